@@ -0,0 +1,145 @@
+#include "rvcc.h"
+
+// rvcc-bench: compiles each input several times in-process and reports the best time
+// of every phase, with throughput in MB/s of source and tokens/s. Comparing a small
+// input against large ones shows phases that do not scale linearly. The inputs go
+// through compile_source(), the pipeline and options of rvcc itself, and the phases
+// are timed by -ftime-report.
+
+static int opt_iters = 5;
+// fail when an input is compiled this many times slower per byte than the first one
+static double opt_max_slowdown;
+
+static char *read_input(const char *path, size_t *len) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        error("cannot open %s", path);
+    }
+    fseek(fp, 0, SEEK_END);
+    *len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *buf = malloc(*len + 1);
+    if (fread(buf, 1, *len, fp) != *len) {
+        error("cannot read %s", path);
+    }
+    buf[*len] = '\0';
+    fclose(fp);
+    return buf;
+}
+
+static int count_tokens(Token *tok) {
+    int n = 0;
+    for (; tok->kind != TK_EOF; tok = tok->next) {
+        n++;
+    }
+    return n;
+}
+
+// Best time of each phase over all iterations, returns the total of the bests
+static double bench_file(const char *path) {
+    size_t len;
+    char *buf = read_input(path, &len);
+
+    set_current_source((SourceFile){(char *)path, buf});
+    int num_tokens = count_tokens(tokenize(buf));
+    arena_reset();
+
+    double best[NUM_PHASES];
+    for (int i = 0; i < opt_iters; i++) {
+        double start[NUM_PHASES];
+        for (int p = 0; p < NUM_PHASES; p++) {
+            start[p] = report_phase_wall(p);
+        }
+        size_t out_len;
+        char *out = compile_source(buf, &out_len);
+        if (out == NULL) {
+            error("cannot compile %s", path);
+        }
+        heap_free(out);
+
+        for (int p = 0; p < NUM_PHASES; p++) {
+            double t = report_phase_wall(p) - start[p];
+            if (i == 0 || t < best[p]) {
+                best[p] = t;
+            }
+        }
+    }
+
+    double mb    = len / 1e6;
+    double total = 0;
+    printf("%s: %.2f MB, %d tokens\n", path, mb, num_tokens);
+    for (int p = 0; p < NUM_PHASES; p++) {
+        // phases the options leave out
+        if (best[p] == 0) {
+            continue;
+        }
+        total += best[p];
+        printf("  %-10s %9.3f ms %9.1f MB/s %12.0f tokens/s\n", report_phase_name(p),
+               best[p] * 1e3, mb / best[p], num_tokens / best[p]);
+    }
+    printf("  %-10s %9.3f ms %9.1f MB/s %12.0f tokens/s\n", "total", total * 1e3, mb / total,
+           num_tokens / total);
+    free(buf);
+    return total / len;
+}
+
+static void usage(int status) {
+    fprintf(stderr, "usage: rvcc-bench [-n <iterations>] [-O0 | -O1 | -O] [-fir-backend] "
+                    "[-fcodegen-threads=<n>] [--max-slowdown=<factor>] <file>...\n");
+    exit(status);
+}
+
+int main(int argc, char **argv) {
+    int num_files = 0;
+    double first  = 0;
+    bool slow     = false;
+    report_set_time(true);
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--help")) {
+            usage(0);
+        }
+        if (!strcmp(argv[i], "-n")) {
+            if (++i == argc || (opt_iters = atoi(argv[i])) < 1) {
+                usage(1);
+            }
+            continue;
+        }
+        if (!strcmp(argv[i], "-O0") || !strcmp(argv[i], "-O1") || !strcmp(argv[i], "-O")) {
+            set_opt_level(&g_opts, strcmp(argv[i], "-O0") != 0);
+            continue;
+        }
+        if (!strcmp(argv[i], "-fir-backend")) {
+            g_opts.ir_backend = true;
+            continue;
+        }
+        if (!strncmp(argv[i], "-fcodegen-threads=", 18)) {
+            g_opts.codegen_threads = atoi(argv[i] + 18);
+            continue;
+        }
+        if (!strncmp(argv[i], "--max-slowdown=", 15)) {
+            opt_max_slowdown = atof(argv[i] + 15);
+            continue;
+        }
+        if (argv[i][0] == '-') {
+            usage(1);
+        }
+
+        double per_byte = bench_file(argv[i]);
+        if (num_files++ == 0) {
+            first = per_byte;
+        } else if (first > 0) {
+            printf("  %.2fx the time per byte of the first input\n", per_byte / first);
+            if (opt_max_slowdown > 0 && per_byte > first * opt_max_slowdown) {
+                slow = true;
+            }
+        }
+    }
+    if (num_files == 0) {
+        usage(1);
+    }
+    if (slow) {
+        fprintf(stderr, "rvcc-bench: compile time grows faster than the input\n");
+        return 1;
+    }
+    return 0;
+}
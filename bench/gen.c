@@ -0,0 +1,270 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// rvcc-gen: writes a random but valid program in rvcc's dialect. The shape is set by
+// the number of functions, locals per function, expression depth, statements per
+// function and loop nesting. Function k only calls function k-1 and every loop runs
+// a fixed number of times, so the programs also terminate when run. The output is
+// plain C as well, a host compiler gives the expected exit code.
+
+static int opt_funcs  = 10;
+static int opt_locals = 4;
+static int opt_depth  = 3;
+static int opt_stmts  = 8;
+static int opt_loops  = 1;
+static int opt_seed   = 1;
+
+#define NUM_PARAMS 2
+#define LOOP_TRIPS 3
+
+static FILE *s_out;
+static uint32_t s_rand;
+static int s_indent;
+
+// xorshift32, the same seed gives the same program everywhere
+static uint32_t next_rand(void) {
+    s_rand ^= s_rand << 13;
+    s_rand ^= s_rand >> 17;
+    s_rand ^= s_rand << 5;
+    return s_rand;
+}
+
+static int rand_below(int n) { return next_rand() % n; }
+
+static void out(const char *fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+    vfprintf(s_out, fmt, va);
+    va_end(va);
+}
+
+static void indent(void) { fprintf(s_out, "%*s", s_indent * 4, ""); }
+
+static void line(const char *fmt, ...) {
+    indent();
+    va_list va;
+    va_start(va, fmt);
+    vfprintf(s_out, fmt, va);
+    va_end(va);
+    fputc('\n', s_out);
+}
+
+static void gen_leaf(void) {
+    switch (rand_below(3)) {
+        case 0:
+            out("v%d", rand_below(opt_locals));
+            break;
+        case 1:
+            out("p%d", rand_below(NUM_PARAMS));
+            break;
+        default:
+            out("%d", rand_below(100));
+            break;
+    }
+}
+
+static const char *binary_ops[] = {"+",  "-",  "*",  "&",  "|",  "^", "<",
+                                   "<=", ">",  ">=", "==", "!=", "&&", "||"};
+static const char *unary_ops[] = {"-", "!", "~"};
+// shifts and division only by constants keep the result defined
+static const char *const_ops[] = {"<<", ">>", "/", "%"};
+
+#define NUM_BINARY_OPS (int)(sizeof(binary_ops) / sizeof(*binary_ops))
+#define NUM_UNARY_OPS  (int)(sizeof(unary_ops) / sizeof(*unary_ops))
+
+static void gen_expr(int depth) {
+    if (depth == 0) {
+        gen_leaf();
+        return;
+    }
+
+    int kind = rand_below(10);
+    out("(");
+    if (kind == 0) {
+        out("%s", unary_ops[rand_below(NUM_UNARY_OPS)]);
+        gen_expr(depth - 1);
+    } else if (kind == 1) {
+        gen_expr(depth - 1);
+        out(" %s %d", const_ops[rand_below(4)], rand_below(7) + 1);
+    } else {
+        gen_expr(depth - 1);
+        out(" %s ", binary_ops[rand_below(NUM_BINARY_OPS)]);
+        gen_expr(rand_below(depth));
+    }
+    out(")");
+}
+
+static void gen_assign(void) {
+    indent();
+    int v = rand_below(opt_locals);
+    if (rand_below(4) == 0) {
+        out("*&v%d = ", v);
+    } else {
+        out("v%d = ", v);
+    }
+    gen_expr(opt_depth);
+    out(";\n");
+}
+
+static void gen_if(void) {
+    indent();
+    out("if (");
+    gen_expr(opt_depth);
+    out(") {\n");
+    s_indent++;
+    gen_assign();
+    s_indent--;
+    line("} else {");
+    s_indent++;
+    gen_assign();
+    s_indent--;
+    line("}");
+}
+
+// Nest of for and while loops, the counters i0.. are declared by the function
+static void gen_loop(int level) {
+    if (level == opt_loops) {
+        gen_assign();
+        if (rand_below(2)) {
+            gen_if();
+        }
+        return;
+    }
+    if (rand_below(2)) {
+        line("for (i%d = 0; i%d < %d; i%d = i%d + 1) {", level, level, LOOP_TRIPS, level, level);
+        s_indent++;
+        gen_loop(level + 1);
+        s_indent--;
+        line("}");
+    } else {
+        line("i%d = 0;", level);
+        line("while (i%d < %d) {", level, LOOP_TRIPS);
+        s_indent++;
+        gen_loop(level + 1);
+        line("i%d = i%d + 1;", level, level);
+        s_indent--;
+        line("}");
+    }
+}
+
+static void gen_stmt(void) {
+    switch (rand_below(4)) {
+        case 0:
+            gen_if();
+            break;
+        case 1:
+            if (opt_loops > 0) {
+                gen_loop(0);
+                break;
+            }
+            // fallthrough
+        default:
+            gen_assign();
+            break;
+    }
+}
+
+static void gen_function(int k) {
+    out("int f%d(int p0, int p1) {\n", k);
+    s_indent = 1;
+    for (int i = 0; i < opt_locals; i++) {
+        line("int v%d = %d;", i, rand_below(100));
+    }
+    for (int i = 0; i < opt_loops; i++) {
+        line("int i%d;", i);
+    }
+    for (int i = 0; i < opt_stmts; i++) {
+        gen_stmt();
+    }
+    if (k > 0) {
+        indent();
+        out("v0 = v0 + f%d(", k - 1);
+        gen_expr(opt_depth);
+        out(", v%d);\n", rand_below(opt_locals));
+    }
+    indent();
+    out("return ");
+    gen_expr(opt_depth);
+    out(";\n");
+    out("}\n\n");
+}
+
+static void usage(int status) {
+    fprintf(stderr, "usage: rvcc-gen [--funcs N] [--locals N] [--depth N] [--stmts N] [--loops N]\n"
+                    "                [--seed N] [-o <path>]\n");
+    exit(status);
+}
+
+// --name=N or --name N
+static bool int_opt(int argc, char **argv, int *i, const char *name, int *val) {
+    size_t n = strlen(name);
+    if (strncmp(argv[*i], name, n) != 0) {
+        return false;
+    }
+    const char *arg;
+    if (argv[*i][n] == '=') {
+        arg = argv[*i] + n + 1;
+    } else if (argv[*i][n] == '\0' && *i + 1 < argc) {
+        arg = argv[++*i];
+    } else {
+        return false;
+    }
+    char *end;
+    long v = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || v < 0 || v > 1000000) {
+        fprintf(stderr, "rvcc-gen: invalid value for %s: %s\n", name, arg);
+        usage(1);
+    }
+    *val = v;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--help")) {
+            usage(0);
+        }
+        if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            path = argv[++i];
+            continue;
+        }
+        if (int_opt(argc, argv, &i, "--funcs", &opt_funcs) ||
+            int_opt(argc, argv, &i, "--locals", &opt_locals) ||
+            int_opt(argc, argv, &i, "--depth", &opt_depth) ||
+            int_opt(argc, argv, &i, "--stmts", &opt_stmts) ||
+            int_opt(argc, argv, &i, "--loops", &opt_loops) ||
+            int_opt(argc, argv, &i, "--seed", &opt_seed)) {
+            continue;
+        }
+        usage(1);
+    }
+    if (opt_funcs < 1 || opt_locals < 1) {
+        fprintf(stderr, "rvcc-gen: need at least one function and one local\n");
+        return 1;
+    }
+
+    s_out = stdout;
+    if (path != NULL && (s_out = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "rvcc-gen: cannot open %s\n", path);
+        return 1;
+    }
+    // xorshift gets stuck at 0
+    s_rand = opt_seed ? opt_seed : 1;
+
+    for (int k = 0; k < opt_funcs; k++) {
+        gen_function(k);
+    }
+    out("int main() {\n");
+    out("    return f%d(%d, %d);\n", opt_funcs - 1, rand_below(100), rand_below(100));
+    out("}\n");
+
+    if (s_out != stdout) {
+        fclose(s_out);
+    }
+    return 0;
+}
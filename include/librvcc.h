@@ -0,0 +1,58 @@
+#ifndef LIBRVCC_H
+#define LIBRVCC_H
+
+// librvcc: the rvcc compiler as a library. Programs are compiled from memory into
+// memory; nothing is read from or written to files.
+//
+// A context holds the options of the compilations made with it and does not change
+// after rvcc_create(), so any number of threads may compile with one context at once.
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RVCC_API __attribute__((visibility("default")))
+
+typedef struct RvccContext RvccContext;
+
+typedef struct {
+    // 0 or 1, like -O0 and -O1
+    int opt_level;
+    // generate code from the IR, like -fir-backend
+    bool ir_backend;
+    // explanatory comments in the assembly, like -fverbose-asm
+    bool verbose_asm;
+    // threads generating the functions of one program, 0 and 1 use none
+    int codegen_threads;
+    // Memory for everything a compilation allocates, the output included; malloc and
+    // free if alloc is NULL. Only the text of a diagnostic is formatted in memory of the
+    // C library. Called from several threads with codegen_threads > 1.
+    void *(*alloc)(void *user, size_t size);
+    void (*free)(void *user, void *ptr);
+    void *alloc_user;
+    // Called with every diagnostic, a complete message with its newlines; they go to
+    // stderr if diagnostic is NULL
+    void (*diagnostic)(void *user, const char *msg);
+    void *diagnostic_user;
+} RvccOptions;
+
+// opts NULL is the same as all fields zero. Returns NULL if out of memory, or if only
+// one of alloc and free is set.
+RVCC_API RvccContext *rvcc_create(const RvccOptions *opts);
+RVCC_API void rvcc_destroy(RvccContext *ctx);
+
+// Compile the program src of len bytes. Returns 0 and sets *out to the NUL-terminated
+// assembly of *out_len bytes, to be released with rvcc_free(). Returns -1 if the
+// program has errors, they have been passed to the diagnostic callback.
+RVCC_API int rvcc_compile(RvccContext *ctx, const char *src, size_t len, char **out,
+                          size_t *out_len);
+RVCC_API void rvcc_free(RvccContext *ctx, void *ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,982 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// rvcc-sim: assembles the subset of RV32IM assembly rvcc emits and interprets it.
+// Every instruction takes one cycle. The in-order pipeline model adds a stall when an
+// instruction reads the result of the load right before it, a flush for each taken
+// branch or jump, and extra latency for mul and div; all of them can be set on the
+// command line. The exit code is the low byte of main's return value, --stats prints
+// the counters and a per function breakdown (self cost) to stderr.
+
+#define MEM_SIZE  (8 << 20)
+#define TEXT_BASE 0x10000000u
+#define EXIT_ADDR 0x0ffffff0u
+
+typedef enum {
+    OP_LUI,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_MULH,
+    OP_MULHU,
+    OP_MULHSU,
+    OP_DIV,
+    OP_DIVU,
+    OP_REM,
+    OP_REMU,
+    OP_AND,
+    OP_OR,
+    OP_XOR,
+    OP_SLL,
+    OP_SRL,
+    OP_SRA,
+    OP_SLT,
+    OP_SLTU,
+    OP_ADDI,
+    OP_ANDI,
+    OP_ORI,
+    OP_XORI,
+    OP_SLLI,
+    OP_SRLI,
+    OP_SRAI,
+    OP_SLTI,
+    OP_SLTIU,
+    OP_LB,
+    OP_LH,
+    OP_LW,
+    OP_LBU,
+    OP_LHU,
+    OP_SB,
+    OP_SH,
+    OP_SW,
+    OP_BEQ,
+    OP_BNE,
+    OP_BLT,
+    OP_BGE,
+    OP_BLTU,
+    OP_BGEU,
+    OP_JAL,
+    OP_JALR,
+} Opcode;
+
+typedef struct {
+    Opcode op;
+    int rd;
+    int rs1;
+    int rs2;
+    int32_t imm;
+    // branch/jump target label, resolved after the whole file is read
+    char *label;
+    int target;
+    // `li` with a large immediate expands to lui + addi
+    int size;
+    int func;
+    int line;
+} Inst;
+
+typedef struct {
+    char *name;
+    int index;
+} Label;
+
+typedef struct {
+    char *name;
+    long insts;
+    long cycles;
+    long calls;
+} FuncStats;
+
+static Inst *s_insts;
+static int s_n_insts;
+static int s_cap_insts;
+
+static Label *s_labels;
+static int s_n_labels;
+static int s_cap_labels;
+
+static FuncStats *s_funcs;
+static int s_n_funcs;
+
+static const char *s_path = "<stdin>";
+static int s_line;
+
+// pipeline model
+static int s_load_use   = 1;
+static int s_branch     = 2;
+static int s_mul_lat    = 2;
+static int s_div_lat    = 32;
+static long s_max_steps = 1000000000L;
+
+static void fatal(const char *fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+    fprintf(stderr, "rvcc-sim: %s:%d: ", s_path, s_line);
+    vfprintf(stderr, fmt, va);
+    fprintf(stderr, "\n");
+    va_end(va);
+    exit(255);
+}
+
+static const char *reg_names[] = {
+    "zero", "ra", "sp", "gp", "tp",  "t0",  "t1", "t2", "s0", "s1", "a0",
+    "a1",   "a2", "a3", "a4", "a5",  "a6",  "a7", "s2", "s3", "s4", "s5",
+    "s6",   "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6",
+};
+
+static int parse_reg(const char *s) {
+    if (!strcmp(s, "fp")) {
+        return 8;
+    }
+    for (int i = 0; i < 32; i++) {
+        if (!strcmp(s, reg_names[i])) {
+            return i;
+        }
+    }
+    if (s[0] == 'x' && isdigit((unsigned char)s[1])) {
+        int r = atoi(s + 1);
+        if (r >= 0 && r < 32) {
+            return r;
+        }
+    }
+    fatal("unknown register '%s'", s);
+    return -1;
+}
+
+static int32_t parse_imm(const char *s) {
+    char *end;
+    long long v = strtoll(s, &end, 0);
+    if (*s == '\0' || *end != '\0') {
+        fatal("invalid immediate '%s'", s);
+    }
+    return (int32_t)v;
+}
+
+// "off(reg)"
+static void parse_mem(const char *s, int32_t *imm, int *reg) {
+    const char *lp = strchr(s, '(');
+    const char *rp = strchr(s, ')');
+    if (lp == NULL || rp == NULL || rp < lp) {
+        fatal("invalid memory operand '%s'", s);
+    }
+    char buf[64];
+    int n = lp - s;
+    if (n >= (int)sizeof(buf) || rp - lp - 1 >= (int)sizeof(buf)) {
+        fatal("invalid memory operand '%s'", s);
+    }
+    memcpy(buf, s, n);
+    buf[n] = '\0';
+    *imm   = n == 0 ? 0 : parse_imm(buf);
+    n      = rp - lp - 1;
+    memcpy(buf, lp + 1, n);
+    buf[n] = '\0';
+    *reg   = parse_reg(buf);
+}
+
+static uint32_t hash_label(const char *s) {
+    uint32_t hash = 2166136261u;
+    for (; *s; s++) {
+        hash ^= (unsigned char)*s;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Bucket of name in the open addressing label table, empty if it is not there
+static Label *label_bucket(const char *name) {
+    for (uint32_t i = hash_label(name);; i++) {
+        Label *l = &s_labels[i & (s_cap_labels - 1)];
+        if (l->name == NULL || !strcmp(l->name, name)) {
+            return l;
+        }
+    }
+}
+
+static void add_label(const char *name) {
+    // keep the table at most half full
+    if (s_n_labels * 2 >= s_cap_labels) {
+        Label *old   = s_labels;
+        int old_cap  = s_cap_labels;
+        s_cap_labels = s_cap_labels ? s_cap_labels * 2 : 64;
+        s_labels     = calloc(s_cap_labels, sizeof(Label));
+        for (int i = 0; i < old_cap; i++) {
+            if (old[i].name != NULL) {
+                *label_bucket(old[i].name) = old[i];
+            }
+        }
+        free(old);
+    }
+    Label *l = label_bucket(name);
+    if (l->name != NULL) {
+        fatal("duplicate label '%s'", name);
+    }
+    l->name  = strdup(name);
+    l->index = s_n_insts;
+    s_n_labels++;
+}
+
+static int find_label(const char *name) {
+    if (s_cap_labels == 0) {
+        return -1;
+    }
+    Label *l = label_bucket(name);
+    return l->name ? l->index : -1;
+}
+
+static Inst *new_inst(Opcode op) {
+    if (s_n_insts == s_cap_insts) {
+        s_cap_insts = s_cap_insts ? s_cap_insts * 2 : 256;
+        s_insts     = realloc(s_insts, sizeof(Inst) * s_cap_insts);
+    }
+    Inst *in = &s_insts[s_n_insts++];
+    memset(in, 0, sizeof(Inst));
+    in->op   = op;
+    in->size = 1;
+    in->func = s_n_funcs - 1;
+    in->line = s_line;
+    return in;
+}
+
+static void add_func(const char *name) {
+    s_funcs = realloc(s_funcs, sizeof(FuncStats) * (s_n_funcs + 1));
+    memset(&s_funcs[s_n_funcs], 0, sizeof(FuncStats));
+    s_funcs[s_n_funcs].name = strdup(name);
+    s_n_funcs++;
+}
+
+typedef struct {
+    const char *name;
+    Opcode op;
+} OpName;
+
+static const OpName rtype[] = {
+    {"add", OP_ADD},     {"sub", OP_SUB},       {"mul", OP_MUL}, {"mulh", OP_MULH},
+    {"mulhu", OP_MULHU}, {"mulhsu", OP_MULHSU}, {"div", OP_DIV}, {"divu", OP_DIVU},
+    {"rem", OP_REM},     {"remu", OP_REMU},     {"and", OP_AND}, {"or", OP_OR},
+    {"xor", OP_XOR},     {"sll", OP_SLL},       {"srl", OP_SRL}, {"sra", OP_SRA},
+    {"slt", OP_SLT},     {"sltu", OP_SLTU},
+};
+
+static const OpName itype[] = {
+    {"addi", OP_ADDI}, {"andi", OP_ANDI}, {"ori", OP_ORI},   {"xori", OP_XORI},  {"slli", OP_SLLI},
+    {"srli", OP_SRLI}, {"srai", OP_SRAI}, {"slti", OP_SLTI}, {"sltiu", OP_SLTIU},
+};
+
+static const OpName mtype[] = {
+    {"lb", OP_LB},   {"lh", OP_LH}, {"lw", OP_LW}, {"lbu", OP_LBU},
+    {"lhu", OP_LHU}, {"sb", OP_SB}, {"sh", OP_SH}, {"sw", OP_SW},
+};
+
+static const OpName btype[] = {
+    {"beq", OP_BEQ}, {"bne", OP_BNE},   {"blt", OP_BLT},
+    {"bge", OP_BGE}, {"bltu", OP_BLTU}, {"bgeu", OP_BGEU},
+};
+
+static int lookup(const OpName *tab, int n, const char *name) {
+    for (int i = 0; i < n; i++) {
+        if (!strcmp(tab[i].name, name)) {
+            return tab[i].op;
+        }
+    }
+    return -1;
+}
+
+#define LOOKUP(tab, name) lookup(tab, sizeof(tab) / sizeof(*tab), name)
+
+static void expect_args(const char *mn, int argc, int n) {
+    if (argc != n) {
+        fatal("'%s' expects %d operands, got %d", mn, n, argc);
+    }
+}
+
+static void branch(Opcode op, int rs1, int rs2, const char *label) {
+    Inst *in  = new_inst(op);
+    in->rs1   = rs1;
+    in->rs2   = rs2;
+    in->label = strdup(label);
+}
+
+static void jump(int rd, const char *label) {
+    Inst *in  = new_inst(OP_JAL);
+    in->rd    = rd;
+    in->label = strdup(label);
+}
+
+static void assemble_inst(const char *mn, char **argv, int argc) {
+    int op;
+    if ((op = LOOKUP(rtype, mn)) >= 0) {
+        expect_args(mn, argc, 3);
+        Inst *in = new_inst(op);
+        in->rd   = parse_reg(argv[0]);
+        in->rs1  = parse_reg(argv[1]);
+        in->rs2  = parse_reg(argv[2]);
+        return;
+    }
+    if ((op = LOOKUP(itype, mn)) >= 0) {
+        expect_args(mn, argc, 3);
+        Inst *in = new_inst(op);
+        in->rd   = parse_reg(argv[0]);
+        in->rs1  = parse_reg(argv[1]);
+        in->imm  = parse_imm(argv[2]);
+        return;
+    }
+    if ((op = LOOKUP(mtype, mn)) >= 0) {
+        expect_args(mn, argc, 2);
+        Inst *in = new_inst(op);
+        if (op >= OP_SB) {
+            in->rs2 = parse_reg(argv[0]);
+        } else {
+            in->rd = parse_reg(argv[0]);
+        }
+        parse_mem(argv[1], &in->imm, &in->rs1);
+        return;
+    }
+    if ((op = LOOKUP(btype, mn)) >= 0) {
+        expect_args(mn, argc, 3);
+        branch(op, parse_reg(argv[0]), parse_reg(argv[1]), argv[2]);
+        return;
+    }
+
+    // pseudo instructions
+    if (!strcmp(mn, "bgt") || !strcmp(mn, "ble") || !strcmp(mn, "bgtu") || !strcmp(mn, "bleu")) {
+        expect_args(mn, argc, 3);
+        Opcode bop = !strcmp(mn, "bgt") ? OP_BLT : !strcmp(mn, "ble") ? OP_BGE
+                   : !strcmp(mn, "bgtu") ? OP_BLTU : OP_BGEU;
+        branch(bop, parse_reg(argv[1]), parse_reg(argv[0]), argv[2]);
+        return;
+    }
+    if (!strcmp(mn, "beqz") || !strcmp(mn, "bnez") || !strcmp(mn, "bltz") ||
+        !strcmp(mn, "bgez")) {
+        expect_args(mn, argc, 2);
+        Opcode bop = !strcmp(mn, "beqz") ? OP_BEQ : !strcmp(mn, "bnez") ? OP_BNE
+                   : !strcmp(mn, "bltz") ? OP_BLT : OP_BGE;
+        branch(bop, parse_reg(argv[0]), 0, argv[1]);
+        return;
+    }
+    if (!strcmp(mn, "bgtz") || !strcmp(mn, "blez")) {
+        expect_args(mn, argc, 2);
+        branch(!strcmp(mn, "bgtz") ? OP_BLT : OP_BGE, 0, parse_reg(argv[0]), argv[1]);
+        return;
+    }
+    if (!strcmp(mn, "j") || !strcmp(mn, "tail")) {
+        expect_args(mn, argc, 1);
+        jump(0, argv[0]);
+        return;
+    }
+    if (!strcmp(mn, "call") || (!strcmp(mn, "jal") && argc == 1)) {
+        expect_args(mn, argc, 1);
+        jump(1, argv[0]);
+        return;
+    }
+    if (!strcmp(mn, "jal")) {
+        expect_args(mn, argc, 2);
+        jump(parse_reg(argv[0]), argv[1]);
+        return;
+    }
+    if (!strcmp(mn, "ret") || !strcmp(mn, "jr") || !strcmp(mn, "jalr")) {
+        Inst *in = new_inst(OP_JALR);
+        if (!strcmp(mn, "ret")) {
+            expect_args(mn, argc, 0);
+            in->rs1 = 1;
+        } else if (!strcmp(mn, "jr")) {
+            expect_args(mn, argc, 1);
+            in->rs1 = parse_reg(argv[0]);
+        } else if (argc == 1) {
+            in->rd  = 1;
+            in->rs1 = parse_reg(argv[0]);
+        } else {
+            expect_args(mn, argc, 3);
+            in->rd  = parse_reg(argv[0]);
+            in->rs1 = parse_reg(argv[1]);
+            in->imm = parse_imm(argv[2]);
+        }
+        return;
+    }
+    if (!strcmp(mn, "li")) {
+        expect_args(mn, argc, 2);
+        Inst *in = new_inst(OP_ADDI);
+        in->rd   = parse_reg(argv[0]);
+        in->imm  = parse_imm(argv[1]);
+        if (in->imm < -2048 || in->imm > 2047) {
+            in->size = 2;
+        }
+        return;
+    }
+    if (!strcmp(mn, "lui")) {
+        expect_args(mn, argc, 2);
+        Inst *in = new_inst(OP_LUI);
+        in->rd   = parse_reg(argv[0]);
+        in->imm  = (int32_t)((uint32_t)parse_imm(argv[1]) << 12);
+        return;
+    }
+    if (!strcmp(mn, "nop")) {
+        expect_args(mn, argc, 0);
+        new_inst(OP_ADDI);
+        return;
+    }
+
+    // two register pseudo instructions
+    Opcode pop;
+    bool swap = false;
+    int32_t imm = 0;
+    bool is_imm = false;
+    if (!strcmp(mn, "mv")) {
+        pop    = OP_ADDI;
+        is_imm = true;
+    } else if (!strcmp(mn, "not")) {
+        pop    = OP_XORI;
+        imm    = -1;
+        is_imm = true;
+    } else if (!strcmp(mn, "seqz")) {
+        pop    = OP_SLTIU;
+        imm    = 1;
+        is_imm = true;
+    } else if (!strcmp(mn, "neg")) {
+        pop  = OP_SUB;
+        swap = true;
+    } else if (!strcmp(mn, "snez")) {
+        pop  = OP_SLTU;
+        swap = true;
+    } else if (!strcmp(mn, "sgtz")) {
+        pop  = OP_SLT;
+        swap = true;
+    } else if (!strcmp(mn, "sltz")) {
+        pop = OP_SLT;
+    } else {
+        fatal("unsupported instruction '%s'", mn);
+        return;
+    }
+    expect_args(mn, argc, 2);
+    Inst *in = new_inst(pop);
+    in->rd   = parse_reg(argv[0]);
+    if (is_imm) {
+        in->rs1 = parse_reg(argv[1]);
+        in->imm = imm;
+    } else if (swap) {
+        // op rd, zero, rs
+        in->rs1 = 0;
+        in->rs2 = parse_reg(argv[1]);
+    } else {
+        // op rd, rs, zero
+        in->rs1 = parse_reg(argv[1]);
+        in->rs2 = 0;
+    }
+}
+
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+    char *e = s + strlen(s);
+    while (e > s && isspace((unsigned char)e[-1])) {
+        *--e = '\0';
+    }
+    return s;
+}
+
+static void assemble_line(char *line) {
+    char *hash = strchr(line, '#');
+    if (hash) {
+        *hash = '\0';
+    }
+    char *s = trim(line);
+
+    // labels
+    char *colon;
+    while ((colon = strchr(s, ':')) != NULL) {
+        *colon = '\0';
+        char *name = trim(s);
+        if (*name == '\0' || strpbrk(name, " \t,")) {
+            fatal("invalid label");
+        }
+        add_label(name);
+        if (name[0] != '.') {
+            add_func(name);
+        }
+        s = trim(colon + 1);
+    }
+    if (*s == '\0') {
+        return;
+    }
+
+    // directives
+    if (*s == '.') {
+        return;
+    }
+
+    char *mn = s;
+    while (*s && !isspace((unsigned char)*s)) {
+        s++;
+    }
+    if (*s) {
+        *s++ = '\0';
+    }
+    char *argv[4];
+    int argc = 0;
+    s        = trim(s);
+    while (*s) {
+        if (argc == 4) {
+            fatal("too many operands");
+        }
+        char *comma = strchr(s, ',');
+        if (comma) {
+            *comma = '\0';
+        }
+        argv[argc++] = trim(s);
+        if (!comma) {
+            break;
+        }
+        s = trim(comma + 1);
+    }
+    if (s_n_funcs == 0) {
+        add_func("<top>");
+    }
+    assemble_inst(mn, argv, argc);
+}
+
+static void assemble(FILE *fp) {
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, fp) != -1) {
+        s_line++;
+        assemble_line(line);
+    }
+    free(line);
+
+    for (int i = 0; i < s_n_insts; i++) {
+        Inst *in = &s_insts[i];
+        if (in->label) {
+            s_line     = in->line;
+            in->target = find_label(in->label);
+            if (in->target < 0) {
+                fatal("undefined label '%s'", in->label);
+            }
+        }
+    }
+}
+
+static uint8_t *s_mem;
+
+static uint32_t addr_of(uint32_t addr, int size, const Inst *in) {
+    if (addr > (uint32_t)(MEM_SIZE - size)) {
+        s_line = in->line;
+        fatal("memory access out of range: 0x%08x", addr);
+    }
+    return addr;
+}
+
+static uint32_t load(uint32_t addr, int size, const Inst *in) {
+    addr       = addr_of(addr, size, in);
+    uint32_t v = 0;
+    memcpy(&v, s_mem + addr, size);
+    return v;
+}
+
+static void store(uint32_t addr, uint32_t val, int size, const Inst *in) {
+    addr = addr_of(addr, size, in);
+    memcpy(s_mem + addr, &val, size);
+}
+
+typedef struct {
+    long insts;
+    long cycles;
+    long loads;
+    long stores;
+    long branches;
+    long taken;
+    long jumps;
+    long muls;
+    long divs;
+} Stats;
+
+static bool reads_reg(const Inst *in, int r) {
+    if (r == 0) {
+        return false;
+    }
+    switch (in->op) {
+        case OP_LUI:
+        case OP_JAL:
+            return false;
+        case OP_ADDI:
+        case OP_ANDI:
+        case OP_ORI:
+        case OP_XORI:
+        case OP_SLLI:
+        case OP_SRLI:
+        case OP_SRAI:
+        case OP_SLTI:
+        case OP_SLTIU:
+        case OP_LB:
+        case OP_LH:
+        case OP_LW:
+        case OP_LBU:
+        case OP_LHU:
+        case OP_JALR:
+            return in->rs1 == r;
+        default:
+            return in->rs1 == r || in->rs2 == r;
+    }
+}
+
+static int run(Stats *st) {
+    s_mem = calloc(1, MEM_SIZE);
+    int main_idx = find_label("main");
+    if (main_idx < 0) {
+        fatal("no 'main' label");
+    }
+
+    uint32_t x[32] = {0};
+    x[1]           = EXIT_ADDR;
+    x[2]           = MEM_SIZE - 16;
+    // main(argc = 1, argv), as under a hosted loader
+    x[10]  = 1;
+    x[11]  = MEM_SIZE - 16;
+    int pc = main_idx;
+
+    // register written by the previous load, for load-use stalls
+    int load_rd = 0;
+
+    for (long step = 0;; step++) {
+        if (step >= s_max_steps) {
+            fprintf(stderr, "rvcc-sim: step limit exceeded\n");
+            exit(255);
+        }
+        if (pc < 0 || pc >= s_n_insts) {
+            fprintf(stderr, "rvcc-sim: pc out of range: %d\n", pc);
+            exit(255);
+        }
+        const Inst *in = &s_insts[pc];
+        int next       = pc + 1;
+        int cycles     = in->size;
+
+        if (load_rd && reads_reg(in, load_rd)) {
+            cycles += s_load_use;
+        }
+        load_rd = 0;
+
+        uint32_t a  = x[in->rs1];
+        uint32_t b  = x[in->rs2];
+        int32_t sa  = (int32_t)a;
+        int32_t sb  = (int32_t)b;
+        uint32_t r  = 0;
+        bool wb     = true;
+        bool taken  = false;
+
+        switch (in->op) {
+            case OP_LUI:
+                r = in->imm;
+                break;
+            case OP_ADD:
+                r = a + b;
+                break;
+            case OP_SUB:
+                r = a - b;
+                break;
+            case OP_MUL:
+                r = a * b;
+                break;
+            case OP_MULH:
+                r = (uint32_t)(((int64_t)sa * (int64_t)sb) >> 32);
+                break;
+            case OP_MULHU:
+                r = (uint32_t)(((uint64_t)a * (uint64_t)b) >> 32);
+                break;
+            case OP_MULHSU:
+                r = (uint32_t)(((int64_t)sa * (int64_t)(uint64_t)b) >> 32);
+                break;
+            case OP_DIV:
+                r = sb == 0 ? 0xffffffffu : (sa == INT32_MIN && sb == -1) ? (uint32_t)sa
+                                                                          : (uint32_t)(sa / sb);
+                break;
+            case OP_DIVU:
+                r = b == 0 ? 0xffffffffu : a / b;
+                break;
+            case OP_REM:
+                r = sb == 0 ? a : (sa == INT32_MIN && sb == -1) ? 0 : (uint32_t)(sa % sb);
+                break;
+            case OP_REMU:
+                r = b == 0 ? a : a % b;
+                break;
+            case OP_AND:
+                r = a & b;
+                break;
+            case OP_OR:
+                r = a | b;
+                break;
+            case OP_XOR:
+                r = a ^ b;
+                break;
+            case OP_SLL:
+                r = a << (b & 31);
+                break;
+            case OP_SRL:
+                r = a >> (b & 31);
+                break;
+            case OP_SRA:
+                r = (uint32_t)(sa >> (b & 31));
+                break;
+            case OP_SLT:
+                r = sa < sb;
+                break;
+            case OP_SLTU:
+                r = a < b;
+                break;
+            case OP_ADDI:
+                r = a + (uint32_t)in->imm;
+                break;
+            case OP_ANDI:
+                r = a & (uint32_t)in->imm;
+                break;
+            case OP_ORI:
+                r = a | (uint32_t)in->imm;
+                break;
+            case OP_XORI:
+                r = a ^ (uint32_t)in->imm;
+                break;
+            case OP_SLLI:
+                r = a << (in->imm & 31);
+                break;
+            case OP_SRLI:
+                r = a >> (in->imm & 31);
+                break;
+            case OP_SRAI:
+                r = (uint32_t)(sa >> (in->imm & 31));
+                break;
+            case OP_SLTI:
+                r = sa < in->imm;
+                break;
+            case OP_SLTIU:
+                r = a < (uint32_t)in->imm;
+                break;
+            case OP_LB:
+                r = (uint32_t)(int8_t)load(a + in->imm, 1, in);
+                break;
+            case OP_LH:
+                r = (uint32_t)(int16_t)load(a + in->imm, 2, in);
+                break;
+            case OP_LW:
+                r = load(a + in->imm, 4, in);
+                break;
+            case OP_LBU:
+                r = load(a + in->imm, 1, in);
+                break;
+            case OP_LHU:
+                r = load(a + in->imm, 2, in);
+                break;
+            case OP_SB:
+                store(a + in->imm, b, 1, in);
+                wb = false;
+                break;
+            case OP_SH:
+                store(a + in->imm, b, 2, in);
+                wb = false;
+                break;
+            case OP_SW:
+                store(a + in->imm, b, 4, in);
+                wb = false;
+                break;
+            case OP_BEQ:
+                taken = a == b;
+                wb = false;
+                break;
+            case OP_BNE:
+                taken = a != b;
+                wb = false;
+                break;
+            case OP_BLT:
+                taken = sa < sb;
+                wb = false;
+                break;
+            case OP_BGE:
+                taken = sa >= sb;
+                wb = false;
+                break;
+            case OP_BLTU:
+                taken = a < b;
+                wb = false;
+                break;
+            case OP_BGEU:
+                taken = a >= b;
+                wb = false;
+                break;
+            case OP_JAL:
+                r     = TEXT_BASE + 4 * (pc + 1);
+                next  = in->target;
+                taken = true;
+                break;
+            case OP_JALR: {
+                uint32_t dst = (a + in->imm) & ~1u;
+                r            = TEXT_BASE + 4 * (pc + 1);
+                taken        = true;
+                if (dst == EXIT_ADDR) {
+                    next = -1;
+                } else {
+                    if (dst < TEXT_BASE || (dst - TEXT_BASE) % 4 != 0) {
+                        fprintf(stderr, "rvcc-sim: invalid jump target 0x%08x\n", dst);
+                        exit(255);
+                    }
+                    next = (dst - TEXT_BASE) / 4;
+                }
+                break;
+            }
+        }
+
+        if (wb && in->rd != 0) {
+            x[in->rd] = r;
+        }
+
+        switch (in->op) {
+            case OP_LB:
+            case OP_LH:
+            case OP_LW:
+            case OP_LBU:
+            case OP_LHU:
+                st->loads++;
+                load_rd = in->rd;
+                break;
+            case OP_SB:
+            case OP_SH:
+            case OP_SW:
+                st->stores++;
+                break;
+            case OP_BEQ:
+            case OP_BNE:
+            case OP_BLT:
+            case OP_BGE:
+            case OP_BLTU:
+            case OP_BGEU:
+                st->branches++;
+                if (taken) {
+                    next = in->target;
+                    st->taken++;
+                    cycles += s_branch;
+                }
+                break;
+            case OP_JAL:
+            case OP_JALR:
+                st->jumps++;
+                cycles += s_branch;
+                if (in->op == OP_JAL && in->rd == 1) {
+                    s_funcs[s_insts[in->target].func].calls++;
+                }
+                break;
+            case OP_MUL:
+            case OP_MULH:
+            case OP_MULHU:
+            case OP_MULHSU:
+                st->muls++;
+                cycles += s_mul_lat;
+                break;
+            case OP_DIV:
+            case OP_DIVU:
+            case OP_REM:
+            case OP_REMU:
+                st->divs++;
+                cycles += s_div_lat;
+                break;
+            default:
+                break;
+        }
+
+        st->insts += in->size;
+        st->cycles += cycles;
+        s_funcs[in->func].insts += in->size;
+        s_funcs[in->func].cycles += cycles;
+
+        if (next < 0) {
+            break;
+        }
+        pc = next;
+    }
+    return x[10] & 0xff;
+}
+
+static void print_stats(const Stats *st) {
+    fprintf(stderr, "instructions: %ld\n", st->insts);
+    fprintf(stderr, "cycles:       %ld\n", st->cycles);
+    fprintf(stderr, "loads:        %ld\n", st->loads);
+    fprintf(stderr, "stores:       %ld\n", st->stores);
+    fprintf(stderr, "branches:     %ld (taken %ld)\n", st->branches, st->taken);
+    fprintf(stderr, "jumps:        %ld\n", st->jumps);
+    fprintf(stderr, "mul/div:      %ld/%ld\n", st->muls, st->divs);
+    fprintf(stderr, "%-24s %12s %12s %8s\n", "function", "insts", "cycles", "calls");
+    for (int i = 0; i < s_n_funcs; i++) {
+        FuncStats *f = &s_funcs[i];
+        fprintf(stderr, "%-24s %12ld %12ld %8ld\n", f->name, f->insts, f->cycles, f->calls);
+    }
+}
+
+static void usage(int status) {
+    fprintf(stderr,
+            "usage: rvcc-sim [--stats] [--load-use=N] [--branch-penalty=N] [--mul-latency=N]\n"
+            "                [--div-latency=N] [--max-steps=N] [file.s]\n");
+    exit(status);
+}
+
+static bool int_opt(const char *arg, const char *name, long *val) {
+    size_t n = strlen(name);
+    if (strncmp(arg, name, n) || arg[n] != '=') {
+        return false;
+    }
+    char *end;
+    *val = strtol(arg + n + 1, &end, 10);
+    if (arg[n + 1] == '\0' || *end != '\0' || *val < 0) {
+        fprintf(stderr, "rvcc-sim: invalid value for %s\n", name);
+        usage(255);
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    bool stats       = false;
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        long v;
+        if (!strcmp(argv[i], "--stats")) {
+            stats = true;
+        } else if (!strcmp(argv[i], "--help")) {
+            usage(0);
+        } else if (int_opt(argv[i], "--load-use", &v)) {
+            s_load_use = v;
+        } else if (int_opt(argv[i], "--branch-penalty", &v)) {
+            s_branch = v;
+        } else if (int_opt(argv[i], "--mul-latency", &v)) {
+            s_mul_lat = v;
+        } else if (int_opt(argv[i], "--div-latency", &v)) {
+            s_div_lat = v;
+        } else if (int_opt(argv[i], "--max-steps", &v)) {
+            s_max_steps = v;
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            usage(255);
+        } else {
+            path = argv[i];
+        }
+    }
+
+    FILE *fp = stdin;
+    if (path && strcmp(path, "-")) {
+        fp = fopen(path, "r");
+        if (fp == NULL) {
+            fprintf(stderr, "rvcc-sim: cannot open %s\n", path);
+            return 255;
+        }
+        s_path = path;
+    }
+    assemble(fp);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+
+    Stats st = {0};
+    int ret  = run(&st);
+    if (stats) {
+        print_stats(&st);
+    }
+    return ret;
+}
@@ -0,0 +1,112 @@
+#include "rvcc.h"
+
+// Bump-pointer arena backing every front-end structure (Token, Node, Type, Object,
+// Function and identifier strings). Nothing is freed individually, the whole
+// compilation is released at once by arena_reset(). Each thread has its own arena.
+
+#define ARENA_CHUNK_SIZE (1 << 16)
+
+typedef struct Chunk Chunk;
+struct Chunk {
+    Chunk *next;
+    _Alignas(max_align_t) char data[];
+};
+
+// every thread allocates from an arena of its own
+static _Thread_local Chunk *s_chunks = NULL;
+static _Thread_local char *s_ptr     = NULL;
+static _Thread_local char *s_end     = NULL;
+static _Thread_local ArenaStats s_stats;
+
+// Memory outside the arena that a compilation needs, the output and the buffers kept
+// by a thread between compilations, comes from the allocator of the options like the
+// chunks. All three are like their C library counterparts, NULL if out of memory.
+void *heap_alloc(size_t size) {
+    if (g_opts.alloc != NULL) {
+        return g_opts.alloc(g_opts.alloc_ctx, size);
+    }
+    return malloc(size);
+}
+
+// The allocator of the options has no realloc, old_size bytes of ptr are copied
+void *heap_realloc(void *ptr, size_t old_size, size_t size) {
+    if (g_opts.alloc == NULL) {
+        return realloc(ptr, size);
+    }
+    void *p = g_opts.alloc(g_opts.alloc_ctx, size);
+    if (p != NULL && ptr != NULL) {
+        memcpy(p, ptr, old_size < size ? old_size : size);
+        g_opts.free(g_opts.alloc_ctx, ptr);
+    }
+    return p;
+}
+
+void heap_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (g_opts.free != NULL) {
+        g_opts.free(g_opts.alloc_ctx, ptr);
+    } else {
+        free(ptr);
+    }
+}
+
+static Chunk *new_chunk(size_t size) {
+    Chunk *chunk = heap_alloc(sizeof(Chunk) + size);
+    if (chunk == NULL) {
+        error("out of memory");
+    }
+    memset(chunk, 0, sizeof(Chunk) + size);
+    chunk->next = s_chunks;
+    s_chunks    = chunk;
+    s_stats.chunks++;
+    s_stats.reserved += size;
+    return chunk;
+}
+
+// Returns zeroed memory, like calloc(1, size)
+void *arena_alloc(size_t size) { return arena_alloc_kind(MEM_OTHER, size); }
+
+void *arena_alloc_kind(MemKind kind, size_t size) {
+    size_t align = _Alignof(max_align_t);
+    size         = (size + align - 1) / align * align;
+    s_stats.allocs++;
+    s_stats.bytes += size;
+    s_stats.kind_allocs[kind]++;
+    s_stats.kind_bytes[kind] += size;
+
+    if ((size_t)(s_end - s_ptr) < size) {
+        // oversized requests get a chunk of their own and keep the current one open
+        if (size > ARENA_CHUNK_SIZE / 4) {
+            return new_chunk(size)->data;
+        }
+        Chunk *chunk = new_chunk(ARENA_CHUNK_SIZE);
+        s_ptr        = chunk->data;
+        s_end        = chunk->data + ARENA_CHUNK_SIZE;
+    }
+
+    void *ptr = s_ptr;
+    s_ptr += size;
+    return ptr;
+}
+
+char *arena_strndup(const char *str, size_t len) {
+    char *s = arena_alloc(len + 1);
+    memcpy(s, str, len);
+    return s;
+}
+
+// Release everything allocated since the last reset
+void arena_reset(void) {
+    while (s_chunks != NULL) {
+        Chunk *next = s_chunks->next;
+        heap_free(s_chunks);
+        s_chunks = next;
+    }
+    s_ptr = NULL;
+    s_end = NULL;
+    memset(&s_stats, 0, sizeof(s_stats));
+}
+
+ArenaStats arena_stats(void) { return s_stats; }
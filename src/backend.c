@@ -0,0 +1,364 @@
+#include "rvcc.h"
+
+// RV32IM instruction selection from the register-allocated IR
+
+static const char *reg_names[32] = {
+    "zero", "ra", "sp", "gp", "tp",  "t0",  "t1", "t2", "fp", "s1", "a0",
+    "a1",   "a2", "a3", "a4", "a5",  "a6",  "a7", "s2", "s3", "s4", "s5",
+    "s6",   "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6",
+};
+static const char *arg_regs[]    = {"a0", "a1", "a2", "a3", "a4", "a5"};
+static const char *unary_insns[] = {[IR_NEG] = "neg", [IR_NOT] = "seqz", [IR_BITNOT] = "not"};
+
+// scratch registers for operands and results living in spill slots
+static const char *scratch_a = "t5";
+static const char *scratch_b = "t6";
+
+// function being generated, on this thread
+static _Thread_local IrFunc *s_fn = NULL;
+// fp offset of spill slot 0
+static _Thread_local int s_slot_offset;
+// a call whose result is returned jumps to the callee; off when the address of a
+// variable may be passed on
+static _Thread_local bool s_tail_calls;
+
+// Offset of the spill slot of vreg from frame_reg()
+static int slot_offset(int vreg) {
+    return frame_offset(s_slot_offset - s_fn->slot[vreg] * REG_BYTES);
+}
+
+static bool is_spilled(int vreg) { return s_fn->reg[vreg] < 0; }
+
+// Register holding vreg, reloaded into scratch if it was spilled
+static const char *use(int vreg, const char *scratch) {
+    if (!is_spilled(vreg)) {
+        return reg_names[s_fn->reg[vreg]];
+    }
+    emit("    lw %s, %d(%s)", scratch, slot_offset(vreg), frame_reg());
+    return scratch;
+}
+
+// Register to compute vreg into, finished by def()
+static const char *dst(int vreg) {
+    return is_spilled(vreg) ? scratch_a : reg_names[s_fn->reg[vreg]];
+}
+
+static void def(int vreg, const char *rd) {
+    if (is_spilled(vreg)) {
+        emit("    sw %s, %d(%s)", rd, slot_offset(vreg), frame_reg());
+    }
+}
+
+static bool is_tail_call(IrInsn *insn) {
+    return s_tail_calls && insn->op == IR_CALL && insn->next != NULL &&
+           insn->next->op == IR_RET && insn->next->a == insn->dst;
+}
+
+// Does the function call another one other than in a tail call, i.e. is ra clobbered
+static bool has_call(IrFunc *fn) {
+    for (BasicBlock *bb = fn->blocks; bb != NULL; bb = bb->next) {
+        for (IrInsn *insn = bb->insns; insn != NULL; insn = insn->next) {
+            if (insn->op == IR_CALL && !is_tail_call(insn)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool has_op(IrFunc *fn, IrOp op) {
+    for (BasicBlock *bb = fn->blocks; bb != NULL; bb = bb->next) {
+        for (IrInsn *insn = bb->insns; insn != NULL; insn = insn->next) {
+            if (insn->op == op) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool has_self_tail_call(IrFunc *fn) {
+    for (BasicBlock *bb = fn->blocks; bb != NULL; bb = bb->next) {
+        for (IrInsn *insn = bb->insns; insn != NULL; insn = insn->next) {
+            if (is_tail_call(insn) && !strcmp(insn->func_name, fn->func->name)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Save or restore the callee-saved registers the function uses, below fp
+static void gen_saved_regs(const char *op) {
+    int offset = 0;
+    for (int r = 0; r < 32; r++) {
+        if (s_fn->saved_regs & (1u << r)) {
+            offset += REG_BYTES;
+            emit("    %s %s, %d(%s)", op, reg_names[r], frame_offset(-offset), frame_reg());
+        }
+    }
+}
+
+static void gen_label(BasicBlock *bb) { emit(".L.%s.%d:", s_fn->func->name, bb->id); }
+
+static void gen_jump(BasicBlock *from, BasicBlock *to) {
+    if (from->next != to) {
+        emit("    j .L.%s.%d", s_fn->func->name, to->id);
+    }
+}
+
+static void gen_args(IrInsn *insn) {
+    for (int i = 0; i < insn->num_args; i++) {
+        int arg = insn->args[i];
+        if (is_spilled(arg)) {
+            emit("    lw %s, %d(%s)", arg_regs[i], slot_offset(arg), frame_reg());
+        } else {
+            emit("    mv %s, %s", arg_regs[i], reg_names[s_fn->reg[arg]]);
+        }
+    }
+}
+
+static void gen_call(IrInsn *insn) {
+    gen_args(insn);
+    emit("    call %s", insn->func_name);
+    if (is_spilled(insn->dst)) {
+        emit("    sw a0, %d(%s)", slot_offset(insn->dst), frame_reg());
+    } else {
+        emit("    mv %s, a0", dst(insn->dst));
+    }
+}
+
+static void gen_binary(IrInsn *insn) {
+    const char *a  = use(insn->a, scratch_a);
+    const char *b  = use(insn->b, scratch_b);
+    const char *rd = dst(insn->dst);
+
+    switch (insn->op) {
+        case IR_ADD:
+            emit("    add %s, %s, %s", rd, a, b);
+            break;
+        case IR_SUB:
+            emit("    sub %s, %s, %s", rd, a, b);
+            break;
+        case IR_MUL:
+            emit("    mul %s, %s, %s", rd, a, b);
+            break;
+        case IR_DIV:
+            emit("    div %s, %s, %s", rd, a, b);
+            break;
+        case IR_MOD:
+            emit("    rem %s, %s, %s", rd, a, b);
+            break;
+        case IR_SHL:
+            emit("    sll %s, %s, %s", rd, a, b);
+            break;
+        case IR_SHR:
+            emit("    sra %s, %s, %s", rd, a, b);
+            break;
+        case IR_AND:
+            emit("    and %s, %s, %s", rd, a, b);
+            break;
+        case IR_OR:
+            emit("    or %s, %s, %s", rd, a, b);
+            break;
+        case IR_XOR:
+            emit("    xor %s, %s, %s", rd, a, b);
+            break;
+        case IR_EQ:
+            emit("    xor %s, %s, %s", rd, a, b);
+            emit("    seqz %s, %s", rd, rd);
+            break;
+        case IR_NE:
+            emit("    xor %s, %s, %s", rd, a, b);
+            emit("    snez %s, %s", rd, rd);
+            break;
+        case IR_LT:
+            emit("    slt %s, %s, %s", rd, a, b);
+            break;
+        case IR_LE:
+            // a <= b is !(b < a)
+            emit("    slt %s, %s, %s", rd, b, a);
+            emit("    xori %s, %s, 1", rd, rd);
+            break;
+        default:
+            error("invalid ir op %d", insn->op);
+    }
+    def(insn->dst, rd);
+}
+
+// Leave the frame and jump to the callee, which returns straight to our caller. The
+// function calling itself jumps back to its first block, a loop.
+static void gen_tail_call(IrInsn *insn) {
+    gen_args(insn);
+    if (!strcmp(insn->func_name, s_fn->func->name)) {
+        emit("    j .L.tail.%s", s_fn->func->name);
+        return;
+    }
+    gen_saved_regs("lw");
+    frame_teardown();
+    emit("    tail %s", insn->func_name);
+}
+
+static void gen_insn(BasicBlock *bb, IrInsn *insn) {
+    const char *rd;
+    const char *a;
+    switch (insn->op) {
+        case IR_IMM:
+            rd = dst(insn->dst);
+            emit("    li %s, %d", rd, insn->imm);
+            def(insn->dst, rd);
+            return;
+        case IR_MOV:
+            a  = use(insn->a, scratch_a);
+            rd = dst(insn->dst);
+            if (rd != a) {
+                emit("    mv %s, %s", rd, a);
+            }
+            def(insn->dst, rd);
+            return;
+        case IR_PARAM:
+            rd = dst(insn->dst);
+            emit("    mv %s, %s", rd, arg_regs[insn->imm]);
+            def(insn->dst, rd);
+            return;
+        case IR_MULI:
+        case IR_DIVI:
+        case IR_MODI:
+            a  = use(insn->a, scratch_a);
+            rd = dst(insn->dst);
+            if (insn->op == IR_MULI) {
+                emit_mul_imm(rd, a, insn->imm);
+            } else if (insn->op == IR_DIVI) {
+                emit_div_imm(rd, a, insn->imm);
+            } else {
+                emit_mod_imm(rd, a, insn->imm);
+            }
+            def(insn->dst, rd);
+            return;
+        case IR_NEG:
+        case IR_NOT:
+        case IR_BITNOT:
+            a  = use(insn->a, scratch_a);
+            rd = dst(insn->dst);
+            emit("    %s %s, %s", unary_insns[insn->op], rd, a);
+            def(insn->dst, rd);
+            return;
+        case IR_ADDR:
+            rd = dst(insn->dst);
+            emit("    addi %s, %s, %d", rd, frame_reg(), frame_offset(insn->var->offset));
+            def(insn->dst, rd);
+            return;
+        case IR_LDVAR:
+            rd = dst(insn->dst);
+            emit_comment("load %s", insn->var->name);
+            emit("    lw %s, %d(%s)", rd, frame_offset(insn->var->offset), frame_reg());
+            def(insn->dst, rd);
+            return;
+        case IR_STVAR:
+            a = use(insn->a, scratch_a);
+            emit_comment("store %s to %s", a, insn->var->name);
+            emit("    sw %s, %d(%s)", a, frame_offset(insn->var->offset), frame_reg());
+            return;
+        case IR_LOAD:
+            a  = use(insn->a, scratch_a);
+            rd = dst(insn->dst);
+            emit("    lw %s, 0(%s)", rd, a);
+            def(insn->dst, rd);
+            return;
+        case IR_STORE:
+            emit("    sw %s, 0(%s)", use(insn->b, scratch_b), use(insn->a, scratch_a));
+            return;
+        case IR_CALL:
+            gen_call(insn);
+            return;
+        case IR_JMP:
+            gen_jump(bb, insn->then);
+            return;
+        case IR_BR: {
+            a             = insn->a ? use(insn->a, scratch_a) : "zero";
+            const char *b = insn->b ? use(insn->b, scratch_b) : "zero";
+            if (bb->next == insn->then) {
+                emit_branch(insn->cmp, true, a, b, ".L.%s.%d", s_fn->func->name, insn->els->id);
+            } else {
+                emit_branch(insn->cmp, false, a, b, ".L.%s.%d", s_fn->func->name, insn->then->id);
+                gen_jump(bb, insn->els);
+            }
+            return;
+        }
+        case IR_RET:
+            if (insn->a) {
+                emit("    mv a0, %s", use(insn->a, scratch_a));
+            }
+            if (bb->next != NULL) {
+                emit("    j .L.return.%s", s_fn->func->name);
+            }
+            return;
+        default:
+            gen_binary(insn);
+            return;
+    }
+}
+
+static void gen_function(void *arg) {
+    IrFunc *fn     = arg;
+    s_fn           = fn;
+    Function *func = fn->func;
+    report_begin(PHASE_REGALLOC);
+    regalloc(fn);
+    report_end();
+
+    // below fp: saved registers, variables left in the frame, spill slots
+    int offset = 0;
+    for (int r = 0; r < 32; r++) {
+        if (fn->saved_regs & (1u << r)) {
+            offset += REG_BYTES;
+        }
+    }
+    for (Object *var = func->locals; var != NULL; var = var->next) {
+        if (var->vreg == 0) {
+            offset += REG_BYTES;
+            var->offset = -offset;
+        }
+    }
+    s_slot_offset    = -offset - REG_BYTES;
+    func->stack_size = offset + fn->num_slots * REG_BYTES;
+
+    s_tail_calls = g_opts.tail_calls && !has_op(fn, IR_ADDR);
+    frame_prologue(func->name, func->stack_size, !has_call(fn));
+    gen_saved_regs("sw");
+    if (has_self_tail_call(fn)) {
+        emit(".L.tail.%s:", func->name);
+    }
+
+    for (BasicBlock *bb = fn->blocks; bb != NULL; bb = bb->next) {
+        if (bb->num_preds > 0) {
+            gen_label(bb);
+        }
+        for (IrInsn *insn = bb->insns; insn != NULL; insn = insn->next) {
+            // the return after a tail call is never reached
+            if (is_tail_call(insn)) {
+                gen_tail_call(insn);
+                break;
+            }
+            gen_insn(bb, insn);
+        }
+    }
+
+    emit(".L.return.%s:", func->name);
+    gen_saved_regs("lw");
+    frame_epilogue();
+    emit_function_end();
+}
+
+void ir_codegen(IrFunc *prog) {
+    int n = 0;
+    for (IrFunc *fn = prog; fn != NULL; fn = fn->next) {
+        n++;
+    }
+    void **funcs = arena_alloc(sizeof(void *) * (n ? n : 1));
+    n            = 0;
+    for (IrFunc *fn = prog; fn != NULL; fn = fn->next) {
+        funcs[n++] = fn;
+    }
+    parallel_codegen(funcs, n, gen_function);
+}
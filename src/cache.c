@@ -0,0 +1,108 @@
+#include "rvcc.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// On-disk cache of the code of single functions for --cache-dir. The key of a function
+// is its tokens, separated by single spaces so that layout changes do not matter, and
+// the options that change the generated code. A file is named by the hash of the key
+// and holds the key itself, so a hash collision is a miss and never wrong code.
+//
+// The cache does not know how the compiler itself changed: bump CACHE_VERSION along
+// with any change to the generated code.
+
+#define CACHE_VERSION 5
+
+// numbers the temporary files of this process
+static atomic_int s_tmp_count;
+
+// 64-bit FNV-1a
+static uint64_t hash_key(const char *key, size_t len) {
+    uint64_t h = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)key[i]) * 0x100000001b3;
+    }
+    return h;
+}
+
+static char *entry_path(const char *key, size_t len) {
+    char *path = arena_alloc(strlen(g_opts.cache_dir) + 18);
+    sprintf(path, "%s/%016llx", g_opts.cache_dir, (unsigned long long)hash_key(key, len));
+    return path;
+}
+
+// The key of the function spelled by the tokens begin..end
+char *cache_key(Token *begin, Token *end, size_t *len) {
+    char opts[64];
+    int n       = snprintf(opts, sizeof(opts), "rvcc-cache %d %d%d%d%d%d%d%d\n", CACHE_VERSION,
+                           g_opts.peephole, g_opts.licm, g_opts.tail_calls, g_opts.comments,
+                           g_opts.omit_fp, g_opts.emit_ir, g_opts.ir_backend);
+    size_t size = n;
+    for (Token *tok = begin;; tok = tok->next) {
+        size += tok->len + 1;
+        if (tok == end) {
+            break;
+        }
+    }
+
+    char *key = arena_alloc(size + 1);
+    memcpy(key, opts, n);
+    char *p = key + n;
+    for (Token *tok = begin;; tok = tok->next) {
+        memcpy(p, tok->loc, tok->len);
+        p += tok->len;
+        *p++ = ' ';
+        if (tok == end) {
+            break;
+        }
+    }
+    *len = size;
+    return key;
+}
+
+// The cached code of key in the arena, NULL if there is none
+char *cache_load(const char *key, size_t key_len, size_t *len) {
+    FILE *fp = fopen(entry_path(key, key_len), "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    char *code = NULL;
+    size_t stored_key_len;
+    size_t code_len;
+    if (fscanf(fp, "%zu %zu", &stored_key_len, &code_len) == 2 && fgetc(fp) == '\n' &&
+        stored_key_len == key_len) {
+        char *stored = arena_alloc(key_len + code_len + 1);
+        if (fread(stored, 1, key_len + code_len, fp) == key_len + code_len &&
+            memcmp(stored, key, key_len) == 0) {
+            code = stored + key_len;
+            *len = code_len;
+        }
+    }
+    fclose(fp);
+    return code;
+}
+
+// Add the code of key to the cache. Any failure just leaves it out; the entry is
+// written to a file of its own and renamed, so concurrent compilers never see half of
+// an entry.
+void cache_save(const char *key, size_t key_len, const char *code, size_t len) {
+    if (mkdir(g_opts.cache_dir, 0755) != 0 && errno != EEXIST) {
+        return;
+    }
+    char *path = entry_path(key, key_len);
+    char *tmp  = arena_alloc(strlen(path) + 32);
+    sprintf(tmp, "%s.%ld.%d", path, (long)getpid(), atomic_fetch_add(&s_tmp_count, 1));
+
+    FILE *fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        return;
+    }
+    fprintf(fp, "%zu %zu\n", key_len, len);
+    bool ok = fwrite(key, 1, key_len, fp) == key_len && fwrite(code, 1, len, fp) == len;
+    if (fclose(fp) != 0 || !ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+    }
+}
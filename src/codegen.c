@@ -1,145 +1,513 @@
 #include "rvcc.h"
 
-// Record stack depth
-static int Depth = 0;
-
 static const char *arg_regs[] = {"a0", "a1", "a2", "a3", "a4", "a5"};
-static Function *s_func       = NULL;
+// Per-function state lives in thread-local storage, functions may be generated on
+// several threads at once
+static _Thread_local Function *s_func = NULL;
+
+// Expression temporaries live in t0-t6, a7 is only used to reload a spilled operand
+static const char *tmp_regs[] = {"t0", "t1", "t2", "t3", "t4", "t5", "t6"};
+static const char *spill_reg  = "a7";
+
+#define NUM_ARG_REGS (int)(sizeof(arg_regs) / sizeof(*arg_regs))
+#define NUM_TMP_REGS (int)(sizeof(tmp_regs) / sizeof(*tmp_regs))
+
+// Number of spill slots in use
+static _Thread_local int s_spill_depth = 0;
+// return statement that falls through into the epilogue
+static _Thread_local Node *s_last_stmt = NULL;
+// Labels are numbered per function and carry its name
+static _Thread_local int s_label_count = 0;
+// return f(...) jumps to f; off when the address of a local may be passed on
+static _Thread_local bool s_tail_calls = false;
 
-static void gen_expr(Node *nd);
+static void gen_expr(Node *nd, int r);
 
-static int align_to(int N, int align) { return (N + align - 1) / align * align; }
+static int max(int a, int b) { return a > b ? a : b; }
 
-static void push() {
-    printf("    # a0 is pressed into a stack\n");
-    printf("    addi sp, sp, %d\n", -REG_BYTES);
-    printf("    sw a0, 0(sp)\n");
-    ++Depth;
+// Offset of spill slot i from frame_reg()
+static int spill_slot(int i) { return frame_offset(s_func->spill_offset - i * REG_BYTES); }
+
+static bool is_tail_call(Node *nd) {
+    return s_tail_calls && nd->kind == ND_RETURN && nd->lhs->kind == ND_FUNCCALL;
 }
 
-static void pop(const char *reg) {
-    printf("    lw %s, 0(sp)\n", reg);
-    printf("    addi sp, sp, %d\n", REG_BYTES);
-    --Depth;
+// Does the subtree call a function, i.e. is ra clobbered
+static bool has_call(Node *nd) {
+    for (; nd != NULL; nd = nd->next) {
+        // a tail call leaves with ra as it came
+        if (is_tail_call(nd)) {
+            if (has_call(nd->lhs->args)) {
+                return true;
+            }
+            continue;
+        }
+        if (nd->kind == ND_FUNCCALL || has_call(nd->lhs) || has_call(nd->rhs) ||
+            has_call(nd->body) || has_call(nd->cond) || has_call(nd->then) ||
+            has_call(nd->els) || has_call(nd->init) || has_call(nd->inc) || has_call(nd->args)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void check_lvalue(Node *nd) {
+    if (nd->kind != ND_VAR && nd->kind != ND_DEREF) {
+        error_tok(nd->tok, "not an lvalue");
+    }
+}
+
+static int binary_need(int lhs, int rhs) { return lhs == rhs ? lhs + 1 : max(lhs, rhs); }
+
+// x * c, x / c and x % c are strength reduced on the register of x
+static bool has_imm_rhs(Node *nd) {
+    return (nd->kind == ND_MUL || nd->kind == ND_DIV || nd->kind == ND_MOD) &&
+           nd->rhs->kind == ND_NUM;
+}
+
+// Label every expression node with its register need
+static int label_expr(Node *nd) {
+    switch (nd->kind) {
+        case ND_NUM:
+        case ND_VAR:
+            nd->reg_need = 1;
+            break;
+        case ND_NEG:
+        case ND_NOT:
+        case ND_BITNOT:
+        case ND_DEREF:
+            nd->reg_need = label_expr(nd->lhs);
+            break;
+        case ND_LOGAND:
+        case ND_LOGOR:
+        case ND_COMMA:
+            // both sides are evaluated into the same register, one after the other
+            nd->reg_need = max(label_expr(nd->lhs), label_expr(nd->rhs));
+            break;
+        case ND_ADDR:
+            check_lvalue(nd->lhs);
+            nd->reg_need = nd->lhs->kind == ND_VAR ? 1 : label_expr(nd->lhs->lhs);
+            break;
+        case ND_ASSIGN:
+            check_lvalue(nd->lhs);
+            if (nd->lhs->kind == ND_VAR) {
+                nd->reg_need = label_expr(nd->rhs);
+            } else {
+                nd->reg_need = binary_need(label_expr(nd->rhs), label_expr(nd->lhs->lhs));
+            }
+            break;
+        case ND_FUNCCALL: {
+            int n_args = 0;
+            for (Node *arg = nd->args; arg != NULL; arg = arg->next) {
+                label_expr(arg);
+                n_args++;
+            }
+            if (n_args > NUM_ARG_REGS) {
+                error_tok(nd->tok, "too many arguments");
+            }
+            // a call clobbers every temporary, so evaluate it before its siblings
+            nd->reg_need = NUM_TMP_REGS;
+            break;
+        }
+        default:
+            if (has_imm_rhs(nd)) {
+                nd->reg_need = label_expr(nd->lhs);
+                break;
+            }
+            nd->reg_need = binary_need(label_expr(nd->lhs), label_expr(nd->rhs));
+            break;
+    }
+    return nd->reg_need;
+}
+
+static int count_expr_spills(Node *nd, int r);
+
+// Spill slots used by gen_operands
+static int count_operand_spills(Node *a, Node *b, int r) {
+    Node *first  = a->reg_need >= b->reg_need ? a : b;
+    Node *second = first == a ? b : a;
+    int n        = count_expr_spills(first, r);
+    if (second->reg_need < NUM_TMP_REGS - r) {
+        return max(n, count_expr_spills(second, r + 1));
+    }
+    return max(n, 1 + count_expr_spills(second, r));
+}
+
+// Spill slots used by gen_expr(nd, r), mirrors its register assignment
+static int count_expr_spills(Node *nd, int r) {
+    switch (nd->kind) {
+        case ND_NUM:
+        case ND_VAR:
+            return 0;
+        case ND_NEG:
+        case ND_NOT:
+        case ND_BITNOT:
+        case ND_DEREF:
+            return count_expr_spills(nd->lhs, r);
+        case ND_LOGAND:
+        case ND_LOGOR:
+        case ND_COMMA:
+            return max(count_expr_spills(nd->lhs, r), count_expr_spills(nd->rhs, r));
+        case ND_ADDR:
+            return nd->lhs->kind == ND_VAR ? 0 : count_expr_spills(nd->lhs->lhs, r);
+        case ND_ASSIGN:
+            if (nd->lhs->kind == ND_VAR) {
+                return count_expr_spills(nd->rhs, r);
+            }
+            return count_operand_spills(nd->rhs, nd->lhs->lhs, r);
+        case ND_FUNCCALL: {
+            int n_args = 0;
+            for (Node *arg = nd->args; arg != NULL; arg = arg->next) {
+                n_args++;
+            }
+            // live temporaries are saved around the call
+            int n = r;
+            int i = 0;
+            for (Node *arg = nd->args; arg != NULL; arg = arg->next, i++) {
+                if (n_args <= NUM_TMP_REGS - r) {
+                    n = max(n, count_expr_spills(arg, r + i));
+                } else {
+                    n = max(n, i + count_expr_spills(arg, r));
+                }
+            }
+            return max(n, n_args <= NUM_TMP_REGS - r ? 0 : n_args);
+        }
+        default:
+            if (has_imm_rhs(nd)) {
+                return count_expr_spills(nd->lhs, r);
+            }
+            return count_operand_spills(nd->lhs, nd->rhs, r);
+    }
+}
+
+static int count_stmt_spills(Node *nd) {
+    if (nd == NULL) {
+        return 0;
+    }
+    switch (nd->kind) {
+        case ND_FOR:
+        case ND_IF:
+            return max(max(count_stmt_spills(nd->init), count_stmt_spills(nd->then)),
+                       max(count_stmt_spills(nd->els),
+                           max(nd->cond ? count_expr_spills(nd->cond, 0) : 0,
+                               nd->inc ? count_expr_spills(nd->inc, 0) : 0)));
+        case ND_BLOCK: {
+            int n = 0;
+            for (Node *stmt = nd->body; stmt != NULL; stmt = stmt->next) {
+                n = max(n, count_stmt_spills(stmt));
+            }
+            return n;
+        }
+        case ND_EXPR_STMT:
+        case ND_RETURN:
+            return count_expr_spills(nd->lhs, 0);
+        default:
+            return 0;
+    }
+}
+
+static void label_stmt(Node *nd) {
+    if (nd == NULL) {
+        return;
+    }
+    switch (nd->kind) {
+        case ND_FOR:
+        case ND_IF:
+            label_stmt(nd->init);
+            label_stmt(nd->then);
+            label_stmt(nd->els);
+            if (nd->cond) {
+                label_expr(nd->cond);
+            }
+            if (nd->inc) {
+                label_expr(nd->inc);
+            }
+            return;
+        case ND_BLOCK:
+            for (Node *stmt = nd->body; stmt != NULL; stmt = stmt->next) {
+                label_stmt(stmt);
+            }
+            return;
+        case ND_EXPR_STMT:
+        case ND_RETURN:
+            label_expr(nd->lhs);
+            return;
+        default:
+            return;
+    }
+}
+
+// Evaluate a and b, the heavier subtree first (a on a tie). Spills the first result to
+// the frame only when the second subtree does not fit in the remaining temporaries.
+static void gen_operands(Node *a, Node *b, int r, const char **a_reg, const char **b_reg) {
+    Node *first  = a->reg_need >= b->reg_need ? a : b;
+    Node *second = first == a ? b : a;
+    const char *first_reg;
+    const char *second_reg;
+
+    gen_expr(first, r);
+    if (second->reg_need < NUM_TMP_REGS - r) {
+        gen_expr(second, r + 1);
+        first_reg  = tmp_regs[r];
+        second_reg = tmp_regs[r + 1];
+    } else {
+        int slot = spill_slot(s_spill_depth++);
+        emit_comment("spill %s", tmp_regs[r]);
+        emit("    sw %s, %d(%s)", tmp_regs[r], slot, frame_reg());
+        gen_expr(second, r);
+        emit("    lw %s, %d(%s)", spill_reg, slot, frame_reg());
+        --s_spill_depth;
+        first_reg  = spill_reg;
+        second_reg = tmp_regs[r];
+    }
+
+    *a_reg = first == a ? first_reg : second_reg;
+    *b_reg = first == a ? second_reg : first_reg;
 }
 
-static void get_var_addr(Node *nd) {
+// Load the address of an lvalue into tmp_regs[r]
+static void gen_addr(Node *nd, int r) {
     if (nd->kind == ND_VAR) {
-        printf("    # Get the variable stack address and store a0\n");
-        printf("    addi a0, fp, %d\n", nd->var->offset);
+        emit_comment("Get the variable stack address");
+        emit("    addi %s, %s, %d", tmp_regs[r], frame_reg(), frame_offset(nd->var->offset));
         return;
     }
     if (nd->kind == ND_DEREF) {
-        gen_expr(nd->lhs);
+        gen_expr(nd->lhs, r);
         return;
     }
     error_tok(nd->tok, "not an lvalue");
 }
 
-static int count_code_segment() {
-    static int i = 1;
-    return i++;
+// Does the subtree take the address of a variable
+static bool has_addr(Node *nd) {
+    for (; nd != NULL; nd = nd->next) {
+        if (nd->kind == ND_ADDR || has_addr(nd->lhs) || has_addr(nd->rhs) || has_addr(nd->body) ||
+            has_addr(nd->cond) || has_addr(nd->then) || has_addr(nd->els) || has_addr(nd->init) ||
+            has_addr(nd->inc) || has_addr(nd->args)) {
+            return true;
+        }
+    }
+    return false;
 }
 
-static void gen_expr(Node *nd) {
-    // if ast have only one num node
+// Does a statement of the subtree end in a tail call of the function itself
+static bool has_self_tail_call(Node *nd) {
+    for (; nd != NULL; nd = nd->next) {
+        if ((is_tail_call(nd) && !strcmp(nd->lhs->func_name, s_func->name)) ||
+            has_self_tail_call(nd->body) || has_self_tail_call(nd->then) ||
+            has_self_tail_call(nd->els)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Evaluate the arguments of a call into a0-a5
+static void gen_args(Node *nd, int r) {
+    int n_args = 0;
+    for (Node *arg = nd->args; arg != NULL; arg = arg->next) {
+        n_args++;
+    }
+
+    int i = 0;
+    if (n_args <= NUM_TMP_REGS - r) {
+        for (Node *arg = nd->args; arg != NULL; arg = arg->next) {
+            gen_expr(arg, r + i++);
+        }
+        // a0->param0 a1->param1 a2->param2 ... a5->param5
+        for (i = 0; i < n_args; i++) {
+            emit("    mv %s, %s", arg_regs[i], tmp_regs[r + i]);
+        }
+    } else {
+        // not enough temporaries, park the arguments in spill slots
+        int base = s_spill_depth;
+        for (Node *arg = nd->args; arg != NULL; arg = arg->next) {
+            gen_expr(arg, r);
+            emit("    sw %s, %d(%s)", tmp_regs[r], spill_slot(base + i++), frame_reg());
+            s_spill_depth = base + i;
+        }
+        for (i = 0; i < n_args; i++) {
+            emit("    lw %s, %d(%s)", arg_regs[i], spill_slot(base + i), frame_reg());
+        }
+        s_spill_depth = base;
+    }
+}
+
+static void gen_funccall(Node *nd, int r) {
+    emit_comment("call func %s", nd->func_name);
+    gen_args(nd, r);
+
+    // temporaries are caller-saved
+    for (int i = 0; i < r; i++) {
+        emit("    sw %s, %d(%s)", tmp_regs[i], spill_slot(s_spill_depth + i), frame_reg());
+    }
+    emit("    call %s", nd->func_name);
+    emit("    mv %s, a0", tmp_regs[r]);
+    for (int i = 0; i < r; i++) {
+        emit("    lw %s, %d(%s)", tmp_regs[i], spill_slot(s_spill_depth + i), frame_reg());
+    }
+}
+
+// Leave the frame and jump to the callee, which returns straight to our caller. The
+// function calling itself jumps back to where it stores its parameters, a loop.
+static void gen_tail_call(Node *nd) {
+    emit_comment("tail call func %s", nd->func_name);
+    gen_args(nd, 0);
+    if (!strcmp(nd->func_name, s_func->name)) {
+        emit("    j .L.tail.%s", s_func->name);
+        return;
+    }
+    frame_teardown();
+    emit("    tail %s", nd->func_name);
+}
+
+static int count_code_segment() { return ++s_label_count; }
+
+// Evaluate nd into tmp_regs[r], using only tmp_regs[r..] as scratch
+static void gen_expr(Node *nd, int r) {
+    const char *rd = tmp_regs[r];
+    const char *lhs;
+    const char *rhs;
+
     switch (nd->kind) {
         case ND_NUM:
-            printf("    # Assign a value to ao\n");
-            printf("    li a0, %d\n", nd->val);
+            emit("    li %s, %d", rd, nd->val);
             return;
         case ND_NEG:
-            gen_expr(nd->lhs);
-            printf("    # Take the negative of ao\n");
-            printf("    neg a0, a0\n");
+            gen_expr(nd->lhs, r);
+            emit("    neg %s, %s", rd, rd);
+            return;
+        case ND_NOT:
+            gen_expr(nd->lhs, r);
+            emit("    seqz %s, %s", rd, rd);
+            return;
+        case ND_BITNOT:
+            gen_expr(nd->lhs, r);
+            emit("    not %s, %s", rd, rd);
+            return;
+        case ND_COMMA:
+            gen_expr(nd->lhs, r);
+            gen_expr(nd->rhs, r);
+            return;
+        case ND_LOGAND:
+        case ND_LOGOR: {
+            // short-circuit: the rhs only runs if the lhs does not decide the result
+            int i = count_code_segment();
+            gen_expr(nd->lhs, r);
+            if (nd->kind == ND_LOGAND) {
+                emit("    beqz %s, .L.false.%s.%d", rd, s_func->name, i);
+            } else {
+                emit("    bnez %s, .L.true.%s.%d", rd, s_func->name, i);
+            }
+            gen_expr(nd->rhs, r);
+            if (nd->kind == ND_LOGAND) {
+                emit("    snez %s, %s", rd, rd);
+                emit("    j .L.end.%s.%d", s_func->name, i);
+                emit(".L.false.%s.%d:", s_func->name, i);
+                emit("    li %s, 0", rd);
+            } else {
+                emit("    snez %s, %s", rd, rd);
+                emit("    j .L.end.%s.%d", s_func->name, i);
+                emit(".L.true.%s.%d:", s_func->name, i);
+                emit("    li %s, 1", rd);
+            }
+            emit(".L.end.%s.%d:", s_func->name, i);
             return;
+        }
         case ND_ASSIGN:
-            get_var_addr(nd->lhs);
-            push();
-            gen_expr(nd->rhs);
-            printf("    # pop stack to a1\n");
-            pop("a1");
-            printf("    # store ao to 0(a1)\n");
-            printf("    sw a0, 0(a1)\n");
+            if (nd->lhs->kind == ND_VAR) {
+                gen_expr(nd->rhs, r);
+                emit_comment("store %s to %s", rd, nd->lhs->var->name);
+                emit("    sw %s, %d(%s)", rd, frame_offset(nd->lhs->var->offset), frame_reg());
+                return;
+            }
+            gen_operands(nd->rhs, nd->lhs->lhs, r, &rhs, &lhs);
+            emit("    sw %s, 0(%s)", rhs, lhs);
+            if (rhs != rd) {
+                emit("    mv %s, %s", rd, rhs);
+            }
             return;
         case ND_VAR:
-            get_var_addr(nd);
-            printf("    # load onto a0 from 0(a0)\n");
-            printf("    lw a0, 0(a0)\n");
+            emit_comment("load %s", nd->var->name);
+            emit("    lw %s, %d(%s)", rd, frame_offset(nd->var->offset), frame_reg());
             return;
         case ND_ADDR:
-            get_var_addr(nd->lhs);
+            gen_addr(nd->lhs, r);
             return;
         case ND_DEREF:
-            gen_expr(nd->lhs);
-            printf("    # The address in a0 is read and the resulting value is stored in a0\n");
-            printf("    lw a0, 0(a0)\n");
+            gen_expr(nd->lhs, r);
+            emit("    lw %s, 0(%s)", rd, rd);
             return;
         case ND_FUNCCALL:
-            printf("    # call func %s\n", nd->func_name);
-            int n_args = 0;
-            for (Node *arg = nd->args; arg != NULL; arg = arg->next) {
-                gen_expr(arg);
-                push();
-                n_args++;
-            }
-            // a0->param0 a1->param1 a2->param2 ... a5->param5
-            for (int i = n_args - 1; i >= 0; i--) {
-                pop(arg_regs[i]);
-            }
-            printf("    call %s\n", nd->func_name);
+            gen_funccall(nd, r);
             return;
+        default:
+            break;
     }
 
-    // Recurse to the rightmost node
-    gen_expr(nd->rhs);
-    // Press the a0 register value onto the stack
-    push();
-    // Recurse to the leftmost node
-    gen_expr(nd->lhs);
-    // Pop the right subtree value onto the stack
-    printf("    # pop stack to a1\n");
-    pop("a1");
+    if (has_imm_rhs(nd)) {
+        gen_expr(nd->lhs, r);
+        if (nd->kind == ND_MUL) {
+            emit_mul_imm(rd, rd, nd->rhs->val);
+        } else if (nd->kind == ND_DIV) {
+            emit_div_imm(rd, rd, nd->rhs->val);
+        } else {
+            emit_mod_imm(rd, rd, nd->rhs->val);
+        }
+        return;
+    }
+
+    gen_operands(nd->lhs, nd->rhs, r, &lhs, &rhs);
 
     // Judgment operation
     switch (nd->kind) {
         case ND_ADD:
-            printf("    # a0 = a0 + a1\n");
-            printf("    add a0, a0, a1\n");  // a0 = a0 + a1
+            emit("    add %s, %s, %s", rd, lhs, rhs);
             break;
         case ND_SUB:
-            printf("    # a0 = a0 - a1\n");
-            printf("    sub a0, a0, a1\n");  // a0 = a0 - a1
+            emit("    sub %s, %s, %s", rd, lhs, rhs);
             break;
         case ND_MUL:
-            printf("    # a0 = a0 * a1\n");
-            printf("    mul a0, a0, a1\n");  // a0 = a0 * a1
+            emit("    mul %s, %s, %s", rd, lhs, rhs);
             break;
         case ND_DIV:
-            printf("    # a0 = a0 / a1\n");
-            printf("    div a0, a0, a1\n");  // a0 = a0 / a1
+            emit("    div %s, %s, %s", rd, lhs, rhs);
+            break;
+        case ND_MOD:
+            emit("    rem %s, %s, %s", rd, lhs, rhs);
+            break;
+        case ND_SHL:
+            emit("    sll %s, %s, %s", rd, lhs, rhs);
+            break;
+        case ND_SHR:
+            emit("    sra %s, %s, %s", rd, lhs, rhs);
+            break;
+        case ND_BITAND:
+            emit("    and %s, %s, %s", rd, lhs, rhs);
+            break;
+        case ND_BITOR:
+            emit("    or %s, %s, %s", rd, lhs, rhs);
+            break;
+        case ND_BITXOR:
+            emit("    xor %s, %s, %s", rd, lhs, rhs);
             break;
         case ND_EQ:
         case ND_NE:
-            printf("    # a0 = a0 ^ a1\n");
-            printf("    xor a0, a0, a1\n");  // a0 = a0 ^ a1
+            emit("    xor %s, %s, %s", rd, lhs, rhs);
             if (nd->kind == ND_EQ) {
-                printf("    # if a0 == 0, set a0 = 1\n");
-                printf("    seqz a0, a0\n");  // if a0 == 0, set a0 = 1
+                emit("    seqz %s, %s", rd, rd);
             } else {
-                printf("    # if a0 != 0, set a0 = 1\n");
-                printf("    snez a0, a0\n");  // if a0 != 0, set a0 = 1
+                emit("    snez %s, %s", rd, rd);
             }
             break;
         case ND_LE:
-            printf("    # if a1 < a0, set a0 = 1\n");
-            printf("    slt a0, a1, a0\n");
-            printf("    # a0 = a0 ^ 1\n");
-            printf("    xori a0, a0, 1\n");
+            // lhs <= rhs is !(rhs < lhs)
+            emit("    slt %s, %s, %s", rd, rhs, lhs);
+            emit("    xori %s, %s, 1", rd, rd);
             break;
         case ND_LT:
-            printf("    # if a0 < a1, set a0 = 1\n");
-            printf("    slt a0, a0, a1\n");
+            emit("    slt %s, %s, %s", rd, lhs, rhs);
             break;
         default:
             error_tok(nd->tok, "invalid expr");
@@ -147,6 +515,60 @@ static void gen_expr(Node *nd) {
     }
 }
 
+static bool is_zero(Node *nd) { return nd->kind == ND_NUM && nd->val == 0; }
+
+// Jump to .L.<label>.<function>.<id> if cond is true, or false with negate. Comparisons
+// branch on their operands without a boolean in between, comparisons with zero on the
+// zero register, and && and || branch on each side.
+static void gen_branch(Node *cond, bool negate, const char *label, int id) {
+    switch (cond->kind) {
+        case ND_NOT:
+            gen_branch(cond->lhs, !negate, label, id);
+            return;
+        case ND_LOGAND:
+        case ND_LOGOR:
+            // a && b is false as soon as a is, a || b true as soon as a is
+            if (negate == (cond->kind == ND_LOGAND)) {
+                gen_branch(cond->lhs, negate, label, id);
+                gen_branch(cond->rhs, negate, label, id);
+            } else {
+                int skip = count_code_segment();
+                gen_branch(cond->lhs, !negate, "skip", skip);
+                gen_branch(cond->rhs, negate, label, id);
+                emit(".L.skip.%s.%d:", s_func->name, skip);
+            }
+            return;
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE: {
+            const char *lhs;
+            const char *rhs;
+            if (is_zero(cond->rhs)) {
+                gen_expr(cond->lhs, 0);
+                lhs = tmp_regs[0];
+                rhs = "zero";
+            } else if (is_zero(cond->lhs)) {
+                gen_expr(cond->rhs, 0);
+                lhs = "zero";
+                rhs = tmp_regs[0];
+            } else {
+                gen_operands(cond->lhs, cond->rhs, 0, &lhs, &rhs);
+            }
+            IrOp cmp = cond->kind == ND_EQ   ? IR_EQ
+                       : cond->kind == ND_NE ? IR_NE
+                       : cond->kind == ND_LT ? IR_LT
+                                             : IR_LE;
+            emit_branch(cmp, negate, lhs, rhs, ".L.%s.%s.%d", label, s_func->name, id);
+            return;
+        }
+        default:
+            gen_expr(cond, 0);
+            emit_branch(IR_NE, negate, tmp_regs[0], "zero", ".L.%s.%s.%d", label, s_func->name, id);
+            return;
+    }
+}
+
 static void gen_stmt(Node *nd) {
     switch (nd->kind) {
         case ND_FOR: {
@@ -154,32 +576,34 @@ static void gen_stmt(Node *nd) {
             if (nd->init) {
                 gen_stmt(nd->init);
             }
-            printf(".L.begin.%d:\n", i);
+            // rotated into if (cond) do { body; inc; } while (cond), so an iteration takes
+            // one branch at the bottom instead of one at the top and a jump back
             if (nd->cond) {
-                gen_expr(nd->cond);
-                printf("    # if a0 == 0, jump to .L.end.%d\n", i);
-                printf("    beqz a0, .L.end.%d\n", i);
+                gen_branch(nd->cond, true, "end", i);
             }
+            emit(".L.begin.%s.%d:", s_func->name, i);
             gen_stmt(nd->then);
             if (nd->inc) {
-                gen_expr(nd->inc);
+                gen_expr(nd->inc, 0);
+            }
+            if (nd->cond) {
+                gen_branch(nd->cond, false, "begin", i);
+            } else {
+                emit("    j .L.begin.%s.%d", s_func->name, i);
             }
-            printf("    j .L.begin.%d\n", i);
-            printf(".L.end.%d:\n", i);
+            emit(".L.end.%s.%d:", s_func->name, i);
             return;
         }
         case ND_IF: {
             int i = count_code_segment();
-            gen_expr(nd->cond);
-            printf("    # if a0 == 0, jump to .L.else.%d\n", i);
-            printf("    beqz a0, .L.else.%d\n", i);
+            gen_branch(nd->cond, true, "else", i);
             gen_stmt(nd->then);
-            printf("    j .L.end.%d\n", i);
-            printf(".L.else.%d:\n", i);
+            emit("    j .L.end.%s.%d", s_func->name, i);
+            emit(".L.else.%s.%d:", s_func->name, i);
             if (nd->els) {
                 gen_stmt(nd->els);
             }
-            printf(".L.end.%d:\n", i);
+            emit(".L.end.%s.%d:", s_func->name, i);
             return;
         }
         case ND_BLOCK:
@@ -188,11 +612,18 @@ static void gen_stmt(Node *nd) {
             }
             return;
         case ND_EXPR_STMT:
-            gen_expr(nd->lhs);
+            gen_expr(nd->lhs, 0);
             return;
         case ND_RETURN:
-            gen_expr(nd->lhs);
-            printf("    j .L.return.%s\n", s_func->name);
+            if (is_tail_call(nd)) {
+                gen_tail_call(nd->lhs);
+                return;
+            }
+            gen_expr(nd->lhs, 0);
+            emit("    mv a0, t0");
+            if (nd != s_last_stmt) {
+                emit("    j .L.return.%s", s_func->name);
+            }
             return;
         default:
             error_tok(nd->tok, "invalid stmt");
@@ -206,52 +637,58 @@ void calculate_var_offset(Function *prog) {
             offset += REG_BYTES;
             var->offset = -offset;
         }
-        func->stack_size = align_to(offset, 16);
+
+        // expression spill slots sit right below the locals
+        label_stmt(func->body);
+        func->spill_offset = -offset - REG_BYTES;
+        offset += count_stmt_spills(func->body) * REG_BYTES;
+        func->stack_size = offset;
     }
 }
 
-void codegen(Function *prog) {
-    // calculate var stack offset
-    calculate_var_offset(prog);
+static void gen_function(void *arg) {
+    Function *func = arg;
+    s_func         = func;
+    s_label_count  = 0;
+    s_spill_depth  = 0;
+    s_tail_calls   = g_opts.tail_calls && !has_addr(func->body);
+    frame_prologue(func->name, func->stack_size, !has_call(func->body));
 
-    for (Function *func = prog; func != NULL; func = func->next) {
-        s_func = func;
-        // declare a global Function segment, it is also the start of Function
-        printf("    .global %s\n", func->name);
-        // Function label
-        printf("%s:\n", func->name);
-
-        printf("    # press fp onto the stack\n");
-        printf("    addi sp, sp, %d\n", -REG_BYTES * 2);
-        printf("    sw fp, 0(sp)\n");
-        printf("    # press ra onto the stack\n");
-        printf("    sw ra, %d(sp)\n", REG_BYTES);
-        printf("    # Assign the sp address to fp\n");
-        printf("    mv fp, sp\n");
-
-        printf("    # Allocate space on the stack for variables, algin to 16 Byte\n");
-        printf("    addi sp, sp, %d\n", -func->stack_size);
-
-        int i = 0;
-        for (Object *param = func->params; param != NULL; param = param->next) {
-            printf("    # store %s register val to %s stack address\n", arg_regs[i], param->name);
-            printf("    sw %s, %d(fp)\n", arg_regs[i++], param->offset);
-        }
+    if (has_self_tail_call(func->body)) {
+        emit(".L.tail.%s:", func->name);
+    }
+    int i = 0;
+    for (Object *param = func->params; param != NULL; param = param->next) {
+        emit_comment("store %s register val to %s stack address", arg_regs[i], param->name);
+        emit("    sw %s, %d(%s)", arg_regs[i++], frame_offset(param->offset), frame_reg());
+    }
+
+    s_last_stmt = func->body->body;
+    while (s_last_stmt != NULL && s_last_stmt->next != NULL) {
+        s_last_stmt = s_last_stmt->next;
+    }
 
-        // code generate
-        gen_stmt(func->body);
-        assert(Depth == 0);
+    // code generate
+    gen_stmt(func->body);
+    assert(s_spill_depth == 0);
 
-        printf(".L.return.%s:\n", func->name);
+    emit(".L.return.%s:", func->name);
+    frame_epilogue();
+    emit_function_end();
+}
 
-        printf("    # Release a variable on the stack\n");
-        printf("    mv sp, fp\n");
-        printf("    # pop stack onto fp\n");
-        printf("    lw fp, 0(sp)\n");
-        printf("    lw ra, %d(sp)\n", REG_BYTES);
-        printf("    addi sp, sp, %d\n", REG_BYTES * 2);
+void codegen(Function *prog) {
+    // calculate var stack offset
+    calculate_var_offset(prog);
 
-        // ret is the jalr x0, x1, 0 alias instruction, Used to return a subroutine
-        printf("    ret\n");
+    int n = 0;
+    for (Function *func = prog; func != NULL; func = func->next) {
+        n++;
     }
-}
\ No newline at end of file
+    void **funcs = arena_alloc(sizeof(void *) * (n ? n : 1));
+    n            = 0;
+    for (Function *func = prog; func != NULL; func = func->next) {
+        funcs[n++] = func;
+    }
+    parallel_codegen(funcs, n, gen_function);
+}
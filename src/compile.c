@@ -0,0 +1,280 @@
+#include "rvcc.h"
+
+// The pipeline from source to assembly, shared by the command line and the batch mode.
+// A compilation runs on one thread and an error ends only that compilation: its output
+// and everything allocated for it are dropped and the thread can go on with the next.
+
+// explanatory comments are only wanted when debugging the compiler
+#ifdef NDEBUG
+#define DEFAULT_COMMENTS false
+#else
+#define DEFAULT_COMMENTS true
+#endif
+
+// options of the compilations on this thread, the command line sets the main thread's
+_Thread_local Options g_opts = {.comments = DEFAULT_COMMENTS, .codegen_threads = 1};
+
+// -O<level>: from 1 on, the inliner, the peephole optimizer, loop-invariant code motion
+// and tail calls, without a frame pointer
+void set_opt_level(Options *opts, int level) {
+    opts->peephole     = level > 0;
+    opts->licm         = level > 0;
+    opts->tail_calls   = level > 0;
+    opts->omit_fp      = level > 0;
+    opts->inline_limit = level > 0 ? DEFAULT_INLINE_LIMIT : 0;
+}
+
+// Parse, inline and fold the program, and lower it if the IR is needed
+static Function *front_end(Token *tok, IrFunc **ir) {
+    // build ast
+    report_begin(PHASE_PARSE);
+    Function *prog = parse(tok);
+    report_end();
+
+    if (g_opts.inline_limit > 0) {
+        report_begin(PHASE_INLINE);
+        inline_functions(prog);
+        report_end();
+    }
+
+    // fold constants and simplify expressions
+    report_begin(PHASE_FOLD);
+    fold(prog);
+    report_end();
+
+    *ir = NULL;
+    if (g_opts.emit_ir || g_opts.ir_backend) {
+        report_begin(PHASE_LOWER);
+        *ir = lower(prog);
+        report_end();
+
+        if (g_opts.licm) {
+            report_begin(PHASE_LICM);
+            licm(*ir);
+            report_end();
+        }
+    }
+    return prog;
+}
+
+// Write the program to the current output
+static void back_end(Function *prog, IrFunc *ir) {
+    if (g_opts.emit_ir) {
+        dump_ir(ir);
+    } else if (g_opts.ir_backend) {
+        ir_codegen(ir);
+    } else {
+        codegen(prog);
+    }
+}
+
+// Clean up after an error ended the compilation
+static void drop_unit(void) {
+    error_set_recovery(NULL);
+    emit_abort();
+    report_abort();
+    release_source();
+    arena_reset();
+}
+
+// A function of the source, and its code from the cache or the code generator
+typedef struct {
+    Token *begin;
+    Token *end;
+    char *key;
+    size_t key_len;
+    char *code;
+    size_t len;
+} CachedFunc;
+
+// Split the tokens into functions, declspec declarator "{" ... "}". Returns the number
+// of functions, or -1 if the tokens do not have that shape; the parser is left to
+// report the error then.
+static int split_functions(Token *tok, CachedFunc **funcs) {
+    int n = 0;
+    for (Token *t = tok; t->kind != TK_EOF; t = t->next) {
+        n += equal(t, ID_RBRACE);
+    }
+    *funcs = arena_alloc(sizeof(CachedFunc) * (n ? n : 1));
+
+    n = 0;
+    while (tok->kind != TK_EOF) {
+        CachedFunc *f = &(*funcs)[n++];
+        f->begin      = tok;
+        while (!equal(tok, ID_LBRACE)) {
+            if (tok->kind == TK_EOF) {
+                return -1;
+            }
+            tok = tok->next;
+        }
+        for (int depth = 0;; tok = tok->next) {
+            if (tok->kind == TK_EOF) {
+                return -1;
+            }
+            depth += equal(tok, ID_LBRACE) - equal(tok, ID_RBRACE);
+            if (depth == 0) {
+                break;
+            }
+        }
+        f->end = tok;
+        tok    = tok->next;
+    }
+    return n;
+}
+
+// With --cache-dir every function is looked up in the cache and only the ones not
+// found are parsed and generated, each into a buffer of its own. Returns the number of
+// functions, or -1 if the source could not be split into functions.
+static int compile_cached(Token *tok, CachedFunc **funcs_out) {
+    CachedFunc *funcs;
+    int n = split_functions(tok, &funcs);
+    if (n < 0) {
+        return -1;
+    }
+    *funcs_out = funcs;
+
+    // chain the functions missing from the cache up into a program of their own
+    Token head = {};
+    Token *cur = &head;
+    Token *eof = tok;
+    while (eof->kind != TK_EOF) {
+        eof = eof->next;
+    }
+    for (int i = 0; i < n; i++) {
+        CachedFunc *f = &funcs[i];
+        f->key        = cache_key(f->begin, f->end, &f->key_len);
+        f->code       = cache_load(f->key, f->key_len, &f->len);
+        if (f->code == NULL) {
+            cur->next = f->begin;
+            cur       = f->end;
+        }
+    }
+    cur->next = eof;
+    if (head.next == eof) {
+        return n;
+    }
+
+    IrFunc *ir;
+    Function *prog = front_end(head.next, &ir);
+    report_begin(PHASE_CODEGEN);
+    for (int i = 0; i < n; i++) {
+        CachedFunc *f = &funcs[i];
+        if (f->code != NULL) {
+            continue;
+        }
+        // generate this function alone
+        Function *next_prog = prog->next;
+        IrFunc *next_ir     = ir ? ir->next : NULL;
+        prog->next          = NULL;
+        if (ir != NULL) {
+            ir->next = NULL;
+        }
+        emit_capture_begin();
+        back_end(prog, ir);
+        emit_function_end();
+        char *code = emit_capture_end(&f->len);
+        f->code    = arena_strndup(code, f->len);
+        heap_free(code);
+        cache_save(f->key, f->key_len, f->code, f->len);
+        prog = next_prog;
+        ir   = next_ir;
+    }
+    report_end();
+    return n;
+}
+
+// Compile the file input into output, NULL writes to stdout. Returns false on an
+// error, which leaves no output file behind.
+bool compile_file(char *input, const char *output) {
+    jmp_buf env;
+    if (setjmp(env) != 0) {
+        drop_unit();
+        return false;
+    }
+    error_set_recovery(&env);
+
+    // Lexical analysis, generate token
+    report_begin(PHASE_TOKENIZE);
+    Token *tok = tokenize_file(input);
+    report_end();
+
+    CachedFunc *funcs;
+    int n = g_opts.cache_dir != NULL ? compile_cached(tok, &funcs) : -1;
+    if (n >= 0) {
+        report_begin(PHASE_CODEGEN);
+        emit_open(output);
+        for (int i = 0; i < n; i++) {
+            emit_raw(funcs[i].code, funcs[i].len);
+        }
+        emit_close();
+        report_end();
+    } else {
+        IrFunc *ir;
+        Function *prog = front_end(tok, &ir);
+
+        // codegen
+        report_begin(PHASE_CODEGEN);
+        emit_open(output);
+        back_end(prog, ir);
+        emit_close();
+        report_end();
+    }
+    error_set_recovery(NULL);
+
+    report_collect();
+
+    // release every Token, Node, Type and Object of this compilation, and the source
+    release_source();
+    arena_reset();
+    return true;
+}
+
+// Compile the NUL-terminated program src in memory. Returns the assembly, *len bytes and
+// a NUL, in a buffer from heap_alloc(), or NULL if there were errors.
+char *compile_source(char *src, size_t *len) {
+    jmp_buf env;
+    if (setjmp(env) != 0) {
+        drop_unit();
+        return NULL;
+    }
+    error_set_recovery(&env);
+    set_current_source((SourceFile){"<input>", src});
+
+    report_begin(PHASE_TOKENIZE);
+    Token *tok = tokenize(src);
+    report_end();
+
+    IrFunc *ir;
+    Function *prog = front_end(tok, &ir);
+
+    report_begin(PHASE_CODEGEN);
+    emit_capture_begin();
+    back_end(prog, ir);
+    emit_function_end();
+    char *out = emit_capture_end(len);
+    report_end();
+    error_set_recovery(NULL);
+
+    report_collect();
+    arena_reset();
+    return out;
+}
+
+static void to_stream(void *ctx, const char *msg) { fputs(msg, ctx); }
+
+// Like compile_source(), the diagnostics are collected in the result instead of going
+// to the handler of the thread
+CompileResult compile_buffer(char *src) {
+    CompileResult res = {};
+    FILE *diag        = open_memstream(&res.diag, &res.diag_len);
+    if (diag == NULL) {
+        error("out of memory");
+    }
+    ErrorHandler saved = error_handler();
+    error_set_handler((ErrorHandler){to_stream, diag});
+    res.out = compile_source(src, &res.out_len);
+    res.ok  = res.out != NULL;
+    error_set_handler(saved);
+    fclose(diag);
+    return res;
+}
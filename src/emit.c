@@ -0,0 +1,273 @@
+#include "rvcc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Assembly output is collected in a large buffer and written out with few write calls.
+// Code generator threads capture their output in buffers of their own instead, which
+// grow rather than being flushed.
+
+#define EMIT_BUF_SIZE (1 << 20)
+// longest line emit() can produce
+#define MAX_LINE 1024
+
+// output of the compilation running on this thread, s_path is only set for a regular
+// file, which is removed again if the compilation fails
+static _Thread_local int s_fd = STDOUT_FILENO;
+static _Thread_local const char *s_path;
+
+// buffer the current thread writes to
+static _Thread_local char *s_buf;
+static _Thread_local size_t s_size;
+static _Thread_local size_t s_len;
+static _Thread_local bool s_capture;
+
+// count the lines written, for -fmem-report
+static bool s_count = false;
+static _Thread_local EmitStats s_stats;
+
+// Instructions are indented, directives and comments start with '.' and '#'
+static void count_lines(const char *p, const char *end) {
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (strncmp(p, "    ", 4) == 0 && p[4] != '.' && p[4] != '#') {
+            s_stats.insns++;
+        }
+        s_stats.lines++;
+        p = nl + 1;
+    }
+}
+
+static void flush_buf(void) {
+    const char *p = s_buf;
+    if (s_count) {
+        count_lines(s_buf, s_buf + s_len);
+    }
+    while (s_len > 0) {
+        ssize_t n = write(s_fd, p, s_len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error("cannot write output: %s", strerror(errno));
+        }
+        p += n;
+        s_len -= n;
+    }
+}
+
+// Make sure n more bytes fit into the buffer
+static void reserve(size_t n) {
+    if (s_size - s_len >= n) {
+        return;
+    }
+    if (!s_capture) {
+        flush_buf();
+        return;
+    }
+    size_t old_size = s_size;
+    while (s_size - s_len < n) {
+        s_size *= 2;
+    }
+    s_buf = heap_realloc(s_buf, old_size, s_size);
+    if (s_buf == NULL) {
+        error("out of memory");
+    }
+}
+
+// path NULL or "-" writes to stdout
+void emit_open(const char *path) {
+    s_size  = EMIT_BUF_SIZE;
+    s_len   = 0;
+    s_buf   = heap_alloc(s_size);
+    s_stats = (EmitStats){};
+    if (s_buf == NULL) {
+        error("out of memory");
+    }
+    if (path == NULL || strcmp(path, "-") == 0) {
+        s_fd = STDOUT_FILENO;
+        return;
+    }
+    s_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (s_fd < 0) {
+        error("cannot open output file %s: %s", path, strerror(errno));
+    }
+    struct stat st;
+    if (fstat(s_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        s_path = path;
+    }
+}
+
+static void release(void) {
+    if (s_fd != STDOUT_FILENO) {
+        close(s_fd);
+        s_fd = STDOUT_FILENO;
+    }
+    heap_free(s_buf);
+    s_buf     = NULL;
+    s_size    = 0;
+    s_len     = 0;
+    s_path    = NULL;
+    s_capture = false;
+}
+
+void emit_close(void) {
+    emit_function_end();
+    flush_buf();
+    release();
+}
+
+// Drop the output of a compilation that failed, a partly written file is removed
+void emit_abort(void) {
+    peephole_release();
+    if (s_path != NULL) {
+        unlink(s_path);
+    }
+    release();
+}
+
+void emit_set_stats(bool on) { s_count = on; }
+
+EmitStats emit_stats(void) { return s_stats; }
+
+static void put_line(const char *s, size_t len) {
+    reserve(len + 1);
+    memcpy(s_buf + s_len, s, len);
+    s_len += len;
+    s_buf[s_len++] = '\n';
+}
+
+// Send the output of this thread to a private buffer until emit_capture_end()
+void emit_capture_begin(void) {
+    s_capture = true;
+    s_size    = 1 << 16;
+    s_len     = 0;
+    s_buf     = heap_alloc(s_size);
+    if (s_buf == NULL) {
+        error("out of memory");
+    }
+}
+
+// The captured output, NUL-terminated, to be freed by the caller with heap_free()
+char *emit_capture_end(size_t *len) {
+    reserve(1);
+    s_buf[s_len] = '\0';
+    char *buf    = s_buf;
+    *len      = s_len;
+    s_capture = false;
+    s_buf     = NULL;
+    s_size    = 0;
+    s_len     = 0;
+    return buf;
+}
+
+// Append output captured by another thread
+void emit_raw(const char *s, size_t len) {
+    while (len > 0) {
+        reserve(1);
+        size_t n = s_size - s_len < len ? s_size - s_len : len;
+        memcpy(s_buf + s_len, s, n);
+        s_len += n;
+        s += n;
+        len -= n;
+    }
+}
+
+// Run the peephole optimizer over the lines of the function just generated
+void emit_function_end(void) {
+    if (g_opts.peephole) {
+        report_begin(PHASE_PEEPHOLE);
+        peephole_run();
+        peephole_flush(put_line);
+        report_end();
+    }
+}
+
+static void vemit(const char *prefix, const char *fmt, va_list va) {
+    char local[MAX_LINE];
+    char *line = local;
+    if (!g_opts.peephole) {
+        // format right into the output buffer
+        reserve(MAX_LINE);
+        line = s_buf + s_len;
+    }
+
+    size_t prefix_len = strlen(prefix);
+    memcpy(line, prefix, prefix_len);
+    int n = vsnprintf(line + prefix_len, MAX_LINE - prefix_len, fmt, va);
+    if (n < 0 || prefix_len + n >= MAX_LINE) {
+        error("assembly line too long");
+    }
+
+    if (g_opts.peephole) {
+        peephole_add(line, prefix_len + n);
+        return;
+    }
+    s_len += prefix_len + n;
+    s_buf[s_len++] = '\n';
+}
+
+// Write one line of assembly
+void emit(const char *fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+    vemit("", fmt, va);
+    va_end(va);
+}
+
+// Write a branch to the label if a cmp b is true, or false with negate. cmp is IR_EQ,
+// IR_NE, IR_LT or IR_LE, and either side may be the zero register, which takes the
+// one-operand forms like beqz and bgtz.
+void emit_branch(IrOp cmp, bool negate, const char *a, const char *b, const char *label_fmt,
+                 ...) {
+    char label[MAX_LINE];
+    va_list va;
+    va_start(va, label_fmt);
+    int n = vsnprintf(label, sizeof(label), label_fmt, va);
+    va_end(va);
+    if (n < 0 || n >= MAX_LINE) {
+        error("assembly line too long");
+    }
+
+    // a <= b is b >= a
+    if (cmp == IR_LE) {
+        const char *tmp = a;
+        a               = b;
+        b               = tmp;
+    }
+    // pairs of opposite branches, with the forms for zero on the right and on the left
+    static const struct {
+        const char *op;
+        const char *zero_b;
+        const char *zero_a;
+    } forms[] = {
+        {"beq", "beqz", "beqz"},
+        {"bne", "bnez", "bnez"},
+        {"blt", "bltz", "bgtz"},
+        {"bge", "bgez", "blez"},
+    };
+    int k = cmp == IR_EQ ? 0 : cmp == IR_NE ? 1 : cmp == IR_LT ? 2 : 3;
+    if (negate) {
+        k ^= 1;
+    }
+    if (!strcmp(b, "zero")) {
+        emit("    %s %s, %s", forms[k].zero_b, a, label);
+    } else if (!strcmp(a, "zero")) {
+        emit("    %s %s, %s", forms[k].zero_a, b, label);
+    } else {
+        emit("    %s %s, %s, %s", forms[k].op, a, b, label);
+    }
+}
+
+// Write an explanatory comment line, unless comments are turned off
+void emit_comment(const char *fmt, ...) {
+    if (!g_opts.comments) {
+        return;
+    }
+    va_list va;
+    va_start(va, fmt);
+    vemit("    # ", fmt, va);
+    va_end(va);
+}
@@ -0,0 +1,328 @@
+#include "rvcc.h"
+
+static Node *fold_expr(Node *nd);
+static Node *fold_stmt(Node *nd);
+
+static bool is_num(Node *nd, int val) { return nd->kind == ND_NUM && nd->val == val; }
+
+static bool has_side_effects(Node *nd) {
+    if (nd == NULL) {
+        return false;
+    }
+    if (nd->kind == ND_ASSIGN || nd->kind == ND_FUNCCALL) {
+        return true;
+    }
+    return has_side_effects(nd->lhs) || has_side_effects(nd->rhs);
+}
+
+// Turn nd into a number node in place, so its token and links survive
+static Node *to_num(Node *nd, int val) {
+    nd->kind = ND_NUM;
+    nd->val  = val;
+    nd->lhs  = NULL;
+    nd->rhs  = NULL;
+    nd->type = TypeInt;
+    return nd;
+}
+
+// Evaluate a binary operator with C int semantics, wrapping on overflow like the target does.
+// Returns false if the result is undefined and must be left to run time.
+static bool eval_binary(Node *nd, int lhs, int rhs, int *val) {
+    switch (nd->kind) {
+        case ND_ADD:
+            *val = (int)((unsigned)lhs + (unsigned)rhs);
+            return true;
+        case ND_SUB:
+            *val = (int)((unsigned)lhs - (unsigned)rhs);
+            return true;
+        case ND_MUL:
+            *val = (int)((unsigned)lhs * (unsigned)rhs);
+            return true;
+        case ND_DIV:
+            if (rhs == 0 || (lhs == -2147483647 - 1 && rhs == -1)) {
+                return false;
+            }
+            *val = lhs / rhs;
+            return true;
+        case ND_MOD:
+            if (rhs == 0 || (lhs == -2147483647 - 1 && rhs == -1)) {
+                return false;
+            }
+            *val = lhs % rhs;
+            return true;
+        case ND_SHL:
+            // out of range shift counts are left to the hardware
+            if (rhs < 0 || rhs > 31) {
+                return false;
+            }
+            *val = (int)((unsigned)lhs << rhs);
+            return true;
+        case ND_SHR:
+            if (rhs < 0 || rhs > 31) {
+                return false;
+            }
+            *val = lhs >> rhs;
+            return true;
+        case ND_BITAND:
+            *val = lhs & rhs;
+            return true;
+        case ND_BITOR:
+            *val = lhs | rhs;
+            return true;
+        case ND_BITXOR:
+            *val = lhs ^ rhs;
+            return true;
+        case ND_LOGAND:
+            *val = lhs && rhs;
+            return true;
+        case ND_LOGOR:
+            *val = lhs || rhs;
+            return true;
+        case ND_EQ:
+            *val = lhs == rhs;
+            return true;
+        case ND_NE:
+            *val = lhs != rhs;
+            return true;
+        case ND_LT:
+            *val = lhs < rhs;
+            return true;
+        case ND_LE:
+            *val = lhs <= rhs;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Replace nd by its operand, keeping nd's list link
+static Node *replace(Node *nd, Node *with) {
+    with->next = nd->next;
+    return with;
+}
+
+static Node *fold_binary(Node *nd) {
+    nd->lhs   = fold_expr(nd->lhs);
+    nd->rhs   = fold_expr(nd->rhs);
+    Node *lhs = nd->lhs;
+    Node *rhs = nd->rhs;
+
+    if ((nd->kind == ND_DIV || nd->kind == ND_MOD) && is_num(rhs, 0)) {
+        warn_tok(nd->tok, "division by zero");
+        return nd;
+    }
+
+    int val;
+    if (lhs->kind == ND_NUM && rhs->kind == ND_NUM && eval_binary(nd, lhs->val, rhs->val, &val)) {
+        return to_num(nd, val);
+    }
+
+    switch (nd->kind) {
+        case ND_ADD:
+            // x + 0, 0 + x
+            if (is_num(rhs, 0)) {
+                return replace(nd, lhs);
+            }
+            if (is_num(lhs, 0)) {
+                return replace(nd, rhs);
+            }
+            // (x + c1) + c2 -> x + (c1 + c2), this also merges scaled pointer offsets
+            if (rhs->kind == ND_NUM && lhs->kind == ND_ADD && lhs->rhs->kind == ND_NUM) {
+                eval_binary(nd, lhs->rhs->val, rhs->val, &val);
+                nd->lhs = lhs->lhs;
+                if (val == 0) {
+                    return replace(nd, nd->lhs);
+                }
+                to_num(rhs, val);
+                return nd;
+            }
+            return nd;
+        case ND_SUB:
+            // x - 0
+            if (is_num(rhs, 0)) {
+                return replace(nd, lhs);
+            }
+            return nd;
+        case ND_MUL:
+            // x * 1, 1 * x
+            if (is_num(rhs, 1)) {
+                return replace(nd, lhs);
+            }
+            if (is_num(lhs, 1)) {
+                return replace(nd, rhs);
+            }
+            // x * 0, 0 * x, unless x has to be evaluated anyway
+            if ((is_num(rhs, 0) && !has_side_effects(lhs)) ||
+                (is_num(lhs, 0) && !has_side_effects(rhs))) {
+                return to_num(nd, 0);
+            }
+            // c * x -> x * c, the code generators look for a constant on the right only
+            if (lhs->kind == ND_NUM) {
+                nd->lhs = rhs;
+                nd->rhs = lhs;
+            }
+            return nd;
+        case ND_DIV:
+            // x / 1
+            if (is_num(rhs, 1)) {
+                return replace(nd, lhs);
+            }
+            return nd;
+        case ND_SHL:
+        case ND_SHR:
+        case ND_BITOR:
+        case ND_BITXOR:
+            // x << 0, x >> 0, x | 0, x ^ 0
+            if (is_num(rhs, 0)) {
+                return replace(nd, lhs);
+            }
+            return nd;
+        case ND_LOGAND:
+            // 0 && x never looks at x
+            if (is_num(lhs, 0)) {
+                return to_num(nd, 0);
+            }
+            return nd;
+        case ND_LOGOR:
+            // c || x with c != 0 never looks at x
+            if (lhs->kind == ND_NUM && lhs->val != 0) {
+                return to_num(nd, 1);
+            }
+            return nd;
+        default:
+            return nd;
+    }
+}
+
+static Node *fold_expr(Node *nd) {
+    switch (nd->kind) {
+        case ND_NUM:
+        case ND_VAR:
+            return nd;
+        case ND_NEG:
+            nd->lhs = fold_expr(nd->lhs);
+            if (nd->lhs->kind == ND_NUM) {
+                return to_num(nd, (int)-(unsigned)nd->lhs->val);
+            }
+            // --x
+            if (nd->lhs->kind == ND_NEG) {
+                return replace(nd, nd->lhs->lhs);
+            }
+            return nd;
+        case ND_NOT:
+            nd->lhs = fold_expr(nd->lhs);
+            if (nd->lhs->kind == ND_NUM) {
+                return to_num(nd, !nd->lhs->val);
+            }
+            return nd;
+        case ND_BITNOT:
+            nd->lhs = fold_expr(nd->lhs);
+            if (nd->lhs->kind == ND_NUM) {
+                return to_num(nd, ~nd->lhs->val);
+            }
+            // ~~x
+            if (nd->lhs->kind == ND_BITNOT) {
+                return replace(nd, nd->lhs->lhs);
+            }
+            return nd;
+        case ND_ADDR:
+            nd->lhs = fold_expr(nd->lhs);
+            // &*x
+            if (nd->lhs->kind == ND_DEREF) {
+                return replace(nd, nd->lhs->lhs);
+            }
+            return nd;
+        case ND_DEREF:
+            nd->lhs = fold_expr(nd->lhs);
+            // *&x
+            if (nd->lhs->kind == ND_ADDR) {
+                return replace(nd, nd->lhs->lhs);
+            }
+            return nd;
+        case ND_ASSIGN:
+            nd->lhs = fold_expr(nd->lhs);
+            nd->rhs = fold_expr(nd->rhs);
+            return nd;
+        case ND_COMMA:
+            nd->lhs = fold_expr(nd->lhs);
+            nd->rhs = fold_expr(nd->rhs);
+            // the lhs is only there for its effects
+            if (!has_side_effects(nd->lhs)) {
+                return replace(nd, nd->rhs);
+            }
+            return nd;
+        case ND_FUNCCALL: {
+            Node head = {};
+            Node *cur = &head;
+            for (Node *arg = nd->args; arg != NULL; arg = arg->next) {
+                cur->next = fold_expr(arg);
+                cur       = cur->next;
+            }
+            nd->args = head.next;
+            return nd;
+        }
+        default:
+            return fold_binary(nd);
+    }
+}
+
+static Node *fold_stmt(Node *nd) {
+    switch (nd->kind) {
+        case ND_IF:
+            nd->cond = fold_expr(nd->cond);
+            nd->then = fold_stmt(nd->then);
+            if (nd->els) {
+                nd->els = fold_stmt(nd->els);
+            }
+            // drop the branch that can never run
+            if (nd->cond->kind == ND_NUM) {
+                if (nd->cond->val) {
+                    return replace(nd, nd->then);
+                }
+                if (nd->els) {
+                    return replace(nd, nd->els);
+                }
+                nd->kind = ND_BLOCK;
+                nd->body = NULL;
+            }
+            return nd;
+        case ND_FOR:
+            if (nd->init) {
+                nd->init = fold_stmt(nd->init);
+            }
+            if (nd->cond) {
+                nd->cond = fold_expr(nd->cond);
+                // for (;1;) does not need a test
+                if (nd->cond->kind == ND_NUM && nd->cond->val) {
+                    nd->cond = NULL;
+                }
+            }
+            if (nd->inc) {
+                nd->inc = fold_expr(nd->inc);
+            }
+            nd->then = fold_stmt(nd->then);
+            return nd;
+        case ND_BLOCK: {
+            Node head = {};
+            Node *cur = &head;
+            for (Node *n = nd->body; n != NULL; n = n->next) {
+                cur->next = fold_stmt(n);
+                cur       = cur->next;
+            }
+            nd->body = head.next;
+            return nd;
+        }
+        case ND_EXPR_STMT:
+        case ND_RETURN:
+            nd->lhs = fold_expr(nd->lhs);
+            return nd;
+        default:
+            return nd;
+    }
+}
+
+void fold(Function *prog) {
+    for (Function *func = prog; func != NULL; func = func->next) {
+        func->body = fold_stmt(func->body);
+    }
+}
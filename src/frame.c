@@ -0,0 +1,87 @@
+#include "rvcc.h"
+
+// Prologue and epilogue shared by both code generators. Frame offsets are handed out
+// relative to the frame pointer. Without one they are rebased on sp, which stays put
+// for the whole function body.
+
+// frame of the function being generated on this thread
+static _Thread_local bool s_use_fp;
+static _Thread_local bool s_save_ra;
+// bytes sp moves by below the fp/ra pair, or for the whole frame without fp
+static _Thread_local int s_size;
+// added to fp offsets to address the frame
+static _Thread_local int s_bias;
+
+static int align_to(int N, int align) { return (N + align - 1) / align * align; }
+
+const char *frame_reg(void) { return s_use_fp ? "fp" : "sp"; }
+
+int frame_offset(int offset) { return offset + s_bias; }
+
+void frame_prologue(const char *name, int size, bool is_leaf) {
+    s_use_fp  = !g_opts.omit_fp;
+    s_save_ra = !is_leaf;
+
+    // declare a global Function segment, it is also the start of Function
+    emit("    .global %s", name);
+    emit("%s:", name);
+
+    if (s_use_fp) {
+        s_size = align_to(size, 16);
+        s_bias = 0;
+        emit_comment("press fp onto the stack");
+        emit("    addi sp, sp, %d", -REG_BYTES * 2);
+        emit("    sw fp, 0(sp)");
+        // a leaf never clobbers ra
+        if (s_save_ra) {
+            emit_comment("press ra onto the stack");
+            emit("    sw ra, %d(sp)", REG_BYTES);
+        }
+        emit_comment("Assign the sp address to fp");
+        emit("    mv fp, sp");
+        if (s_size) {
+            emit_comment("Allocate space on the stack for variables, algin to 16 Byte");
+            emit("    addi sp, sp, %d", -s_size);
+        }
+        return;
+    }
+
+    // ra takes the top word of the frame, fp offsets count down from there
+    int header = s_save_ra ? REG_BYTES : 0;
+    s_size     = align_to(size + header, 16);
+    s_bias     = s_size - header;
+    if (s_size) {
+        emit_comment("Allocate the frame, align to 16 Byte");
+        emit("    addi sp, sp, %d", -s_size);
+    }
+    if (s_save_ra) {
+        emit("    sw ra, %d(sp)", s_bias);
+    }
+}
+
+// Restore ra, fp and sp as they were on entry, without returning
+void frame_teardown(void) {
+    if (s_use_fp) {
+        emit_comment("Release a variable on the stack");
+        emit("    mv sp, fp");
+        emit_comment("pop stack onto fp");
+        emit("    lw fp, 0(sp)");
+        if (s_save_ra) {
+            emit("    lw ra, %d(sp)", REG_BYTES);
+        }
+        emit("    addi sp, sp, %d", REG_BYTES * 2);
+    } else {
+        if (s_save_ra) {
+            emit("    lw ra, %d(sp)", s_bias);
+        }
+        if (s_size) {
+            emit("    addi sp, sp, %d", s_size);
+        }
+    }
+}
+
+void frame_epilogue(void) {
+    frame_teardown();
+    // ret is the jalr x0, x1, 0 alias instruction, Used to return a subroutine
+    emit("    ret");
+}
@@ -0,0 +1,83 @@
+#include "rvcc.h"
+
+// Open addressing hash map from strings to pointers. Keys are not copied, they
+// usually point into the source buffer. Buckets come from the arena, so a map
+// lives for one compilation.
+
+#define INIT_CAPACITY 64
+// grow when more than 70% of the buckets are used
+#define HIGH_WATERMARK 70
+
+static uint32_t fnv_hash(const char *s, int len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash ^= (unsigned char)s[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void rehash(HashMap *map) {
+    int capacity = map->capacity ? map->capacity * 2 : INIT_CAPACITY;
+    HashMap map2 = {arena_alloc(sizeof(HashEntry) * capacity), capacity, 0};
+
+    for (int i = 0; i < map->capacity; i++) {
+        HashEntry *ent = &map->buckets[i];
+        if (ent->key == NULL) {
+            continue;
+        }
+        for (uint32_t j = ent->hash;; j++) {
+            HashEntry *ent2 = &map2.buckets[j & (capacity - 1)];
+            if (ent2->key == NULL) {
+                *ent2 = *ent;
+                break;
+            }
+        }
+        map2.used++;
+    }
+    *map = map2;
+}
+
+static HashEntry *get_entry(HashMap *map, const char *key, int keylen, uint32_t hash) {
+    if (map->buckets == NULL) {
+        return NULL;
+    }
+    for (uint32_t i = hash;; i++) {
+        HashEntry *ent = &map->buckets[i & (map->capacity - 1)];
+        if (ent->key == NULL) {
+            return NULL;
+        }
+        if (ent->hash == hash && ent->keylen == keylen && memcmp(ent->key, key, keylen) == 0) {
+            return ent;
+        }
+    }
+}
+
+void *hashmap_get(HashMap *map, const char *key, int keylen) {
+    HashEntry *ent = get_entry(map, key, keylen, fnv_hash(key, keylen));
+    return ent ? ent->val : NULL;
+}
+
+void hashmap_put(HashMap *map, const char *key, int keylen, void *val) {
+    uint32_t hash  = fnv_hash(key, keylen);
+    HashEntry *ent = get_entry(map, key, keylen, hash);
+    if (ent != NULL) {
+        ent->val = val;
+        return;
+    }
+
+    if (map->buckets == NULL || map->used * 100 >= map->capacity * HIGH_WATERMARK) {
+        rehash(map);
+    }
+    for (uint32_t i = hash;; i++) {
+        ent = &map->buckets[i & (map->capacity - 1)];
+        if (ent->key == NULL) {
+            ent->key    = key;
+            ent->keylen = keylen;
+            ent->hash   = hash;
+            ent->val    = val;
+            map->used++;
+            return;
+        }
+    }
+}
@@ -0,0 +1,365 @@
+#include "rvcc.h"
+
+// Inlining on the AST, between parsing and folding. A function whose body is straight-
+// line code ending in a return can stand in for a call as an expression: copies of its
+// parameters and locals join the caller's locals, the arguments are assigned to them,
+// and the statements and the returned value follow, joined by ND_COMMA. A constant
+// argument replaces a parameter that is never assigned, so folding can go on through
+// the body.
+//
+// A function is inlined if its body has at most g_opts.inline_limit nodes or it is
+// called from one place only, and never if it can call itself. Callees are done before
+// their callers, so chains of small functions collapse into the outermost one. The
+// inlined functions are still generated, other files may call them.
+
+typedef struct {
+    Function *func;
+    // call sites in the program
+    int calls;
+    bool recursive;
+    bool done;
+    // nodes of the body, -1 if it is not straight-line code ending in a return
+    int size;
+} FuncInfo;
+
+// A local of the inlined function and what it becomes in the caller
+typedef struct {
+    Object *from;
+    Object *to;
+    // the constant argument replacing a parameter
+    Node *num;
+} VarMap;
+
+// functions of the program being inlined on this thread
+static _Thread_local FuncInfo *s_funcs;
+static _Thread_local int s_num_funcs;
+
+static FuncInfo *find_func(const char *name) {
+    for (int i = 0; i < s_num_funcs; i++) {
+        if (!strcmp(s_funcs[i].func->name, name)) {
+            return &s_funcs[i];
+        }
+    }
+    return NULL;
+}
+
+static Node *new_node(NodeKind kind, Token *tok, Type *type) {
+    Node *nd = arena_alloc_kind(MEM_NODE, sizeof(Node));
+    nd->kind = kind;
+    nd->tok  = tok;
+    nd->type = type;
+    return nd;
+}
+
+// Apply fn to every direct child of nd, the ones in lists included
+static void for_each_child(Node *nd, void (*fn)(Node **child, void *arg), void *arg) {
+    Node **fields[] = {&nd->lhs, &nd->rhs, &nd->cond, &nd->then, &nd->els, &nd->init, &nd->inc};
+    for (size_t i = 0; i < sizeof(fields) / sizeof(*fields); i++) {
+        if (*fields[i] != NULL) {
+            fn(fields[i], arg);
+        }
+    }
+    for (Node **p = &nd->body; *p != NULL; p = &(*p)->next) {
+        fn(p, arg);
+    }
+    for (Node **p = &nd->args; *p != NULL; p = &(*p)->next) {
+        fn(p, arg);
+    }
+}
+
+static void count_calls(Node **nd, void *arg) {
+    if ((*nd)->kind == ND_FUNCCALL) {
+        FuncInfo *callee = find_func((*nd)->func_name);
+        if (callee != NULL) {
+            callee->calls++;
+        }
+    }
+    for_each_child(*nd, count_calls, arg);
+}
+
+typedef struct {
+    FuncInfo *target;
+    bool *visited;
+    bool found;
+} Reach;
+
+static void find_calls_to(Node **nd, void *arg);
+
+// Whether f calls r->target, directly or not
+static void reach_from(FuncInfo *f, Reach *r) {
+    if (r->found || r->visited[f - s_funcs]) {
+        return;
+    }
+    r->visited[f - s_funcs] = true;
+    find_calls_to(&f->func->body, r);
+}
+
+static void find_calls_to(Node **nd, void *arg) {
+    Reach *r = arg;
+    if ((*nd)->kind == ND_FUNCCALL) {
+        FuncInfo *callee = find_func((*nd)->func_name);
+        if (callee == r->target) {
+            r->found = true;
+        } else if (callee != NULL) {
+            reach_from(callee, r);
+        }
+    }
+    for_each_child(*nd, find_calls_to, arg);
+}
+
+static void count_nodes(Node **nd, void *arg) {
+    ++*(int *)arg;
+    for_each_child(*nd, count_nodes, arg);
+}
+
+// Append the statements of a body to stmts, blocks opened up. Returns false on anything
+// but expression statements and returns.
+static bool flatten(Node *nd, Node **stmts, int *n) {
+    if (nd->kind == ND_BLOCK) {
+        for (Node *stmt = nd->body; stmt != NULL; stmt = stmt->next) {
+            if (!flatten(stmt, stmts, n)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (nd->kind != ND_EXPR_STMT && nd->kind != ND_RETURN) {
+        return false;
+    }
+    if (stmts != NULL) {
+        stmts[*n] = nd;
+    }
+    ++*n;
+    return true;
+}
+
+// Size of the body of f if it can be inlined, -1 if not
+static int inline_size(Function *f) {
+    int n = 0;
+    if (!flatten(f->body, NULL, &n) || n == 0) {
+        return -1;
+    }
+    Node **stmts = arena_alloc(sizeof(Node *) * n);
+    n            = 0;
+    flatten(f->body, stmts, &n);
+
+    int size = 0;
+    for (int i = 0; i < n; i++) {
+        // one return, at the end
+        if ((stmts[i]->kind == ND_RETURN) != (i == n - 1)) {
+            return -1;
+        }
+        count_nodes(&stmts[i]->lhs, &size);
+    }
+    return size;
+}
+
+typedef struct {
+    Object *var;
+    bool found;
+} VarUse;
+
+// Whether the variable is assigned or has its address taken
+static void find_writes(Node **nd, void *arg) {
+    VarUse *use = arg;
+    if (((*nd)->kind == ND_ASSIGN || (*nd)->kind == ND_ADDR) && (*nd)->lhs->kind == ND_VAR &&
+        (*nd)->lhs->var == use->var) {
+        use->found = true;
+    }
+    for_each_child(*nd, find_writes, arg);
+}
+
+typedef struct {
+    VarMap *map;
+    int num_vars;
+} Clone;
+
+static Node *clone(Node *nd, Clone *c);
+
+static Node *clone_list(Node *list, Clone *c) {
+    Node head = {};
+    Node *cur = &head;
+    for (Node *nd = list; nd != NULL; nd = nd->next) {
+        cur = cur->next = clone(nd, c);
+    }
+    return head.next;
+}
+
+// Copy of the callee's tree with its variables replaced
+static Node *clone(Node *nd, Clone *c) {
+    if (nd == NULL) {
+        return NULL;
+    }
+    Node *copy = arena_alloc_kind(MEM_NODE, sizeof(Node));
+    *copy      = *nd;
+    copy->next = NULL;
+    if (nd->kind == ND_VAR) {
+        for (int i = 0; i < c->num_vars; i++) {
+            if (c->map[i].from != nd->var) {
+                continue;
+            }
+            if (c->map[i].num != NULL) {
+                *copy      = *c->map[i].num;
+                copy->next = NULL;
+            } else {
+                copy->var = c->map[i].to;
+            }
+            break;
+        }
+        return copy;
+    }
+    copy->lhs  = clone(nd->lhs, c);
+    copy->rhs  = clone(nd->rhs, c);
+    copy->cond = clone(nd->cond, c);
+    copy->then = clone(nd->then, c);
+    copy->els  = clone(nd->els, c);
+    copy->init = clone(nd->init, c);
+    copy->inc  = clone(nd->inc, c);
+    copy->body = clone_list(nd->body, c);
+    copy->args = clone_list(nd->args, c);
+    return copy;
+}
+
+static Node *new_comma(Node *lhs, Node *rhs) {
+    Node *nd = new_node(ND_COMMA, rhs->tok, rhs->type);
+    nd->lhs  = lhs;
+    nd->rhs  = rhs;
+    return nd;
+}
+
+// A copy of var among the locals of func, in front so the parameters stay the tail
+static Object *new_local(Function *func, Object *var) {
+    Object *obj  = arena_alloc_kind(MEM_OBJECT, sizeof(Object));
+    obj->name    = var->name;
+    obj->type    = var->type;
+    obj->next    = func->locals;
+    func->locals = obj;
+    return obj;
+}
+
+// The expression standing in for call, a call of callee in caller
+static Node *expand(Function *caller, Function *callee, Node *call) {
+    int num_vars = 0;
+    for (Object *var = callee->locals; var != NULL; var = var->next) {
+        num_vars++;
+    }
+    int num_stmts = 0;
+    flatten(callee->body, NULL, &num_stmts);
+    Node **stmts = arena_alloc(sizeof(Node *) * num_stmts);
+    num_stmts    = 0;
+    flatten(callee->body, stmts, &num_stmts);
+
+    // an assignment per argument, then the statements
+    Node **exprs = arena_alloc(sizeof(Node *) * (num_vars + num_stmts));
+    int n        = 0;
+    Clone c      = {.map = arena_alloc(sizeof(VarMap) * num_vars)};
+
+    Node *arg = call->args;
+    for (Object *param = callee->params; param != NULL; param = param->next) {
+        Node *next = arg->next;
+        arg->next  = NULL;
+        VarMap *m  = &c.map[c.num_vars++];
+        m->from    = param;
+
+        VarUse use = {.var = param};
+        find_writes(&callee->body, &use);
+        if (arg->kind == ND_NUM && is_int(param->type) && !use.found) {
+            m->num = arg;
+        } else {
+            m->to        = new_local(caller, param);
+            Node *var    = new_node(ND_VAR, arg->tok, param->type);
+            var->var     = m->to;
+            Node *assign = new_node(ND_ASSIGN, arg->tok, param->type);
+            assign->lhs  = var;
+            assign->rhs  = arg;
+            exprs[n++]   = assign;
+        }
+        arg = next;
+    }
+    for (Object *var = callee->locals; var != callee->params; var = var->next) {
+        VarMap *m = &c.map[c.num_vars++];
+        m->from   = var;
+        m->to     = new_local(caller, var);
+    }
+
+    for (int i = 0; i < num_stmts; i++) {
+        exprs[n++] = clone(stmts[i]->lhs, &c);
+    }
+    Node *nd = exprs[n - 1];
+    for (int i = n - 2; i >= 0; i--) {
+        nd = new_comma(exprs[i], nd);
+    }
+    return nd;
+}
+
+static void inline_calls(FuncInfo *f);
+
+static int count_args(Node *call) {
+    int n = 0;
+    for (Node *arg = call->args; arg != NULL; arg = arg->next) {
+        n++;
+    }
+    return n;
+}
+
+static int count_params(Function *func) {
+    int n = 0;
+    for (Object *param = func->params; param != NULL; param = param->next) {
+        n++;
+    }
+    return n;
+}
+
+// Inline the calls in the subtree *nd of the function caller
+static void inline_in(Node **nd, void *arg) {
+    FuncInfo *caller = arg;
+    for_each_child(*nd, inline_in, arg);
+    if ((*nd)->kind != ND_FUNCCALL) {
+        return;
+    }
+    FuncInfo *callee = find_func((*nd)->func_name);
+    if (callee == NULL || callee->recursive || count_args(*nd) != count_params(callee->func)) {
+        return;
+    }
+    // the callee first, what it inlines comes along
+    inline_calls(callee);
+    if (callee->size < 0 || (callee->size > g_opts.inline_limit && callee->calls != 1)) {
+        return;
+    }
+    Node *next  = (*nd)->next;
+    *nd         = expand(caller->func, callee->func, *nd);
+    (*nd)->next = next;
+}
+
+static void inline_calls(FuncInfo *f) {
+    if (f->done) {
+        return;
+    }
+    f->done = true;
+    inline_in(&f->func->body, f);
+    f->size = inline_size(f->func);
+}
+
+void inline_functions(Function *prog) {
+    s_num_funcs = 0;
+    for (Function *f = prog; f != NULL; f = f->next) {
+        s_num_funcs++;
+    }
+    s_funcs = arena_alloc(sizeof(FuncInfo) * s_num_funcs);
+    int i   = 0;
+    for (Function *f = prog; f != NULL; f = f->next) {
+        s_funcs[i++] = (FuncInfo){.func = f};
+    }
+
+    bool *visited = arena_alloc(sizeof(bool) * s_num_funcs);
+    for (i = 0; i < s_num_funcs; i++) {
+        count_calls(&s_funcs[i].func->body, NULL);
+        memset(visited, 0, sizeof(bool) * s_num_funcs);
+        Reach r = {.target = &s_funcs[i], .visited = visited};
+        reach_from(&s_funcs[i], &r);
+        s_funcs[i].recursive = r.found;
+    }
+    for (i = 0; i < s_num_funcs; i++) {
+        inline_calls(&s_funcs[i]);
+    }
+}
@@ -0,0 +1,609 @@
+#include "rvcc.h"
+
+// Lowering from the AST to the three-address IR, control-flow graph construction
+// and the textual dump printed by --emit-ir
+
+// function being lowered on this thread
+static _Thread_local IrFunc *s_fn       = NULL;
+static _Thread_local BasicBlock *s_bb   = NULL;
+static _Thread_local BasicBlock *s_tail = NULL;
+// virtual registers up to this one belong to variables, the rest are temporaries
+static _Thread_local int s_last_var_vreg;
+
+static int lower_expr(Node *nd);
+static void lower_stmt(Node *nd);
+
+static bool is_zero(Node *nd) { return nd->kind == ND_NUM && nd->val == 0; }
+
+static int new_vreg(void) { return ++s_fn->num_vregs; }
+
+static BasicBlock *new_block(void) {
+    BasicBlock *bb = arena_alloc_kind(MEM_IR, sizeof(BasicBlock));
+    bb->id         = s_fn->num_blocks++;
+    return bb;
+}
+
+static bool is_terminated(BasicBlock *bb);
+static void new_jmp(BasicBlock *to);
+
+// Append bb to the layout and make it the insertion point. The current block falls
+// through into it unless it already ends in a jump.
+static void start_block(BasicBlock *bb) {
+    if (s_bb != NULL) {
+        new_jmp(bb);
+    }
+    if (s_tail == NULL) {
+        s_fn->blocks = bb;
+    } else {
+        s_tail->next = bb;
+    }
+    s_tail = bb;
+    s_bb   = bb;
+}
+
+static bool is_terminated(BasicBlock *bb) {
+    return bb->last && (bb->last->op == IR_JMP || bb->last->op == IR_BR || bb->last->op == IR_RET);
+}
+
+static IrInsn *new_insn(IrOp op, int dst, int a, int b) {
+    IrInsn *insn = arena_alloc_kind(MEM_IR, sizeof(IrInsn));
+    insn->op     = op;
+    insn->dst    = dst;
+    insn->a      = a;
+    insn->b      = b;
+
+    // code after a return or jump is unreachable, collect it in a fresh block
+    if (is_terminated(s_bb)) {
+        start_block(new_block());
+    }
+    if (s_bb->last == NULL) {
+        s_bb->insns = insn;
+    } else {
+        s_bb->last->next = insn;
+    }
+    s_bb->last = insn;
+    return insn;
+}
+
+static int new_imm(int val) {
+    int dst                          = new_vreg();
+    new_insn(IR_IMM, dst, 0, 0)->imm = val;
+    return dst;
+}
+
+static void new_jmp(BasicBlock *to) {
+    if (!is_terminated(s_bb)) {
+        new_insn(IR_JMP, 0, 0, 0)->then = to;
+    }
+}
+
+static void new_br(int cond, BasicBlock *then, BasicBlock *els) {
+    IrInsn *insn = new_insn(IR_BR, 0, cond, 0);
+    insn->cmp    = IR_NE;
+    insn->then   = then;
+    insn->els    = els;
+}
+
+static IrOp binary_op(NodeKind kind) {
+    switch (kind) {
+        case ND_ADD:
+            return IR_ADD;
+        case ND_SUB:
+            return IR_SUB;
+        case ND_MUL:
+            return IR_MUL;
+        case ND_DIV:
+            return IR_DIV;
+        case ND_MOD:
+            return IR_MOD;
+        case ND_SHL:
+            return IR_SHL;
+        case ND_SHR:
+            return IR_SHR;
+        case ND_BITAND:
+            return IR_AND;
+        case ND_BITOR:
+            return IR_OR;
+        case ND_BITXOR:
+            return IR_XOR;
+        case ND_EQ:
+            return IR_EQ;
+        case ND_NE:
+            return IR_NE;
+        case ND_LT:
+            return IR_LT;
+        case ND_LE:
+            return IR_LE;
+        default:
+            error("invalid binary node %d", kind);
+    }
+}
+
+// Address of an lvalue
+static int lower_addr(Node *nd) {
+    if (nd->kind == ND_VAR) {
+        int dst                           = new_vreg();
+        new_insn(IR_ADDR, dst, 0, 0)->var = nd->var;
+        return dst;
+    }
+    if (nd->kind == ND_DEREF) {
+        return lower_expr(nd->lhs);
+    }
+    error_tok(nd->tok, "not an lvalue");
+}
+
+// a && b, a || b
+static int lower_logical(Node *nd) {
+    BasicBlock *rhs_bb   = new_block();
+    BasicBlock *short_bb = new_block();
+    BasicBlock *end_bb   = new_block();
+    int dst              = new_vreg();
+
+    int lhs = lower_expr(nd->lhs);
+    if (nd->kind == ND_LOGAND) {
+        new_br(lhs, rhs_bb, short_bb);
+    } else {
+        new_br(lhs, short_bb, rhs_bb);
+    }
+
+    start_block(rhs_bb);
+    int rhs = lower_expr(nd->rhs);
+    new_insn(IR_NE, dst, rhs, new_imm(0));
+    new_jmp(end_bb);
+
+    // the left side alone decided the result
+    start_block(short_bb);
+    new_insn(IR_IMM, dst, 0, 0)->imm = nd->kind == ND_LOGOR;
+    new_jmp(end_bb);
+
+    start_block(end_bb);
+    return dst;
+}
+
+// Branch on cond. Comparisons branch on their operands without a boolean in between,
+// and a comparison with zero uses no register for the zero.
+static void lower_cond(Node *cond, BasicBlock *then, BasicBlock *els) {
+    switch (cond->kind) {
+        case ND_NOT:
+            lower_cond(cond->lhs, els, then);
+            return;
+        case ND_LOGAND:
+        case ND_LOGOR: {
+            BasicBlock *rhs_bb = new_block();
+            if (cond->kind == ND_LOGAND) {
+                lower_cond(cond->lhs, rhs_bb, els);
+            } else {
+                lower_cond(cond->lhs, then, rhs_bb);
+            }
+            start_block(rhs_bb);
+            lower_cond(cond->rhs, then, els);
+            return;
+        }
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE: {
+            int a        = is_zero(cond->lhs) ? 0 : lower_expr(cond->lhs);
+            int b        = is_zero(cond->rhs) ? 0 : lower_expr(cond->rhs);
+            IrInsn *insn = new_insn(IR_BR, 0, a, b);
+            insn->cmp    = binary_op(cond->kind);
+            insn->then   = then;
+            insn->els    = els;
+            return;
+        }
+        default:
+            new_br(lower_expr(cond), then, els);
+            return;
+    }
+}
+
+static int lower_funccall(Node *nd) {
+    int num_args = 0;
+    for (Node *arg = nd->args; arg != NULL; arg = arg->next) {
+        num_args++;
+    }
+    if (num_args > 6) {
+        error_tok(nd->tok, "too many arguments");
+    }
+
+    int *args = arena_alloc_kind(MEM_IR, sizeof(int) * (num_args ? num_args : 1));
+    int i     = 0;
+    for (Node *arg = nd->args; arg != NULL; arg = arg->next) {
+        args[i++] = lower_expr(arg);
+    }
+
+    int dst         = new_vreg();
+    IrInsn *insn    = new_insn(IR_CALL, dst, 0, 0);
+    insn->func_name = nd->func_name;
+    insn->args      = args;
+    insn->num_args  = num_args;
+    return dst;
+}
+
+// Lower an expression, returns the virtual register holding its value
+static int lower_expr(Node *nd) {
+    int dst;
+    switch (nd->kind) {
+        case ND_NUM:
+            return new_imm(nd->val);
+        case ND_VAR:
+            if (nd->var->vreg) {
+                return nd->var->vreg;
+            }
+            dst                                = new_vreg();
+            new_insn(IR_LDVAR, dst, 0, 0)->var = nd->var;
+            return dst;
+        case ND_ASSIGN: {
+            if (nd->lhs->kind == ND_VAR) {
+                int val = lower_expr(nd->rhs);
+                int var = nd->lhs->var->vreg;
+                if (var) {
+                    // let the instruction computing a fresh temporary write the variable
+                    if (val > s_last_var_vreg && s_bb->last && s_bb->last->dst == val) {
+                        s_bb->last->dst = var;
+                    } else {
+                        new_insn(IR_MOV, var, val, 0);
+                    }
+                    return var;
+                }
+                new_insn(IR_STVAR, 0, val, 0)->var = nd->lhs->var;
+                return val;
+            }
+            if (nd->lhs->kind != ND_DEREF) {
+                error_tok(nd->lhs->tok, "not an lvalue");
+            }
+            int val  = lower_expr(nd->rhs);
+            int addr = lower_expr(nd->lhs->lhs);
+            new_insn(IR_STORE, 0, addr, val);
+            return val;
+        }
+        case ND_ADDR:
+            return lower_addr(nd->lhs);
+        case ND_DEREF:
+            dst = new_vreg();
+            new_insn(IR_LOAD, dst, lower_expr(nd->lhs), 0);
+            return dst;
+        case ND_NEG:
+        case ND_NOT:
+        case ND_BITNOT: {
+            IrOp op = nd->kind == ND_NEG ? IR_NEG : nd->kind == ND_NOT ? IR_NOT : IR_BITNOT;
+            int a   = lower_expr(nd->lhs);
+            dst     = new_vreg();
+            new_insn(op, dst, a, 0);
+            return dst;
+        }
+        case ND_LOGAND:
+        case ND_LOGOR:
+            return lower_logical(nd);
+        case ND_COMMA:
+            lower_expr(nd->lhs);
+            return lower_expr(nd->rhs);
+        case ND_FUNCCALL:
+            return lower_funccall(nd);
+        case ND_MUL:
+        case ND_DIV:
+        case ND_MOD:
+            if (nd->rhs->kind == ND_NUM) {
+                IrOp op = nd->kind == ND_MUL ? IR_MULI : nd->kind == ND_DIV ? IR_DIVI : IR_MODI;
+
+                int a        = lower_expr(nd->lhs);
+                dst          = new_vreg();
+                IrInsn *insn = new_insn(op, dst, a, 0);
+                insn->imm    = nd->rhs->val;
+                return dst;
+            }
+            // fallthrough
+        default: {
+            int a = lower_expr(nd->lhs);
+            int b = lower_expr(nd->rhs);
+            dst   = new_vreg();
+            new_insn(binary_op(nd->kind), dst, a, b);
+            return dst;
+        }
+    }
+}
+
+static void lower_stmt(Node *nd) {
+    switch (nd->kind) {
+        case ND_IF: {
+            BasicBlock *then_bb = new_block();
+            BasicBlock *else_bb = new_block();
+            BasicBlock *end_bb  = nd->els ? new_block() : else_bb;
+            lower_cond(nd->cond, then_bb, else_bb);
+            start_block(then_bb);
+            lower_stmt(nd->then);
+            new_jmp(end_bb);
+            if (nd->els) {
+                start_block(else_bb);
+                lower_stmt(nd->els);
+                new_jmp(end_bb);
+            }
+            start_block(end_bb);
+            return;
+        }
+        case ND_FOR: {
+            // rotated into init; if (cond) do { body; inc; } while (cond), so an iteration
+            // takes one branch. The empty preheader is where licm() hoists code to.
+            BasicBlock *pre_bb  = new_block();
+            BasicBlock *body_bb = new_block();
+            BasicBlock *end_bb  = new_block();
+            if (nd->init) {
+                lower_stmt(nd->init);
+            }
+            if (nd->cond) {
+                lower_cond(nd->cond, pre_bb, end_bb);
+            }
+            start_block(pre_bb);
+            start_block(body_bb);
+            lower_stmt(nd->then);
+            if (nd->inc) {
+                lower_expr(nd->inc);
+            }
+            if (nd->cond) {
+                lower_cond(nd->cond, body_bb, end_bb);
+            } else {
+                new_jmp(body_bb);
+            }
+            start_block(end_bb);
+            return;
+        }
+        case ND_BLOCK:
+            for (Node *n = nd->body; n != NULL; n = n->next) {
+                lower_stmt(n);
+            }
+            return;
+        case ND_EXPR_STMT:
+            lower_expr(nd->lhs);
+            return;
+        case ND_RETURN:
+            new_insn(IR_RET, 0, lower_expr(nd->lhs), 0);
+            return;
+        default:
+            error_tok(nd->tok, "invalid stmt");
+    }
+}
+
+// Variables whose address is taken have to stay in the frame
+static void mark_addr_taken(Node *nd) {
+    for (; nd != NULL; nd = nd->next) {
+        if (nd->kind == ND_ADDR && nd->lhs->kind == ND_VAR) {
+            nd->lhs->var->vreg = 0;
+        }
+        mark_addr_taken(nd->lhs);
+        mark_addr_taken(nd->rhs);
+        mark_addr_taken(nd->body);
+        mark_addr_taken(nd->cond);
+        mark_addr_taken(nd->then);
+        mark_addr_taken(nd->els);
+        mark_addr_taken(nd->init);
+        mark_addr_taken(nd->inc);
+        mark_addr_taken(nd->args);
+    }
+}
+
+static void add_edge(BasicBlock *from, BasicBlock *to) {
+    from->succs[from->num_succs++] = to;
+    to->num_preds++;
+}
+
+static void mark_reachable(BasicBlock *bb, bool *reachable) {
+    while (!reachable[bb->id]) {
+        reachable[bb->id] = true;
+        if (bb->num_succs == 0) {
+            return;
+        }
+        if (bb->num_succs == 2) {
+            mark_reachable(bb->succs[1], reachable);
+        }
+        bb = bb->succs[0];
+    }
+}
+
+// Fill in successor and predecessor edges and drop unreachable blocks
+static void build_cfg(IrFunc *fn) {
+    for (BasicBlock *bb = fn->blocks; bb != NULL; bb = bb->next) {
+        IrInsn *term = bb->last;
+        if (term->op == IR_JMP) {
+            add_edge(bb, term->then);
+        } else if (term->op == IR_BR) {
+            add_edge(bb, term->then);
+            if (term->els != term->then) {
+                add_edge(bb, term->els);
+            }
+        }
+    }
+
+    bool *reachable = arena_alloc(sizeof(bool) * fn->num_blocks);
+    mark_reachable(fn->blocks, reachable);
+
+    BasicBlock head = {};
+    BasicBlock *cur = &head;
+    for (BasicBlock *bb = fn->blocks; bb != NULL; bb = bb->next) {
+        if (reachable[bb->id]) {
+            cur = cur->next = bb;
+            continue;
+        }
+        for (int i = 0; i < bb->num_succs; i++) {
+            bb->succs[i]->num_preds--;
+        }
+    }
+    cur->next = NULL;
+
+    int id = 0;
+    for (BasicBlock *bb = head.next; bb != NULL; bb = bb->next) {
+        int n         = bb->num_preds ? bb->num_preds : 1;
+        bb->id        = id++;
+        bb->preds     = arena_alloc_kind(MEM_IR, sizeof(BasicBlock *) * n);
+        bb->num_preds = 0;
+    }
+    for (BasicBlock *bb = head.next; bb != NULL; bb = bb->next) {
+        for (int i = 0; i < bb->num_succs; i++) {
+            BasicBlock *succ               = bb->succs[i];
+            succ->preds[succ->num_preds++] = bb;
+        }
+    }
+    fn->blocks     = head.next;
+    fn->num_blocks = id;
+}
+
+static IrFunc *lower_function(Function *func) {
+    s_fn       = arena_alloc_kind(MEM_IR, sizeof(IrFunc));
+    s_fn->func = func;
+    s_bb       = NULL;
+    s_tail     = NULL;
+    start_block(new_block());
+
+    for (Object *var = func->locals; var != NULL; var = var->next) {
+        var->vreg = new_vreg();
+    }
+    s_last_var_vreg = s_fn->num_vregs;
+    mark_addr_taken(func->body);
+
+    int i = 0;
+    for (Object *param = func->params; param != NULL; param = param->next) {
+        if (param->vreg) {
+            new_insn(IR_PARAM, param->vreg, 0, 0)->imm = i++;
+        } else {
+            int dst                            = new_vreg();
+            new_insn(IR_PARAM, dst, 0, 0)->imm = i++;
+            new_insn(IR_STVAR, 0, dst, 0)->var = param;
+        }
+    }
+
+    lower_stmt(func->body);
+    // falling off the end returns whatever is in a0, like the AST code generator
+    if (!is_terminated(s_bb)) {
+        new_insn(IR_RET, 0, 0, 0);
+    }
+
+    build_cfg(s_fn);
+    return s_fn;
+}
+
+IrFunc *lower(Function *prog) {
+    IrFunc head = {};
+    IrFunc *cur = &head;
+    for (Function *func = prog; func != NULL; func = func->next) {
+        cur = cur->next = lower_function(func);
+    }
+    return head.next;
+}
+
+// Virtual registers read by insn
+int insn_uses(IrInsn *insn, int *uses) {
+    if (insn->op == IR_CALL) {
+        memcpy(uses, insn->args, sizeof(int) * insn->num_args);
+        return insn->num_args;
+    }
+    int n = 0;
+    if (insn->a) {
+        uses[n++] = insn->a;
+    }
+    if (insn->b) {
+        uses[n++] = insn->b;
+    }
+    return n;
+}
+
+static const char *op_names[] = {
+    [IR_IMM] = "imm",   [IR_MOV] = "mov",     [IR_PARAM] = "param", [IR_ADD] = "add",
+    [IR_SUB] = "sub",   [IR_MUL] = "mul",     [IR_DIV] = "div",     [IR_MOD] = "mod",
+    [IR_SHL] = "shl",   [IR_SHR] = "shr",     [IR_AND] = "and",     [IR_OR] = "or",
+    [IR_XOR] = "xor",   [IR_EQ] = "eq",       [IR_NE] = "ne",       [IR_LT] = "lt",
+    [IR_LE] = "le",     [IR_MULI] = "muli",   [IR_DIVI] = "divi",   [IR_MODI] = "modi",
+    [IR_NEG] = "neg",     [IR_NOT] = "not",     [IR_BITNOT] = "bitnot",
+    [IR_ADDR] = "addr", [IR_LDVAR] = "ldvar", [IR_STVAR] = "stvar", [IR_LOAD] = "load",
+    [IR_STORE] = "store", [IR_CALL] = "call", [IR_JMP] = "jmp",     [IR_BR] = "br",
+    [IR_RET] = "ret",
+};
+
+static void dump_insn(IrInsn *insn) {
+    const char *op = op_names[insn->op];
+    switch (insn->op) {
+        case IR_IMM:
+            emit("    v%d = %s %d", insn->dst, op, insn->imm);
+            return;
+        case IR_MOV:
+        case IR_NEG:
+        case IR_NOT:
+        case IR_BITNOT:
+        case IR_LOAD:
+            emit("    v%d = %s v%d", insn->dst, op, insn->a);
+            return;
+        case IR_PARAM:
+            emit("    v%d = %s %d", insn->dst, op, insn->imm);
+            return;
+        case IR_MULI:
+        case IR_DIVI:
+        case IR_MODI:
+            emit("    v%d = %s v%d, %d", insn->dst, op, insn->a, insn->imm);
+            return;
+        case IR_ADDR:
+        case IR_LDVAR:
+            emit("    v%d = %s %s", insn->dst, op, insn->var->name);
+            return;
+        case IR_STVAR:
+            emit("    %s %s, v%d", op, insn->var->name, insn->a);
+            return;
+        case IR_STORE:
+            emit("    %s v%d, v%d", op, insn->a, insn->b);
+            return;
+        case IR_CALL: {
+            char buf[128];
+            int len = 0;
+            for (int i = 0; i < insn->num_args; i++) {
+                len += snprintf(buf + len, sizeof(buf) - len, i ? ", v%d" : "v%d", insn->args[i]);
+            }
+            buf[len] = '\0';
+            emit("    v%d = %s %s(%s)", insn->dst, op, insn->func_name, buf);
+            return;
+        }
+        case IR_JMP:
+            emit("    %s bb%d", op, insn->then->id);
+            return;
+        case IR_BR:
+            if (insn->cmp == IR_NE && insn->b == 0) {
+                emit("    %s v%d, bb%d, bb%d", op, insn->a, insn->then->id, insn->els->id);
+            } else {
+                char a[16];
+                char b[16];
+                snprintf(a, sizeof(a), insn->a ? "v%d" : "%d", insn->a);
+                snprintf(b, sizeof(b), insn->b ? "v%d" : "%d", insn->b);
+                emit("    %s %s %s, %s, bb%d, bb%d", op, op_names[insn->cmp], a, b, insn->then->id,
+                     insn->els->id);
+            }
+            return;
+        case IR_RET:
+            if (insn->a) {
+                emit("    %s v%d", op, insn->a);
+            } else {
+                emit("    %s", op);
+            }
+            return;
+        default:
+            emit("    v%d = %s v%d, v%d", insn->dst, op, insn->a, insn->b);
+            return;
+    }
+}
+
+void dump_ir(IrFunc *prog) {
+    for (IrFunc *fn = prog; fn != NULL; fn = fn->next) {
+        emit("func %s", fn->func->name);
+        for (BasicBlock *bb = fn->blocks; bb != NULL; bb = bb->next) {
+            if (bb->num_preds == 0) {
+                emit("bb%d:", bb->id);
+            } else {
+                char buf[256];
+                int len = 0;
+                for (int i = 0; i < bb->num_preds && len < (int)sizeof(buf) - 16; i++) {
+                    len += snprintf(buf + len, sizeof(buf) - len, " bb%d", bb->preds[i]->id);
+                }
+                emit("bb%d:%*s# preds:%s", bb->id, 8, "", buf);
+            }
+            for (IrInsn *insn = bb->insns; insn != NULL; insn = insn->next) {
+                dump_insn(insn);
+            }
+        }
+        emit("");
+    }
+}
@@ -0,0 +1,95 @@
+#include "rvcc.h"
+
+#include "librvcc.h"
+
+// The library API on top of compile_source(). A call runs the whole compilation on the
+// calling thread with the options and handlers of the context, and puts back those
+// the thread had before.
+
+struct RvccContext {
+    Options opts;
+    ErrorHandler handler;
+};
+
+static void *lib_alloc(RvccContext *ctx, size_t size) {
+    if (ctx->opts.alloc != NULL) {
+        return ctx->opts.alloc(ctx->opts.alloc_ctx, size);
+    }
+    return malloc(size);
+}
+
+void rvcc_free(RvccContext *ctx, void *ptr) {
+    if (ctx->opts.free != NULL) {
+        ctx->opts.free(ctx->opts.alloc_ctx, ptr);
+    } else {
+        free(ptr);
+    }
+}
+
+RvccContext *rvcc_create(const RvccOptions *opts) {
+    RvccOptions defaults = {};
+    if (opts == NULL) {
+        opts = &defaults;
+    }
+    if ((opts->alloc == NULL) != (opts->free == NULL)) {
+        return NULL;
+    }
+
+    Options o = {
+        .comments        = opts->verbose_asm,
+        .ir_backend      = opts->ir_backend,
+        .codegen_threads = opts->codegen_threads > 1 ? opts->codegen_threads : 1,
+        .alloc           = opts->alloc,
+        .free            = opts->free,
+        .alloc_ctx       = opts->alloc_user,
+    };
+    set_opt_level(&o, opts->opt_level);
+    RvccContext *ctx = o.alloc != NULL ? o.alloc(o.alloc_ctx, sizeof(RvccContext))
+                                       : malloc(sizeof(RvccContext));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->opts    = o;
+    ctx->handler = (ErrorHandler){opts->diagnostic, opts->diagnostic_user};
+    return ctx;
+}
+
+void rvcc_destroy(RvccContext *ctx) {
+    if (ctx != NULL) {
+        rvcc_free(ctx, ctx);
+    }
+}
+
+int rvcc_compile(RvccContext *ctx, const char *src, size_t len, char **out, size_t *out_len) {
+    char *buf = lib_alloc(ctx, len + 1);
+    if (buf == NULL) {
+        return -1;
+    }
+    memcpy(buf, src, len);
+    buf[len] = '\0';
+
+    Options saved_opts    = g_opts;
+    ErrorHandler saved    = error_handler();
+    SourceFile saved_file = current_source();
+    g_opts                = ctx->opts;
+    error_set_handler(ctx->handler);
+
+    size_t n;
+    char *code = compile_source(buf, &n);
+    // the thread may never compile again, its buffers go back while the context's
+    // allocator is still the one of the thread
+    peephole_release();
+
+    g_opts = saved_opts;
+    error_set_handler(saved);
+    set_current_source(saved_file);
+    rvcc_free(ctx, buf);
+    if (code == NULL) {
+        return -1;
+    }
+
+    // the code was captured in the caller's memory
+    *out     = code;
+    *out_len = n;
+    return 0;
+}
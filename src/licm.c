@@ -0,0 +1,224 @@
+#include "rvcc.h"
+
+// Loop-invariant code motion. lower() leaves every loop rotated with an empty preheader
+// in front of its first block, and as the source has no goto the blocks of a loop are
+// the ones laid out from its first block to the block that jumps back. Instructions
+// whose operands are not defined in the loop compute the same value on every iteration
+// and move to the preheader, which runs only when the loop is entered.
+//
+// Only single-definition registers that are not used outside the loop move. Loads from
+// the frame move if the loop stores to neither the variable nor memory nor calls, loads
+// through a pointer also need to be in the first block, which runs on every iteration.
+//
+// Constants that fit an immediate stay where they are: in the preheader they would hold
+// a register through the whole loop, a callee-saved one once the temporaries run out,
+// where the backend folds them into the instruction using them. One that is the single
+// operand of an instruction that moves goes along with it.
+
+typedef struct {
+    BasicBlock *first;
+    BasicBlock *last;
+    BasicBlock *preheader;
+    // definitions in the loop, by virtual register, and the last one and its block
+    int *defs;
+    IrInsn **def_insns;
+    BasicBlock **def_blocks;
+    // uses in the loop, by virtual register
+    int *uses;
+    // registers used before or after the loop
+    bool *used_outside;
+    // the loop writes memory other than its IR_STVAR variables
+    bool writes_memory;
+    Object **stored_vars;
+    int num_stored_vars;
+} Loop;
+
+static bool in_loop(Loop *loop, BasicBlock *bb) {
+    return loop->first->id <= bb->id && bb->id <= loop->last->id;
+}
+
+static bool stores_var(Loop *loop, Object *var) {
+    for (int i = 0; i < loop->num_stored_vars; i++) {
+        if (loop->stored_vars[i] == var) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_small_imm(IrInsn *insn) {
+    return insn->op == IR_IMM && -2048 <= insn->imm && insn->imm <= 2047;
+}
+
+// Whether reg is a small constant defined in the loop for a single instruction
+static bool is_own_imm(Loop *loop, int reg, int *fn_defs) {
+    return loop->def_insns[reg] != NULL && is_small_imm(loop->def_insns[reg]) &&
+           fn_defs[reg] == 1 && loop->uses[reg] == 1 && !loop->used_outside[reg];
+}
+
+static bool is_invariant(Loop *loop, BasicBlock *bb, IrInsn *insn, int *fn_defs) {
+    switch (insn->op) {
+        case IR_IMM:
+            if (is_small_imm(insn)) {
+                return false;
+            }
+            break;
+        case IR_LDVAR:
+            if (loop->writes_memory || stores_var(loop, insn->var)) {
+                return false;
+            }
+            break;
+        case IR_LOAD:
+            if (loop->writes_memory || loop->num_stored_vars > 0 || bb != loop->first) {
+                return false;
+            }
+            break;
+        case IR_PARAM:
+        case IR_STVAR:
+        case IR_STORE:
+        case IR_CALL:
+        case IR_JMP:
+        case IR_BR:
+        case IR_RET:
+            return false;
+        default:
+            break;
+    }
+    if (fn_defs[insn->dst] != 1 || loop->used_outside[insn->dst]) {
+        return false;
+    }
+    int uses[IR_MAX_USES];
+    int num_uses = insn_uses(insn, uses);
+    for (int i = 0; i < num_uses; i++) {
+        if (loop->defs[uses[i]] != 0 && !is_own_imm(loop, uses[i], fn_defs)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Insert insn before the jump that ends bb
+static void insert_before_end(BasicBlock *bb, IrInsn *insn) {
+    IrInsn **p = &bb->insns;
+    while (*p != bb->last) {
+        p = &(*p)->next;
+    }
+    insn->next = bb->last;
+    *p         = insn;
+}
+
+// Unlink insn from bb, returns the link that pointed to it
+static IrInsn **unlink_insn(BasicBlock *bb, IrInsn *insn) {
+    IrInsn **p = &bb->insns;
+    while (*p != insn) {
+        p = &(*p)->next;
+    }
+    *p = insn->next;
+    return p;
+}
+
+static void hoist(IrFunc *fn, BasicBlock *first, BasicBlock *last, int *fn_defs) {
+    Loop loop = {.first = first, .last = last};
+    int preds = 0;
+    for (int i = 0; i < first->num_preds; i++) {
+        if (!in_loop(&loop, first->preds[i])) {
+            loop.preheader = first->preds[i];
+            preds++;
+        }
+    }
+    if (preds != 1 || loop.preheader->num_succs != 1) {
+        return;
+    }
+
+    int num_locals = 0;
+    for (Object *var = fn->func->locals; var != NULL; var = var->next) {
+        num_locals++;
+    }
+    loop.defs         = arena_alloc(sizeof(int) * (fn->num_vregs + 1));
+    loop.def_insns    = arena_alloc(sizeof(IrInsn *) * (fn->num_vregs + 1));
+    loop.def_blocks   = arena_alloc(sizeof(BasicBlock *) * (fn->num_vregs + 1));
+    loop.uses         = arena_alloc(sizeof(int) * (fn->num_vregs + 1));
+    loop.used_outside = arena_alloc(sizeof(bool) * (fn->num_vregs + 1));
+    loop.stored_vars  = arena_alloc(sizeof(Object *) * (num_locals + 1));
+    for (BasicBlock *bb = fn->blocks; bb != NULL; bb = bb->next) {
+        bool inside = in_loop(&loop, bb);
+        for (IrInsn *insn = bb->insns; insn != NULL; insn = insn->next) {
+            int uses[IR_MAX_USES];
+            int num_uses = insn_uses(insn, uses);
+            for (int i = 0; i < num_uses; i++) {
+                if (inside) {
+                    loop.uses[uses[i]]++;
+                } else {
+                    loop.used_outside[uses[i]] = true;
+                }
+            }
+            if (!inside) {
+                continue;
+            }
+            loop.defs[insn->dst]++;
+            loop.def_insns[insn->dst]  = insn;
+            loop.def_blocks[insn->dst] = bb;
+            if (insn->op == IR_STORE || insn->op == IR_CALL) {
+                loop.writes_memory = true;
+            } else if (insn->op == IR_STVAR && !stores_var(&loop, insn->var)) {
+                loop.stored_vars[loop.num_stored_vars++] = insn->var;
+            }
+        }
+    }
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (BasicBlock *bb = first;; bb = bb->next) {
+            IrInsn **p = &bb->insns;
+            while (*p != NULL) {
+                IrInsn *insn = *p;
+                if (!is_invariant(&loop, bb, insn, fn_defs)) {
+                    p = &insn->next;
+                    continue;
+                }
+                *p = insn->next;
+                // its constants first
+                int uses[IR_MAX_USES];
+                int num_uses = insn_uses(insn, uses);
+                for (int i = 0; i < num_uses; i++) {
+                    if (loop.defs[uses[i]] == 0) {
+                        continue;
+                    }
+                    IrInsn *imm   = loop.def_insns[uses[i]];
+                    IrInsn **link = unlink_insn(loop.def_blocks[uses[i]], imm);
+                    if (p == &imm->next) {
+                        p = link;
+                    }
+                    insert_before_end(loop.preheader, imm);
+                    loop.defs[uses[i]]--;
+                }
+                insert_before_end(loop.preheader, insn);
+                loop.defs[insn->dst]--;
+                changed = true;
+            }
+            if (bb == last) {
+                break;
+            }
+        }
+    }
+}
+
+void licm(IrFunc *prog) {
+    for (IrFunc *fn = prog; fn != NULL; fn = fn->next) {
+        int *defs = arena_alloc(sizeof(int) * (fn->num_vregs + 1));
+        for (BasicBlock *bb = fn->blocks; bb != NULL; bb = bb->next) {
+            for (IrInsn *insn = bb->insns; insn != NULL; insn = insn->next) {
+                defs[insn->dst]++;
+            }
+        }
+        // a block jumping back ends a loop; inner loops end first and are done first,
+        // what they hoist may then move out of the outer loop
+        for (BasicBlock *bb = fn->blocks; bb != NULL; bb = bb->next) {
+            for (int i = 0; i < bb->num_succs; i++) {
+                if (bb->succs[i]->id <= bb->id) {
+                    hoist(fn, bb->succs[i], bb, defs);
+                }
+            }
+        }
+    }
+}
@@ -1,20 +1,296 @@
 #include "rvcc.h"
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "%s: invalid number of arguments, require 2 arguments, but provided %d", argv[1], argc);
-        return -1;
+#include <unistd.h>
+
+// output file of a single input, stdout by default
+static char *opt_o;
+// input files, "-" reads stdin
+static char **inputs;
+static int num_inputs;
+// files compiled at once
+static int opt_jobs = 1;
+// serve requests from stdin, or from a Unix socket
+static bool opt_batch;
+static char *opt_server;
+// -finline-limit=, -1 leaves the one of -O
+static int opt_inline_limit = -1;
+
+static void usage(int status) {
+    fprintf(stderr,
+            "usage: rvcc [-o <path>] [-O0 | -O1] [-fverbose-asm | -fno-verbose-asm] [-fir-backend] "
+            "[-fomit-frame-pointer | -fno-omit-frame-pointer] [-foptimize-sibling-calls | "
+            "-fno-optimize-sibling-calls] [-fmove-loop-invariants | -fno-move-loop-invariants] "
+            "[-finline-limit=<n>] [-ftime-report] [-fmem-report] "
+            "[-freport-format=text|json] [-fcodegen-threads=<n>] [-j <n>] [--cache-dir <dir>] "
+            "[--emit-ir] <file>... | --batch | --server=<socket>\n");
+    exit(status);
+}
+
+// Thread count of -fcodegen-threads= and -j
+static int parse_threads(const char *opt, const char *arg) {
+    char *end;
+    long n = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || n < 1 || n > 256) {
+        error("invalid argument: %s %s", opt, arg);
     }
+    return n;
+}
+
+static void parse_args(int argc, char **argv) {
+    inputs = calloc(argc, sizeof(char *));
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--help")) {
+            usage(0);
+        }
+
+        if (!strcmp(argv[i], "-o")) {
+            if (++i == argc) {
+                usage(1);
+            }
+            opt_o = argv[i];
+            continue;
+        }
+
+        if (!strncmp(argv[i], "-o", 2)) {
+            opt_o = argv[i] + 2;
+            continue;
+        }
+
+        // annotate the assembly with explanatory comments
+        if (!strcmp(argv[i], "-fverbose-asm")) {
+            g_opts.comments = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fno-verbose-asm")) {
+            g_opts.comments = false;
+            continue;
+        }
+
+        // -O is -O1
+        if (!strcmp(argv[i], "-O0") || !strcmp(argv[i], "-O1") || !strcmp(argv[i], "-O")) {
+            set_opt_level(&g_opts, strcmp(argv[i], "-O0") != 0);
+            continue;
+        }
+
+        // inline functions of up to n AST nodes, whatever the -O
+        if (!strncmp(argv[i], "-finline-limit=", 15)) {
+            char *end;
+            long n = strtol(argv[i] + 15, &end, 10);
+            if (argv[i][15] == '\0' || *end != '\0' || n < 0 || n > 100000) {
+                error("invalid argument: %s", argv[i]);
+            }
+            opt_inline_limit = n;
+            continue;
+        }
+
+        // address the frame from sp and keep fp free
+        if (!strcmp(argv[i], "-fomit-frame-pointer")) {
+            g_opts.omit_fp = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fno-omit-frame-pointer")) {
+            g_opts.omit_fp = false;
+            continue;
+        }
+
+        // return f(...) leaves the frame and jumps to f, keeping the stack flat
+        if (!strcmp(argv[i], "-foptimize-sibling-calls")) {
+            g_opts.tail_calls = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fno-optimize-sibling-calls")) {
+            g_opts.tail_calls = false;
+            continue;
+        }
+
+        // hoist loop-invariant code out of loops in the IR
+        if (!strcmp(argv[i], "-fmove-loop-invariants")) {
+            g_opts.licm = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fno-move-loop-invariants")) {
+            g_opts.licm = false;
+            continue;
+        }
+
+        // time spent per phase, and memory and output sizes, printed to stderr
+        if (!strcmp(argv[i], "-ftime-report")) {
+            report_set_time(true);
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fmem-report")) {
+            report_set_mem(true);
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-freport-format=json") || !strcmp(argv[i], "-freport-format=text")) {
+            report_set_json(strcmp(argv[i], "-freport-format=json") == 0);
+            continue;
+        }
+
+        // generate the code of several functions at once
+        if (!strncmp(argv[i], "-fcodegen-threads=", 18)) {
+            g_opts.codegen_threads = parse_threads("-fcodegen-threads=", argv[i] + 18);
+            continue;
+        }
+
+        // reuse the code of functions that did not change since an earlier compilation
+        if (!strcmp(argv[i], "--cache-dir")) {
+            if (++i == argc) {
+                usage(1);
+            }
+            g_opts.cache_dir = argv[i];
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--cache-dir=", 12) && argv[i][12] != '\0') {
+            g_opts.cache_dir = argv[i] + 12;
+            continue;
+        }
+
+        // compile several input files at once, each into an output file of its own
+        if (!strcmp(argv[i], "-j")) {
+            if (++i == argc) {
+                usage(1);
+            }
+            opt_jobs = parse_threads("-j", argv[i]);
+            continue;
+        }
 
-    // char *str = "a=3;a;";
-    // Lexical analysis, generate token
-    Token *tok = tokenize(argv[1]);
+        if (!strncmp(argv[i], "-j", 2)) {
+            opt_jobs = parse_threads("-j", argv[i] + 2);
+            continue;
+        }
 
-    // build ast
-    Function *prog = parse(tok);
+        if (!strcmp(argv[i], "--emit-ir")) {
+            g_opts.emit_ir = true;
+            continue;
+        }
 
-    // codegen
-    codegen(prog);
+        if (!strcmp(argv[i], "-fir-backend")) {
+            g_opts.ir_backend = true;
+            continue;
+        }
 
-    return 0;
-}
\ No newline at end of file
+        if (!strcmp(argv[i], "-fno-ir-backend")) {
+            g_opts.ir_backend = false;
+            continue;
+        }
+
+        // compile many programs in one process, see server.c for the protocol
+        if (!strcmp(argv[i], "--batch")) {
+            opt_batch = true;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--server=", 9) && argv[i][9] != '\0') {
+            opt_server = argv[i] + 9;
+            continue;
+        }
+
+        if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            error("unknown argument: %s", argv[i]);
+        }
+
+        inputs[num_inputs++] = argv[i];
+    }
+
+    if (opt_batch || opt_server != NULL) {
+        if (num_inputs > 0 || opt_o != NULL) {
+            error("%s: --batch and --server take no input or output files", argv[0]);
+        }
+    } else if (num_inputs == 0) {
+        error("%s: no input file", argv[0]);
+    }
+    if (num_inputs > 1) {
+        if (opt_o != NULL) {
+            error("%s: cannot specify -o with multiple input files", argv[0]);
+        }
+        for (int i = 0; i < num_inputs; i++) {
+            if (!strcmp(inputs[i], "-")) {
+                error("%s: cannot read stdin with multiple input files", argv[0]);
+            }
+        }
+    }
+    if (opt_inline_limit >= 0) {
+        g_opts.inline_limit = opt_inline_limit;
+    }
+    // functions from the cache are compiled one by one, none sees the body of another
+    if (g_opts.cache_dir != NULL) {
+        g_opts.inline_limit = 0;
+    }
+    // the IR dump is printed as lowered
+    if (g_opts.emit_ir) {
+        g_opts.peephole = false;
+    }
+}
+
+// One input file and where its code goes
+typedef struct {
+    char *input;
+    char *output;
+    bool failed;
+} Unit;
+
+// foo/bar.c is compiled to bar.s in the current directory
+static char *output_path(const char *input) {
+    const char *base = strrchr(input, '/');
+    base             = base ? base + 1 : input;
+    const char *dot  = strrchr(base, '.');
+    size_t len       = dot && dot != base ? (size_t)(dot - base) : strlen(base);
+    const char *ext  = g_opts.emit_ir ? ".ir" : ".s";
+    char *path       = malloc(len + strlen(ext) + 1);
+    memcpy(path, base, len);
+    strcpy(path + len, ext);
+    return path;
+}
+
+static void compile(void *arg) {
+    Unit *unit   = arg;
+    unit->failed = !compile_file(unit->input, unit->output);
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    if (opt_server != NULL) {
+        server_run(opt_server);
+    }
+    if (opt_batch) {
+        int status = batch_run();
+        report_print();
+        return status;
+    }
+
+    Unit *units  = calloc(num_inputs, sizeof(Unit));
+    void **items = malloc(sizeof(void *) * num_inputs);
+    for (int i = 0; i < num_inputs; i++) {
+        units[i].input  = inputs[i];
+        units[i].output = num_inputs == 1 ? opt_o : output_path(inputs[i]);
+        items[i]        = &units[i];
+    }
+    parallel_run(items, num_inputs, opt_jobs, compile);
+
+    int failed = 0;
+    for (int i = 0; i < num_inputs; i++) {
+        if (units[i].failed) {
+            failed++;
+            // a single file keeps its plain diagnostics
+            if (num_inputs > 1) {
+                fprintf(stderr, "%s: compilation failed\n", units[i].input);
+            }
+        }
+    }
+    report_print();
+    for (int i = 0; num_inputs > 1 && i < num_inputs; i++) {
+        free(units[i].output);
+    }
+    free(units);
+    free(items);
+    free(inputs);
+    return failed ? 1 : 0;
+}
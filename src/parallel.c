@@ -0,0 +1,146 @@
+#include "rvcc.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Thread pools for code generation of independent functions and for compiling
+// several files at once. Each function is generated into a buffer of its own and the
+// buffers are written out in source order, so the output is the same for any number
+// of threads.
+
+typedef struct {
+    void **items;
+    int num_items;
+    void (*fn)(void *item);
+    // next item to hand out
+    atomic_int next;
+    // output of every item, NULL when the items write no code
+    char **bufs;
+    size_t *lens;
+    // options of the compilation, the source diagnostics refer to and where they go
+    Options opts;
+    SourceFile source;
+    ErrorHandler handler;
+    atomic_bool failed;
+} Job;
+
+// Generate one item into a buffer, returns false if it had an error
+static bool gen_item(Job *job, int i) {
+    jmp_buf env;
+    if (setjmp(env) != 0) {
+        error_set_recovery(NULL);
+        emit_abort();
+        report_abort();
+        return false;
+    }
+    error_set_recovery(&env);
+    emit_capture_begin();
+    job->fn(job->items[i]);
+    job->bufs[i] = emit_capture_end(&job->lens[i]);
+    error_set_recovery(NULL);
+    return true;
+}
+
+static void *worker(void *arg) {
+    Job *job = arg;
+    g_opts   = job->opts;
+    if (job->bufs == NULL) {
+        for (int i; (i = atomic_fetch_add(&job->next, 1)) < job->num_items;) {
+            job->fn(job->items[i]);
+        }
+        peephole_release();
+        report_flush();
+        return NULL;
+    }
+
+    set_current_source(job->source);
+    error_set_handler(job->handler);
+    for (int i; (i = atomic_fetch_add(&job->next, 1)) < job->num_items;) {
+        if (!gen_item(job, i)) {
+            // the remaining items are not worth generating
+            atomic_store(&job->failed, true);
+            atomic_store(&job->next, job->num_items);
+        }
+    }
+    // nothing this thread allocated or timed outlives the code it generated
+    peephole_release();
+    report_flush();
+    arena_reset();
+    return NULL;
+}
+
+static void run(Job *job, int threads) {
+    int num_threads   = threads < job->num_items ? threads : job->num_items;
+    pthread_t *thread = heap_alloc(sizeof(pthread_t) * num_threads);
+    if (thread == NULL) {
+        error("out of memory");
+    }
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&thread[i], NULL, worker, job) != 0) {
+            error("cannot create a thread");
+        }
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(thread[i], NULL);
+    }
+    heap_free(thread);
+}
+
+// Call fn on every item from up to threads threads at once
+void parallel_run(void **items, int n, int threads, void (*fn)(void *item)) {
+    if (threads <= 1 || n <= 1) {
+        for (int i = 0; i < n; i++) {
+            fn(items[i]);
+        }
+        return;
+    }
+
+    Job job = {.items = items, .num_items = n, .fn = fn, .opts = g_opts};
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, false);
+    run(&job, threads);
+}
+
+// Call gen on every item, gen writes the code of one item with emit()
+void parallel_codegen(void **items, int n, void (*gen)(void *item)) {
+    if (g_opts.codegen_threads <= 1 || n <= 1) {
+        for (int i = 0; i < n; i++) {
+            gen(items[i]);
+        }
+        return;
+    }
+
+    Job job = {
+        .items     = items,
+        .num_items = n,
+        .fn        = gen,
+        .opts      = g_opts,
+        .source    = current_source(),
+        .handler   = error_handler(),
+    };
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, false);
+    job.bufs = heap_alloc(sizeof(char *) * n);
+    job.lens = heap_alloc(sizeof(size_t) * n);
+    if (job.bufs == NULL || job.lens == NULL) {
+        heap_free(job.bufs);
+        heap_free(job.lens);
+        error("out of memory");
+    }
+    memset(job.bufs, 0, sizeof(char *) * n);
+    run(&job, g_opts.codegen_threads);
+
+    bool failed = atomic_load(&job.failed);
+    for (int i = 0; i < n; i++) {
+        if (!failed) {
+            emit_raw(job.bufs[i], job.lens[i]);
+        }
+        heap_free(job.bufs[i]);
+    }
+    heap_free(job.bufs);
+    heap_free(job.lens);
+    // the error was reported by the thread that ran into it
+    if (failed) {
+        error_exit();
+    }
+}
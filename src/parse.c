@@ -1,24 +1,64 @@
 #include "rvcc.h"
 
-Object *g_locals = NULL;
+// All locals of the function being parsed, in declaration order (newest first)
+_Thread_local Object *g_locals = NULL;
+
+// A declaration visible in some scope, it hides the previous one with the same name
+typedef struct VarBinding VarBinding;
+struct VarBinding {
+    Object *var;
+    // interned name
+    int id;
+    VarBinding *shadowed;
+    // next declaration of the same scope
+    VarBinding *next;
+};
+
+typedef struct Scope Scope;
+struct Scope {
+    Scope *next;
+    VarBinding *vars;
+};
+
+// Innermost visible declaration of every name, indexed by interned identifier id
+static _Thread_local VarBinding **s_var_bindings = NULL;
+static _Thread_local Scope *s_scope              = NULL;
+
+static void enter_scope(void) {
+    Scope *sc = arena_alloc(sizeof(Scope));
+    sc->next  = s_scope;
+    s_scope   = sc;
+}
 
-static char *get_ident(const Token *tok) {
-    if (tok->kind != TK_IDENT) {
-        error_tok(tok, "expect a variable name");
+static void leave_scope(void) {
+    for (VarBinding *b = s_scope->vars; b != NULL; b = b->next) {
+        s_var_bindings[b->id - ID_IDENT] = b->shadowed;
     }
-    return strndup(tok->loc, tok->len);
+    s_scope = s_scope->next;
+}
+
+static void push_var(Object *var, int id) {
+    VarBinding *b = arena_alloc(sizeof(VarBinding));
+    b->var        = var;
+    b->id         = id;
+    b->shadowed   = s_var_bindings[id - ID_IDENT];
+    b->next       = s_scope->vars;
+    s_scope->vars = b;
+
+    s_var_bindings[id - ID_IDENT] = b;
 }
 
-static bool is_var_decl(Token *tok) {
-    static char *types[] = {"int"};
-    for (size_t i = 0; i < sizeof(types) / sizeof(*types); ++i) {
-        return str_equal(tok, types[i]);
+static const char *get_ident(const Token *tok) {
+    if (tok->kind != TK_IDENT) {
+        error_tok(tok, "expect a variable name");
     }
-    return false;
+    return intern_name(tok->id);
 }
 
+static bool is_var_decl(Token *tok) { return equal(tok, ID_INT); }
+
 static Node *new_node(NodeKind kind, Token *tok) {
-    Node *nd = calloc(1, sizeof(Node));
+    Node *nd = arena_alloc_kind(MEM_NODE, sizeof(Node));
     nd->kind = kind;
     nd->tok  = tok;
 
@@ -109,31 +149,24 @@ static Node *new_var_node(Object *obj, Token *tok) {
     return nd;
 }
 
-static Object *new_var_object(const char *name, Type *type) {
-    Object *obj = calloc(1, sizeof(Object));
-    obj->name   = name;
+static Object *new_var_object(Token *name, Type *type) {
+    Object *obj = arena_alloc_kind(MEM_OBJECT, sizeof(Object));
+    obj->name   = get_ident(name);
     obj->next   = g_locals;
     obj->type   = type;
     g_locals    = obj;
+    push_var(obj, name->id);
     return obj;
 }
 
 static Object *find_var(Token *tok) {
-    for (Object *var = g_locals; var != NULL; var = var->next) {
-        if (strlen(var->name) == tok->len && !strncmp(var->name, tok->loc, tok->len)) {
-            return var;
-        }
-    }
-    return NULL;
-}
-
-bool str_equal(Token *tok, const char *str) {
-    return memcmp(tok->loc, str, tok->len) == 0 && str[tok->len] == '\0';
+    VarBinding *b = s_var_bindings[tok->id - ID_IDENT];
+    return b ? b->var : NULL;
 }
 
-static Token *skip(Token *tok, const char *str) {
-    if (!str_equal(tok, str)) {
-        error_tok(tok, "expected %s", str);
+static Token *skip(Token *tok, TokenId id) {
+    if (!equal(tok, id)) {
+        error_tok(tok, "expected %s", id_spelling(id));
     }
     return tok->next;
 }
@@ -158,22 +191,14 @@ static Token *skip(Token *tok, const char *str) {
  * param = declspec declarator
  *
  * express_stmt = expr?;
- * expr = assign
- * assign = equality (=assign)? equality = relational (==relational | !=relational)*
- * relational = add (<add | <=add | >add | >=add)*
- * add = mul (+mul | -mul)*
- * mul = unary (*unary | /unary)*
- * unary = (+ | - | & | *)(unary | primary)
+ * expr = unary (binop unary)*, by precedence climbing over binary_ops
+ * binop = = | || | && | "|" | ^ | & | == | != | < | <= | > | >= | << | >> | + | - | * | / | %
+ * unary = (+ | - | & | * | ! | ~)(unary | primary)
  * primary = expr | num | ident | func_call
  * func_call = ident( (expr(,expr)*)? )
  */
 static Node *primary(Token **rest, Token *tok);
 static Node *unary(Token **rest, Token *tok);
-static Node *mul(Token **rest, Token *tok);
-static Node *add(Token **rest, Token *tok);
-static Node *relational(Token **rest, Token *tok);
-static Node *equality(Token **rest, Token *tok);
-static Node *assign(Token **rest, Token *tok);
 static Node *expr(Token **rest, Token *tok);
 static Type *declspec(Token **rest, Token *tok);
 static Type *declarator(Token **rest, Token *tok, Type *);
@@ -186,19 +211,19 @@ static Function *program(Token **rest, Token *tok);
 // func_call = ident( (expr(,expr)*)? )
 static Node *func_call(Token **rest, Token *tok) {
     Node *nd      = new_node(ND_FUNCCALL, tok);
-    nd->func_name = strndup(tok->loc, tok->len);
-    tok           = skip(tok->next, "(");
+    nd->func_name = intern_name(tok->id);
+    tok           = skip(tok->next, ID_LPAREN);
 
     Node head = {};
     Node *cur = &head;
-    while (!str_equal(tok, ")")) {
+    while (!equal(tok, ID_RPAREN)) {
         if (cur != &head) {
-            tok = skip(tok, ",");
+            tok = skip(tok, ID_COMMA);
         }
         cur->next = expr(&tok, tok);
         cur       = cur->next;
     }
-    *rest    = skip(tok, ")");
+    *rest    = skip(tok, ID_RPAREN);
     nd->args = head.next;
     return nd;
 }
@@ -206,9 +231,9 @@ static Node *func_call(Token **rest, Token *tok) {
 // primary = (expr) | num
 static Node *primary(Token **rest, Token *tok) {
     // (expr)
-    if (str_equal(tok, "(")) {
+    if (equal(tok, ID_LPAREN)) {
         Node *nd = expr(&tok, tok->next);
-        *rest    = skip(tok, ")");
+        *rest    = skip(tok, ID_RPAREN);
         return nd;
     }
     if (tok->kind == TK_NUM) {
@@ -218,7 +243,7 @@ static Node *primary(Token **rest, Token *tok) {
     }
     if (tok->kind == TK_IDENT) {
         // func call
-        if (str_equal(tok->next, "(")) {
+        if (equal(tok->next, ID_LPAREN)) {
             return func_call(rest, tok);
         }
 
@@ -233,114 +258,82 @@ static Node *primary(Token **rest, Token *tok) {
     error_tok(tok, "expected a expression or a num");
 }
 
-// unary = (+ | -)unary | primary
+// unary = (+ | - | & | * | ! | ~)unary | primary
 static Node *unary(Token **rest, Token *tok) {
     Node *nd = NULL;
-    if (str_equal(tok, "+")) {
+    if (equal(tok, ID_PLUS)) {
         nd = unary(rest, tok->next);
-    } else if (str_equal(tok, "-")) {
+    } else if (equal(tok, ID_MINUS)) {
         nd = new_unary(ND_NEG, unary(rest, tok->next), tok);
-    } else if (str_equal(tok, "&")) {
+    } else if (equal(tok, ID_AMP)) {
         nd = new_unary(ND_ADDR, unary(rest, tok->next), tok);
-    } else if (str_equal(tok, "*")) {
+    } else if (equal(tok, ID_STAR)) {
         nd = new_unary(ND_DEREF, unary(rest, tok->next), tok);
+    } else if (equal(tok, ID_NOT)) {
+        nd = new_unary(ND_NOT, unary(rest, tok->next), tok);
+    } else if (equal(tok, ID_TILDE)) {
+        nd = new_unary(ND_BITNOT, unary(rest, tok->next), tok);
     } else {
         nd = primary(rest, tok);
     }
     return nd;
 }
 
-// mul = unary (*unary | /unary)
-static Node *mul(Token **rest, Token *tok) {
-    // parse primary
-    Node *nd = unary(&tok, tok);
-    // parse binary operator
-    while (true) {
-        Token *start = tok;
-        if (str_equal(tok, "*")) {
-            nd = new_binary(ND_MUL, nd, unary(&tok, tok->next), start);
-        } else if (str_equal(tok, "/")) {
-            nd = new_binary(ND_DIV, nd, unary(&tok, tok->next), start);
-        } else {
-            *rest = tok;
-            return nd;
-        }
-    }
-}
-
-// add = mul (+mul | -mul)*
-static Node *add(Token **rest, Token *tok) {
-    // parse mul
-    Node *nd = mul(&tok, tok);
-    // +mul | -mul
-    while (true) {
-        Token *start = tok;
-        if (str_equal(tok, "+")) {
-            nd = new_add(nd, mul(&tok, tok->next), start);
-        } else if (str_equal(tok, "-")) {
-            nd = new_sub(nd, mul(&tok, tok->next), start);
-        } else {
-            break;
-        }
-    }
-    *rest = tok;
-    return nd;
-}
-
-// relational = add (<add | <=add | >add | >=add)*
-static Node *relational(Token **rest, Token *tok) {
-    Node *nd = add(&tok, tok);
-    while (true) {
-        Token *start = tok;
-        if (str_equal(tok, "<")) {
-            nd = new_binary(ND_LT, nd, add(&tok, tok->next), start);
-        } else if (str_equal(tok, "<=")) {
-            nd = new_binary(ND_LE, nd, add(&tok, tok->next), start);
-        } else if (str_equal(tok, ">")) {
-            nd = new_binary(ND_LT, add(&tok, tok->next), nd, start);
-        } else if (str_equal(tok, ">=")) {
-            nd = new_binary(ND_LE, add(&tok, tok->next), nd, start);
-        } else {
-            break;
-        }
+typedef struct {
+    // binding power, 0 if the token is not a binary operator
+    int prec;
+    NodeKind kind;
+} BinaryOp;
+
+// Binary operators by token id, higher precedence binds tighter
+static const BinaryOp binary_ops[ID_IDENT] = {
+    [ID_ASSIGN] = {1, ND_ASSIGN}, [ID_LOGOR] = {2, ND_LOGOR},  [ID_LOGAND] = {3, ND_LOGAND},
+    [ID_PIPE] = {4, ND_BITOR},    [ID_CARET] = {5, ND_BITXOR}, [ID_AMP] = {6, ND_BITAND},
+    [ID_EQ] = {7, ND_EQ},         [ID_NE] = {7, ND_NE},        [ID_LT] = {8, ND_LT},
+    [ID_LE] = {8, ND_LE},         [ID_GT] = {8, ND_LT},        [ID_GE] = {8, ND_LE},
+    [ID_SHL] = {9, ND_SHL},       [ID_SHR] = {9, ND_SHR},      [ID_PLUS] = {10, ND_ADD},
+    [ID_MINUS] = {10, ND_SUB},    [ID_STAR] = {11, ND_MUL},    [ID_SLASH] = {11, ND_DIV},
+    [ID_PERCENT] = {11, ND_MOD},
+};
+
+static Node *new_binop(const BinaryOp *op, Node *lhs, Node *rhs, Token *tok) {
+    switch (tok->id) {
+        case ID_PLUS:
+            return new_add(lhs, rhs, tok);
+        case ID_MINUS:
+            return new_sub(lhs, rhs, tok);
+        // a > b -> b < a, a >= b -> b <= a
+        case ID_GT:
+        case ID_GE:
+            return new_binary(op->kind, rhs, lhs, tok);
+        default:
+            return new_binary(op->kind, lhs, rhs, tok);
     }
-    *rest = tok;
-    return nd;
 }
 
-// equality = relational (==relational | !=relational)*
-static Node *equality(Token **rest, Token *tok) {
-    Node *nd = relational(&tok, tok);
-    while (true) {
-        Token *start = tok;
-        if (str_equal(tok, "==")) {
-            nd = new_binary(ND_EQ, nd, relational(&tok, tok->next), start);
-        } else if (str_equal(tok, "!=")) {
-            nd = new_binary(ND_NE, nd, relational(&tok, tok->next), start);
-        } else {
+// Parse operators binding at least as tight as min_prec
+static Node *binary(Token **rest, Token *tok, int min_prec) {
+    Node *nd = unary(&tok, tok);
+    while (tok->id < ID_IDENT) {
+        const BinaryOp *op = &binary_ops[tok->id];
+        if (op->prec == 0 || op->prec < min_prec) {
             break;
         }
-    }
-    *rest = tok;
-    return nd;
-}
-
-static Node *assign(Token **rest, Token *tok) {
-    Node *nd = equality(&tok, tok);
-    if (str_equal(tok, "=")) {
+        // assignment is right associative, the rest left associative
         Token *start = tok;
-        nd           = new_binary(ND_ASSIGN, nd, assign(&tok, tok->next), start);
+        Node *rhs    = binary(&tok, tok->next, op->kind == ND_ASSIGN ? op->prec : op->prec + 1);
+        nd           = new_binop(op, nd, rhs, start);
     }
     *rest = tok;
     return nd;
 }
 
-// expr = equality
-static Node *expr(Token **rest, Token *tok) { return assign(rest, tok); }
+// expr = unary (binop unary)*
+static Node *expr(Token **rest, Token *tok) { return binary(rest, tok, 1); }
 
 static Node *express_stmt(Token **rest, Token *tok) {
     // ;
-    if (str_equal(tok, ";")) {
+    if (equal(tok, ID_SEMI)) {
         Node *nd = new_node(ND_BLOCK, tok);
         *rest    = tok->next;
         return nd;
@@ -349,7 +342,7 @@ static Node *express_stmt(Token **rest, Token *tok) {
     // expr;
     Node *nd = new_node(ND_EXPR_STMT, tok);
     nd->lhs  = expr(&tok, tok);
-    *rest    = skip(tok, ";");
+    *rest    = skip(tok, ID_SEMI);
     return nd;
 }
 
@@ -361,14 +354,14 @@ static Node *declaration(Token **rest, Token *tok) {
     Node *cur = &head;
     // count var
     int i = 0;
-    while (!str_equal(tok, ";")) {
+    while (!equal(tok, ID_SEMI)) {
         if (i++ > 0) {
-            tok = skip(tok, ",");
+            tok = skip(tok, ID_COMMA);
         }
         Type *type  = declarator(&tok, tok, base_type);
-        Object *var = new_var_object(get_ident(type->name), type);
+        Object *var = new_var_object(type->name, type);
 
-        if (!str_equal(tok, "=")) {
+        if (!equal(tok, ID_ASSIGN)) {
             continue;
         }
 
@@ -382,13 +375,13 @@ static Node *declaration(Token **rest, Token *tok) {
 
     Node *nd = new_node(ND_BLOCK, tok);
     nd->body = head.next;
-    *rest    = skip(tok, ";");
+    *rest    = skip(tok, ID_SEMI);
     return nd;
 }
 
 // declspec = int
 static Type *declspec(Token **rest, Token *tok) {
-    *rest = skip(tok, "int");
+    *rest = skip(tok, ID_INT);
     return TypeInt;
 }
 
@@ -397,13 +390,13 @@ static Type *declspec(Token **rest, Token *tok) {
 // param = declspec declarator
 static Type *type_suffix(Token **rest, Token *tok, Type *type) {
     // type_suffix
-    if (str_equal(tok, "(")) {
+    if (equal(tok, ID_LPAREN)) {
         tok       = tok->next;
         Type head = {};
         Type *cur = &head;
-        while (!str_equal(tok, ")")) {
+        while (!equal(tok, ID_RPAREN)) {
             if (cur != &head) {
-                tok = skip(tok, ",");
+                tok = skip(tok, ID_COMMA);
             }
             Type *base_type = declspec(&tok, tok);
             Type *decl_type = declarator(&tok, tok, base_type);
@@ -411,7 +404,7 @@ static Type *type_suffix(Token **rest, Token *tok, Type *type) {
             cur             = cur->next;
         }
 
-        *rest      = skip(tok, ")");
+        *rest      = skip(tok, ID_RPAREN);
         Type *ty   = func_type(type);
         ty->params = head.next;
         return ty;
@@ -423,7 +416,7 @@ static Type *type_suffix(Token **rest, Token *tok, Type *type) {
 
 // declarator = "*"* ident type_suffix
 static Type *declarator(Token **rest, Token *tok, Type *type) {
-    while (consume(&tok, tok, "*")) {
+    while (consume(&tok, tok, ID_STAR)) {
         type = pointer_to(type);
     }
 
@@ -432,28 +425,32 @@ static Type *declarator(Token **rest, Token *tok, Type *type) {
     }
     // ident
     Type *ty = type_suffix(rest, tok->next, type);
+    // TypeInt is shared by every thread, the name goes into a copy
+    if (ty == TypeInt) {
+        ty = copy_type(ty);
+    }
     ty->name = tok;
     return ty;
 }
 
 static Node *stmt(Token **rest, Token *tok) {
     // return
-    if (str_equal(tok, "return")) {
+    if (equal(tok, ID_RETURN)) {
         Node *nd = new_node(ND_RETURN, tok);
         nd->lhs  = expr(&tok, tok->next);
-        *rest    = skip(tok, ";");
+        *rest    = skip(tok, ID_SEMI);
         return nd;
     }
 
     // if (expr) stmt (else stmt)?
-    if (str_equal(tok, "if")) {
-        tok      = skip(tok->next, "(");
+    if (equal(tok, ID_IF)) {
+        tok      = skip(tok->next, ID_LPAREN);
         Node *nd = new_node(ND_IF, tok);
         nd->cond = expr(&tok, tok);
-        tok      = skip(tok, ")");
+        tok      = skip(tok, ID_RPAREN);
         nd->then = stmt(&tok, tok);
         // else
-        if (str_equal(tok, "else")) {
+        if (equal(tok, ID_ELSE)) {
             nd->els = stmt(&tok, tok->next);
         }
         *rest = tok;
@@ -461,36 +458,36 @@ static Node *stmt(Token **rest, Token *tok) {
     }
 
     // for (express_stmt expr? expr?) stmt
-    if (str_equal(tok, "for")) {
-        tok      = skip(tok->next, "(");
+    if (equal(tok, ID_FOR)) {
+        tok      = skip(tok->next, ID_LPAREN);
         Node *nd = new_node(ND_FOR, tok);
         nd->init = express_stmt(&tok, tok);
-        if (!str_equal(tok, ";")) {
+        if (!equal(tok, ID_SEMI)) {
             nd->cond = expr(&tok, tok);
         }
-        tok = skip(tok, ";");
-        if (!str_equal(tok, ")")) {
+        tok = skip(tok, ID_SEMI);
+        if (!equal(tok, ID_RPAREN)) {
             nd->inc = expr(&tok, tok);
         }
-        tok      = skip(tok, ")");
+        tok      = skip(tok, ID_RPAREN);
         nd->then = stmt(&tok, tok);
         *rest    = tok;
         return nd;
     }
 
     // while (expr) stmt
-    if (str_equal(tok, "while")) {
+    if (equal(tok, ID_WHILE)) {
         Node *nd = new_node(ND_FOR, tok);
-        tok      = skip(tok->next, "(");
+        tok      = skip(tok->next, ID_LPAREN);
         nd->cond = expr(&tok, tok);
-        tok      = skip(tok, ")");
+        tok      = skip(tok, ID_RPAREN);
         nd->then = stmt(&tok, tok);
         *rest    = tok;
         return nd;
     }
 
     // compound_stmt
-    if (str_equal(tok, "{")) {
+    if (equal(tok, ID_LBRACE)) {
         return compound_stmt(rest, tok);
     }
 
@@ -508,14 +505,19 @@ static Node *compound_stmt(Token **rest, Token *tok) {
 
     Node head = {};
     Node *cur = &head;
-    tok       = skip(tok, "{");
-    while (!str_equal(tok, "}")) {
+    tok       = skip(tok, ID_LBRACE);
+    enter_scope();
+    while (!equal(tok, ID_RBRACE)) {
         cur->next = stmt(&tok, tok);
         cur       = cur->next;
-        // add type
+        // add type, timed once per statement: the operands new_add() and new_sub()
+        // type on the way are too many small calls to time and count as parsing
+        report_begin(PHASE_TYPES);
         add_type(cur);
+        report_end();
     }
-    tok = skip(tok, "}");
+    leave_scope();
+    tok = skip(tok, ID_RBRACE);
 
     nd->body = head.next;
 
@@ -526,7 +528,7 @@ static Node *compound_stmt(Token **rest, Token *tok) {
 static void parse_func_params(Type *params) {
     if (params) {
         parse_func_params(params->next);
-        new_var_object(get_ident(params->name), params);
+        new_var_object(params->name, params);
     }
 }
 
@@ -536,18 +538,20 @@ static Function *function(Token **rest, Token *tok) {
     Type *type      = declarator(&tok, tok, base_type);
 
     g_locals       = NULL;
-    Function *func = calloc(1, sizeof(Function));
+    Function *func = arena_alloc_kind(MEM_FUNCTION, sizeof(Function));
     func->name     = get_ident(type->name);
+    enter_scope();
     parse_func_params(type->params);
     func->params     = g_locals;
     func->body       = compound_stmt(rest, tok);
     func->locals     = g_locals;
     func->stack_size = 0;
+    leave_scope();
     return func;
 }
 
 static Function *program(Token **rest, Token *tok) {
-    Function head;
+    Function head = {};
     Function *cur = &head;
     while (tok->kind != TK_EOF) {
         cur->next = function(&tok, tok);
@@ -558,6 +562,8 @@ static Function *program(Token **rest, Token *tok) {
 }
 
 Function *parse(Token *tok) {
+    s_var_bindings = arena_alloc(sizeof(VarBinding *) * intern_count());
+    s_scope        = NULL;
     Function *func = program(&tok, tok);
     if (tok->kind != TK_EOF) {
         error_tok(tok, "extra token");
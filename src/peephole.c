@@ -0,0 +1,627 @@
+#include "rvcc.h"
+
+// Window-based peephole optimizer. With -O1 the assembly of a function is kept as
+// a list of parsed lines instead of being written out, rewritten here, then printed.
+
+#define MAX_ARGS 3
+// how many instructions to look at for a later read or write of a register
+#define SCAN_LIMIT 256
+
+typedef enum { LN_INSN, LN_LABEL, LN_OTHER } LineKind;
+
+typedef struct {
+    LineKind kind;
+    bool dead;
+    // label name or the verbatim text of directives and comments
+    char *text;
+    char *op;
+    char *args[MAX_ARGS];
+    int num_args;
+    // the first operand is the register the instruction writes
+    bool defines;
+} Line;
+
+// Lines and their strings are reused from one function to the next, every code
+// generator thread has its own
+static _Thread_local Line *s_lines   = NULL;
+static _Thread_local int s_num_lines = 0;
+static _Thread_local int s_cap_lines = 0;
+
+typedef struct PoolChunk PoolChunk;
+struct PoolChunk {
+    PoolChunk *next;
+    size_t used;
+    char data[1 << 16];
+};
+
+static _Thread_local PoolChunk *s_pool     = NULL;
+static _Thread_local PoolChunk *s_pool_cur = NULL;
+
+// label name -> line index + 1
+static _Thread_local HashMap s_labels;
+// labels already followed by the current liveness query, stamped with its number
+static _Thread_local int *s_visited  = NULL;
+static _Thread_local int s_cap_visit = 0;
+static _Thread_local int s_query     = 0;
+
+static char *pool_strndup(const char *s, size_t len) {
+    if (len + 1 > sizeof(s_pool->data)) {
+        error("assembly line too long");
+    }
+    if (s_pool_cur == NULL || s_pool_cur->used + len + 1 > sizeof(s_pool_cur->data)) {
+        PoolChunk *next = s_pool_cur ? s_pool_cur->next : s_pool;
+        if (next == NULL) {
+            next = heap_alloc(sizeof(PoolChunk));
+            if (next == NULL) {
+                error("out of memory");
+            }
+            next->next = NULL;
+            if (s_pool_cur) {
+                s_pool_cur->next = next;
+            } else {
+                s_pool = next;
+            }
+        }
+        s_pool_cur       = next;
+        s_pool_cur->used = 0;
+    }
+    char *p = s_pool_cur->data + s_pool_cur->used;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    s_pool_cur->used += len + 1;
+    return p;
+}
+
+// Instructions whose first operand is the register they write
+static bool op_defines_first(const char *op) {
+    static const char *ops[] = {
+        "li",   "mv",   "lw",   "add",  "addi", "sub", "mul",  "mulh", "div", "rem",
+        "and",  "andi", "or",   "ori",  "xor",  "xori", "sll", "slli", "srli", "sra",
+        "srai", "slt",  "slti", "seqz", "snez", "neg",  "not",
+    };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(*ops); i++) {
+        if (!strcmp(op, ops[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static Line *new_line(LineKind kind) {
+    if (s_num_lines == s_cap_lines) {
+        s_cap_lines = s_cap_lines ? s_cap_lines * 2 : 1024;
+        s_lines     = heap_realloc(s_lines, sizeof(Line) * s_num_lines, sizeof(Line) * s_cap_lines);
+        if (s_lines == NULL) {
+            error("out of memory");
+        }
+    }
+    Line *ln = &s_lines[s_num_lines++];
+    memset(ln, 0, sizeof(Line));
+    ln->kind = kind;
+    return ln;
+}
+
+// Take one line of assembly as formatted by emit()
+void peephole_add(const char *s, size_t len) {
+    if (len > 0 && s[0] != ' ' && s[len - 1] == ':') {
+        new_line(LN_LABEL)->text = pool_strndup(s, len - 1);
+        return;
+    }
+
+    const char *p = s;
+    while (*p == ' ') {
+        p++;
+    }
+    if (*p == '.' || *p == '#' || *p == '\0') {
+        new_line(LN_OTHER)->text = pool_strndup(s, len);
+        return;
+    }
+
+    Line *ln      = new_line(LN_INSN);
+    const char *q = p;
+    while (*q != ' ' && *q != '\0') {
+        q++;
+    }
+    ln->op      = pool_strndup(p, q - p);
+    ln->defines = op_defines_first(ln->op);
+    while (*q == ' ') {
+        q++;
+    }
+    while (*q != '\0') {
+        if (ln->num_args == MAX_ARGS) {
+            error("unexpected assembly line: %.*s", (int)len, s);
+        }
+        const char *end = strchr(q, ',');
+        if (end == NULL) {
+            end = s + len;
+        }
+        ln->args[ln->num_args++] = pool_strndup(q, end - q);
+        q                        = *end ? end + 1 : end;
+        while (*q == ' ') {
+            q++;
+        }
+    }
+}
+
+static bool is_op(Line *ln, const char *op) { return ln->kind == LN_INSN && !strcmp(ln->op, op); }
+
+// Conditional branches in pairs of opposites, the label is the last operand
+static const char *branch_ops[] = {
+    "beqz", "bnez", "bltz", "bgez", "bgtz", "blez", "beq", "bne", "blt", "bge",
+};
+#define NUM_BRANCH_OPS (int)(sizeof(branch_ops) / sizeof(*branch_ops))
+
+static int branch_index(Line *ln) {
+    for (int i = 0; ln->kind == LN_INSN && i < NUM_BRANCH_OPS; i++) {
+        if (!strcmp(ln->op, branch_ops[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool is_branch(Line *ln) { return branch_index(ln) >= 0; }
+
+static bool defines_first(Line *ln) { return ln->kind == LN_INSN && ln->defines; }
+
+// Base register of a memory operand like -12(fp)
+static bool mem_base(const char *arg, char *base) {
+    const char *open = strchr(arg, '(');
+    if (open == NULL) {
+        return false;
+    }
+    size_t n = strlen(open + 1);
+    if (n < 2 || n > 7) {
+        return false;
+    }
+    memcpy(base, open + 1, n - 1);
+    base[n - 1] = '\0';
+    return true;
+}
+
+static bool reads_reg(Line *ln, const char *reg) {
+    if (ln->kind != LN_INSN) {
+        return false;
+    }
+    if (is_op(ln, "call") || is_op(ln, "tail")) {
+        return reg[0] == 'a';
+    }
+    if (is_op(ln, "ret")) {
+        return !strcmp(reg, "a0");
+    }
+    for (int i = defines_first(ln) ? 1 : 0; i < ln->num_args; i++) {
+        char base[8];
+        if (!strcmp(ln->args[i], reg) || (mem_base(ln->args[i], base) && !strcmp(base, reg))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool writes_reg(Line *ln, const char *reg) {
+    return defines_first(ln) && !strcmp(ln->args[0], reg);
+}
+
+static bool is_tmp_reg(const char *reg) { return reg[0] == 't' || reg[0] == 'a'; }
+
+static int next_line(int i) {
+    for (i++; i < s_num_lines; i++) {
+        if (!s_lines[i].dead && !(s_lines[i].kind == LN_OTHER && strchr(s_lines[i].text, '#'))) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int next_insn(int i) {
+    i = next_line(i);
+    return i >= 0 && s_lines[i].kind == LN_INSN ? i : -1;
+}
+
+// Line index of a label of the current function, -1 if it is not there
+static int find_label(const char *name) {
+    intptr_t i = (intptr_t)hashmap_get(&s_labels, name, strlen(name));
+    return i - 1;
+}
+
+// Follow every path from line i until reg is written or read, within budget steps
+static bool dead_from(int i, const char *reg, int *budget) {
+    while (--*budget > 0 && (i = next_line(i)) >= 0) {
+        Line *ln = &s_lines[i];
+        if (ln->kind != LN_INSN) {
+            continue;
+        }
+        if (reads_reg(ln, reg)) {
+            return false;
+        }
+        if (writes_reg(ln, reg) || is_op(ln, "ret") || is_op(ln, "tail")) {
+            return true;
+        }
+        // calls clobber the temporaries, and read the argument registers
+        if (is_op(ln, "call") && is_tmp_reg(reg)) {
+            return true;
+        }
+        if (is_op(ln, "j") || is_branch(ln)) {
+            int target = find_label(ln->args[ln->num_args - 1]);
+            if (target < 0) {
+                return false;
+            }
+            // a path through a label seen before has been checked already
+            if (s_visited[target] == s_query) {
+                if (is_op(ln, "j")) {
+                    return true;
+                }
+                continue;
+            }
+            s_visited[target] = s_query;
+            if (is_op(ln, "j")) {
+                i = target;
+                continue;
+            }
+            if (!dead_from(target, reg, budget)) {
+                return false;
+            }
+        }
+    }
+    return false;
+}
+
+// True if reg is certainly overwritten or discarded before being read after line i.
+// Only temporaries and argument registers are ever considered dead.
+static bool is_dead_after(int i, const char *reg) {
+    if (!is_tmp_reg(reg)) {
+        return false;
+    }
+    int budget = SCAN_LIMIT;
+    s_query++;
+    return dead_from(i, reg, &budget);
+}
+
+static bool parse_int(const char *s, int *val) {
+    char *end;
+    long v = strtol(s, &end, 10);
+    if (*s == '\0' || *end != '\0') {
+        return false;
+    }
+    *val = (int)v;
+    return true;
+}
+
+static bool fits_imm12(long v) { return -2048 <= v && v <= 2047; }
+
+static void set_args(Line *ln, const char *op, const char *a, const char *b, const char *c) {
+    ln->op       = pool_strndup(op, strlen(op));
+    ln->defines  = op_defines_first(op);
+    ln->args[0]  = pool_strndup(a, strlen(a));
+    ln->args[1]  = b ? pool_strndup(b, strlen(b)) : NULL;
+    ln->args[2]  = c ? pool_strndup(c, strlen(c)) : NULL;
+    ln->num_args = c ? 3 : b ? 2 : 1;
+}
+
+// Word accesses at different offsets from the same base register never overlap
+static bool may_alias(const char *m1, const char *m2) {
+    char base1[8];
+    char base2[8];
+    int off1;
+    int off2;
+    if (!mem_base(m1, base1) || !mem_base(m2, base2) || strcmp(base1, base2)) {
+        return true;
+    }
+    off1 = atoi(m1);
+    off2 = atoi(m2);
+    return off1 - off2 < REG_BYTES && off2 - off1 < REG_BYTES;
+}
+
+// sw/lw rX, M followed by lw rY, M with nothing in between that could change M or rX
+static bool forward_load(int i) {
+    Line *src = &s_lines[i];
+    if (!(is_op(src, "sw") || is_op(src, "lw")) || src->num_args != 2) {
+        return false;
+    }
+    char base[8];
+    if (!mem_base(src->args[1], base) || !strcmp(src->args[0], base)) {
+        return false;
+    }
+    const char *reg = src->args[0];
+
+    for (int j = i, n = 0; n < SCAN_LIMIT && (j = next_insn(j)) >= 0; n++) {
+        Line *ln = &s_lines[j];
+        if (is_op(ln, "lw") && !strcmp(ln->args[1], src->args[1])) {
+            if (!strcmp(ln->args[0], reg)) {
+                ln->dead = true;
+            } else {
+                set_args(ln, "mv", ln->args[0], reg, NULL);
+            }
+            return true;
+        }
+        // the fall-through path of a branch has no other way in
+        if ((is_op(ln, "sw") && may_alias(ln->args[1], src->args[1])) || is_op(ln, "call") ||
+            is_op(ln, "j") || is_op(ln, "ret") || is_op(ln, "tail") || writes_reg(ln, reg) ||
+            writes_reg(ln, base)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// addi r, r, a; addi r, r, b -> addi r, r, a+b
+static bool merge_addi(int i) {
+    Line *a = &s_lines[i];
+    int j   = next_insn(i);
+    if (j < 0 || !is_op(a, "addi") || strcmp(a->args[0], a->args[1])) {
+        return false;
+    }
+    Line *b = &s_lines[j];
+    int x, y;
+    if (!is_op(b, "addi") || strcmp(b->args[0], a->args[0]) || strcmp(b->args[1], a->args[0]) ||
+        !parse_int(a->args[2], &x) || !parse_int(b->args[2], &y) || !fits_imm12((long)x + y)) {
+        return false;
+    }
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%d", x + y);
+    b->dead = true;
+    if (x + y == 0) {
+        a->dead = true;
+    } else {
+        a->args[2] = pool_strndup(buf, strlen(buf));
+    }
+    return true;
+}
+
+// li rT, N; op rd, rs, rT -> opi rd, rs, N
+static bool fold_li(int i) {
+    Line *li = &s_lines[i];
+    int j    = next_insn(i);
+    int val;
+    if (j < 0 || !is_op(li, "li") || !parse_int(li->args[1], &val)) {
+        return false;
+    }
+    Line *ln        = &s_lines[j];
+    const char *reg = li->args[0];
+    if (!reads_reg(ln, reg) || (!writes_reg(ln, reg) && !is_dead_after(j, reg))) {
+        return false;
+    }
+
+    static const struct {
+        const char *op;
+        const char *imm_op;
+        bool commutative;
+    } forms[] = {
+        {"add", "addi", true}, {"and", "andi", true}, {"or", "ori", true},   {"xor", "xori", true},
+        {"slt", "slti", false}, {"sll", "slli", false}, {"sra", "srai", false},
+    };
+
+    if (ln->num_args == 3 && strcmp(ln->args[1], ln->args[2])) {
+        for (size_t k = 0; k < sizeof(forms) / sizeof(*forms); k++) {
+            if (strcmp(ln->op, forms[k].op)) {
+                continue;
+            }
+            const char *other = NULL;
+            if (!strcmp(ln->args[2], reg)) {
+                other = ln->args[1];
+            } else if (forms[k].commutative && !strcmp(ln->args[1], reg)) {
+                other = ln->args[2];
+            }
+            bool is_shift = !strcmp(forms[k].op, "sll") || !strcmp(forms[k].op, "sra");
+            if (other == NULL || !fits_imm12(val) || (is_shift && (val < 0 || val > 31))) {
+                break;
+            }
+            set_args(ln, forms[k].imm_op, ln->args[0], other, li->args[1]);
+            li->dead = true;
+            return true;
+        }
+        // x - N -> x + -N
+        if (is_op(ln, "sub") && !strcmp(ln->args[2], reg) && fits_imm12(-(long)val)) {
+            char buf[16];
+            snprintf(buf, sizeof(buf), "%d", -val);
+            set_args(ln, "addi", ln->args[0], ln->args[1], buf);
+            li->dead = true;
+            return true;
+        }
+    }
+
+    // a zero operand is just the zero register
+    if (val == 0 && !is_op(ln, "call") && !is_op(ln, "ret")) {
+        for (int k = defines_first(ln) ? 1 : 0; k < ln->num_args; k++) {
+            if (!strcmp(ln->args[k], reg)) {
+                ln->args[k] = "zero";
+            }
+        }
+        if (!reads_reg(ln, reg)) {
+            li->dead = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_control(Line *ln) {
+    return is_op(ln, "j") || is_branch(ln) || is_op(ln, "call") || is_op(ln, "ret") ||
+           is_op(ln, "tail");
+}
+
+// op rT, ...; ...; mv rd, rT -> op rd, ...; ...
+// The instructions in between must leave rd and rT alone.
+static bool forward_mv(int i) {
+    Line *def = &s_lines[i];
+    if (!defines_first(def)) {
+        return false;
+    }
+    const char *reg = def->args[0];
+    for (int j = i, n = 0; n < 4 && (j = next_insn(j)) >= 0; n++) {
+        Line *ln = &s_lines[j];
+        if (is_op(ln, "mv") && !strcmp(ln->args[1], reg)) {
+            char *rd = ln->args[0];
+            for (int k = next_insn(i); k != j; k = next_insn(k)) {
+                if (reads_reg(&s_lines[k], rd) || writes_reg(&s_lines[k], rd)) {
+                    return false;
+                }
+            }
+            if (!is_dead_after(j, reg)) {
+                return false;
+            }
+            def->args[0] = rd;
+            ln->dead     = true;
+            return true;
+        }
+        if (is_control(ln) || reads_reg(ln, reg) || writes_reg(ln, reg)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// mv rT, rs; op ..., rT -> op ..., rs
+static bool propagate_mv(int i) {
+    Line *mv = &s_lines[i];
+    int j    = next_insn(i);
+    if (j < 0 || !is_op(mv, "mv") || is_control(&s_lines[j])) {
+        return false;
+    }
+    Line *ln        = &s_lines[j];
+    const char *reg = mv->args[0];
+    if (!reads_reg(ln, reg) || (!writes_reg(ln, reg) && !is_dead_after(j, reg))) {
+        return false;
+    }
+    for (int k = defines_first(ln) ? 1 : 0; k < ln->num_args; k++) {
+        char base[8];
+        if (!strcmp(ln->args[k], reg)) {
+            ln->args[k] = mv->args[1];
+        } else if (mem_base(ln->args[k], base) && !strcmp(base, reg)) {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%.*s(%s)", (int)(strchr(ln->args[k], '(') - ln->args[k]),
+                     ln->args[k], mv->args[1]);
+            ln->args[k] = pool_strndup(buf, strlen(buf));
+        }
+    }
+    mv->dead = true;
+    return true;
+}
+
+// Jumps and branches to the label right after them
+static bool remove_jump_to_next(int i) {
+    Line *ln = &s_lines[i];
+    if (!is_op(ln, "j") && !is_branch(ln)) {
+        return false;
+    }
+    const char *target = ln->args[ln->num_args - 1];
+    for (int j = next_line(i); j >= 0 && s_lines[j].kind == LN_LABEL; j = next_line(j)) {
+        if (!strcmp(s_lines[j].text, target)) {
+            ln->dead = true;
+            return true;
+        }
+    }
+
+    // bnez r, L1; j L2; L1: -> beqz r, L2
+    int j = next_insn(i);
+    if (!is_branch(ln) || j < 0 || !is_op(&s_lines[j], "j")) {
+        return false;
+    }
+    for (int k = next_line(j); k >= 0 && s_lines[k].kind == LN_LABEL; k = next_line(k)) {
+        if (!strcmp(s_lines[k].text, target)) {
+            const char *inverse = branch_ops[branch_index(ln) ^ 1];
+            char *label         = s_lines[j].args[0];
+            if (ln->num_args == 3) {
+                set_args(ln, inverse, ln->args[0], ln->args[1], label);
+            } else {
+                set_args(ln, inverse, ln->args[0], label, NULL);
+            }
+            s_lines[j].dead = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+void peephole_run(void) {
+    if (s_num_lines == 0) {
+        return;
+    }
+    if (s_cap_visit < s_num_lines) {
+        // the contents are cleared below
+        heap_free(s_visited);
+        s_cap_visit = s_num_lines;
+        s_visited   = heap_alloc(sizeof(int) * s_cap_visit);
+        if (s_visited == NULL) {
+            error("out of memory");
+        }
+    }
+    memset(s_visited, 0, sizeof(int) * s_num_lines);
+    s_query  = 0;
+    s_labels = (HashMap){};
+    for (int i = 0; i < s_num_lines; i++) {
+        if (s_lines[i].kind == LN_LABEL) {
+            hashmap_put(&s_labels, s_lines[i].text, strlen(s_lines[i].text), (void *)(intptr_t)(i + 1));
+        }
+    }
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = 0; i < s_num_lines; i++) {
+            Line *ln = &s_lines[i];
+            if (ln->dead || ln->kind != LN_INSN) {
+                continue;
+            }
+            if (is_op(ln, "mv") && !strcmp(ln->args[0], ln->args[1])) {
+                ln->dead = changed = true;
+                continue;
+            }
+            // x + 0, x | 0, x ^ 0, x << 0, x >> 0
+            if ((is_op(ln, "addi") || is_op(ln, "ori") || is_op(ln, "xori") || is_op(ln, "slli") ||
+                 is_op(ln, "srai")) &&
+                !strcmp(ln->args[2], "0")) {
+                set_args(ln, "mv", ln->args[0], ln->args[1], NULL);
+                changed = true;
+                continue;
+            }
+            changed |= forward_load(i) || merge_addi(i) || forward_mv(i) || propagate_mv(i) ||
+                       fold_li(i) || remove_jump_to_next(i);
+        }
+    }
+}
+
+// Hand the surviving lines to out and start over with an empty list
+void peephole_flush(void (*out)(const char *s, size_t len)) {
+    char buf[1024];
+    for (int i = 0; i < s_num_lines; i++) {
+        Line *ln = &s_lines[i];
+        int n    = 0;
+        if (ln->dead) {
+            continue;
+        }
+        switch (ln->kind) {
+            case LN_LABEL:
+                n = snprintf(buf, sizeof(buf), "%s:", ln->text);
+                break;
+            case LN_OTHER:
+                n = snprintf(buf, sizeof(buf), "%s", ln->text);
+                break;
+            case LN_INSN:
+                n = snprintf(buf, sizeof(buf), "    %s", ln->op);
+                for (int k = 0; k < ln->num_args; k++) {
+                    n += snprintf(buf + n, sizeof(buf) - n, k ? ", %s" : " %s", ln->args[k]);
+                }
+                break;
+        }
+        out(buf, n);
+    }
+    s_num_lines = 0;
+    s_pool_cur  = NULL;
+}
+
+// Free the buffers of this thread
+void peephole_release(void) {
+    while (s_pool != NULL) {
+        PoolChunk *next = s_pool->next;
+        heap_free(s_pool);
+        s_pool = next;
+    }
+    heap_free(s_lines);
+    heap_free(s_visited);
+    s_pool_cur  = NULL;
+    s_lines     = NULL;
+    s_visited   = NULL;
+    s_num_lines = 0;
+    s_cap_lines = 0;
+    s_cap_visit = 0;
+}
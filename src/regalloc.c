@@ -0,0 +1,244 @@
+#include "rvcc.h"
+
+// Linear scan register allocation over the IR. Liveness is solved on the CFG, each
+// virtual register then gets one interval over the linear instruction order.
+// Intervals live across a call only go to callee-saved registers.
+
+// RISC-V register numbers. t5 and t6 are kept free to reload spilled operands.
+static const int caller_saved[] = {5, 6, 7, 28, 29};
+static const int callee_saved[] = {9, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27};
+
+#define NUM_CALLER_SAVED (int)(sizeof(caller_saved) / sizeof(*caller_saved))
+#define NUM_CALLEE_SAVED (int)(sizeof(callee_saved) / sizeof(*callee_saved))
+
+typedef struct {
+    int vreg;
+    int start;
+    int end;
+    bool crosses_call;
+} Interval;
+
+typedef uint32_t Word;
+#define WORD_BITS 32
+
+static bool test_bit(Word *set, int i) { return set[i / WORD_BITS] & (1u << (i % WORD_BITS)); }
+static void set_bit(Word *set, int i) { set[i / WORD_BITS] |= 1u << (i % WORD_BITS); }
+
+// Per block live-in and live-out sets, indexed by block id
+static void compute_liveness(IrFunc *fn, int words, Word **live_in, Word **live_out) {
+    Word **use = arena_alloc(sizeof(Word *) * fn->num_blocks);
+    Word **def = arena_alloc(sizeof(Word *) * fn->num_blocks);
+
+    for (BasicBlock *bb = fn->blocks; bb != NULL; bb = bb->next) {
+        use[bb->id]      = arena_alloc(sizeof(Word) * words);
+        def[bb->id]      = arena_alloc(sizeof(Word) * words);
+        live_in[bb->id]  = arena_alloc(sizeof(Word) * words);
+        live_out[bb->id] = arena_alloc(sizeof(Word) * words);
+        for (IrInsn *insn = bb->insns; insn != NULL; insn = insn->next) {
+            int uses[IR_MAX_USES];
+            int num_uses = insn_uses(insn, uses);
+            for (int i = 0; i < num_uses; i++) {
+                if (!test_bit(def[bb->id], uses[i])) {
+                    set_bit(use[bb->id], uses[i]);
+                }
+            }
+            if (insn->dst) {
+                set_bit(def[bb->id], insn->dst);
+            }
+        }
+    }
+
+    // blocks in reverse layout order converge in few rounds
+    BasicBlock **order = arena_alloc(sizeof(BasicBlock *) * fn->num_blocks);
+    for (BasicBlock *bb = fn->blocks; bb != NULL; bb = bb->next) {
+        order[fn->num_blocks - 1 - bb->id] = bb;
+    }
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = 0; i < fn->num_blocks; i++) {
+            BasicBlock *bb = order[i];
+            Word *in       = live_in[bb->id];
+            Word *out      = live_out[bb->id];
+            for (int w = 0; w < words; w++) {
+                Word o = 0;
+                for (int s = 0; s < bb->num_succs; s++) {
+                    o |= live_in[bb->succs[s]->id][w];
+                }
+                Word n = use[bb->id][w] | (o & ~def[bb->id][w]);
+                if (n != in[w]) {
+                    in[w]   = n;
+                    changed = true;
+                }
+                out[w] = o;
+            }
+        }
+    }
+}
+
+static int cmp_start(const void *a, const void *b) {
+    const Interval *x = a;
+    const Interval *y = b;
+    return x->start != y->start ? x->start - y->start : x->vreg - y->vreg;
+}
+
+static void extend(Interval *it, int pos) {
+    if (it->start < 0 || pos < it->start) {
+        it->start = pos;
+    }
+    if (pos > it->end) {
+        it->end = pos;
+    }
+}
+
+// Build one interval per virtual register, ordered by start
+static Interval *build_intervals(IrFunc *fn, int *num_intervals) {
+    int words       = fn->num_vregs / WORD_BITS + 1;
+    Word **live_in  = arena_alloc(sizeof(Word *) * fn->num_blocks);
+    Word **live_out = arena_alloc(sizeof(Word *) * fn->num_blocks);
+    compute_liveness(fn, words, live_in, live_out);
+
+    Interval *intervals = arena_alloc(sizeof(Interval) * (fn->num_vregs + 1));
+    for (int v = 0; v <= fn->num_vregs; v++) {
+        intervals[v].vreg  = v;
+        intervals[v].start = -1;
+        intervals[v].end   = -1;
+    }
+
+    int num_insns = 0;
+    for (BasicBlock *bb = fn->blocks; bb != NULL; bb = bb->next) {
+        for (IrInsn *insn = bb->insns; insn != NULL; insn = insn->next) {
+            num_insns++;
+        }
+    }
+    // calls[i] is the number of calls before instruction i
+    int *calls = arena_alloc(sizeof(int) * (num_insns + 1));
+
+    // instruction i reads its operands at position 2i and writes its result at 2i+1
+    int i = 0;
+    for (BasicBlock *bb = fn->blocks; bb != NULL; bb = bb->next) {
+        int first = i;
+        for (IrInsn *insn = bb->insns; insn != NULL; insn = insn->next, i++) {
+            calls[i + 1] = calls[i] + (insn->op == IR_CALL);
+            int uses[IR_MAX_USES];
+            int num_uses = insn_uses(insn, uses);
+            for (int j = 0; j < num_uses; j++) {
+                extend(&intervals[uses[j]], 2 * i);
+            }
+            if (insn->dst) {
+                extend(&intervals[insn->dst], 2 * i + 1);
+            }
+        }
+        for (int w = 0; w < words; w++) {
+            for (Word m = live_in[bb->id][w]; m; m &= m - 1) {
+                extend(&intervals[w * WORD_BITS + __builtin_ctz(m)], 2 * first);
+            }
+            for (Word m = live_out[bb->id][w]; m; m &= m - 1) {
+                extend(&intervals[w * WORD_BITS + __builtin_ctz(m)], 2 * i - 1);
+            }
+        }
+    }
+
+    int n = 0;
+    for (int v = 1; v <= fn->num_vregs; v++) {
+        Interval *it = &intervals[v];
+        if (it->start < 0) {
+            continue;
+        }
+        // a call is crossed when the value is live both before and after it
+        int lo           = it->start / 2 + 1;
+        int hi           = it->end >= 2 ? (it->end - 2) / 2 + 1 : 0;
+        it->crosses_call = hi > lo && calls[hi] - calls[lo] > 0;
+        intervals[n++]   = *it;
+    }
+    qsort(intervals, n, sizeof(Interval), cmp_start);
+    *num_intervals = n;
+    return intervals;
+}
+
+static void spill(IrFunc *fn, int vreg) {
+    fn->reg[vreg]  = -1;
+    fn->slot[vreg] = fn->num_slots++;
+}
+
+void regalloc(IrFunc *fn) {
+    fn->reg  = arena_alloc(sizeof(int) * (fn->num_vregs + 1));
+    fn->slot = arena_alloc(sizeof(int) * (fn->num_vregs + 1));
+
+    int n;
+    Interval *intervals = build_intervals(fn, &n);
+
+    // active intervals, ordered by end
+    Interval **active = arena_alloc(sizeof(Interval *) * (n + 1));
+    int num_active    = 0;
+    bool free_reg[32];
+    for (int i = 0; i < 32; i++) {
+        free_reg[i] = true;
+    }
+
+    for (int i = 0; i < n; i++) {
+        Interval *cur = &intervals[i];
+
+        // expire intervals ending before cur starts
+        int k = 0;
+        for (int j = 0; j < num_active; j++) {
+            if (active[j]->end < cur->start) {
+                free_reg[fn->reg[active[j]->vreg]] = true;
+            } else {
+                active[k++] = active[j];
+            }
+        }
+        num_active = k;
+
+        int reg = -1;
+        if (!cur->crosses_call) {
+            for (int j = 0; j < NUM_CALLER_SAVED && reg < 0; j++) {
+                if (free_reg[caller_saved[j]]) {
+                    reg = caller_saved[j];
+                }
+            }
+        }
+        for (int j = 0; j < NUM_CALLEE_SAVED && reg < 0; j++) {
+            if (free_reg[callee_saved[j]]) {
+                reg = callee_saved[j];
+            }
+        }
+
+        if (reg < 0) {
+            // steal the register of the active interval ending last, if it ends after cur
+            int victim = -1;
+            for (int j = num_active - 1; j >= 0; j--) {
+                int r = fn->reg[active[j]->vreg];
+                if (cur->crosses_call && !(fn->saved_regs & (1u << r))) {
+                    continue;
+                }
+                victim = j;
+                break;
+            }
+            if (victim < 0 || active[victim]->end <= cur->end) {
+                spill(fn, cur->vreg);
+                continue;
+            }
+            reg = fn->reg[active[victim]->vreg];
+            spill(fn, active[victim]->vreg);
+            num_active--;
+            memmove(&active[victim], &active[victim + 1], sizeof(Interval *) * (num_active - victim));
+        }
+
+        fn->reg[cur->vreg] = reg;
+        free_reg[reg]      = false;
+        for (int j = 0; j < NUM_CALLEE_SAVED; j++) {
+            if (callee_saved[j] == reg) {
+                fn->saved_regs |= 1u << reg;
+            }
+        }
+
+        // insert into active, keeping it ordered by end
+        int j = num_active++;
+        while (j > 0 && active[j - 1]->end > cur->end) {
+            active[j] = active[j - 1];
+            j--;
+        }
+        active[j] = cur;
+    }
+}
@@ -0,0 +1,225 @@
+#include "rvcc.h"
+
+#include <pthread.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// -ftime-report and -fmem-report. Both are off by default and then every hook
+// returns right away: phase boundaries are a handful of calls per function and
+// the counters behind the memory report are kept anyway.
+
+static bool s_time = false;
+static bool s_mem  = false;
+static bool s_json = false;
+
+static const char *phase_names[NUM_PHASES] = {
+    [PHASE_TOKENIZE] = "tokenize", [PHASE_PARSE] = "parse",       [PHASE_TYPES] = "add_type",
+    [PHASE_INLINE] = "inline",     [PHASE_FOLD] = "fold",         [PHASE_LOWER] = "lower",
+    [PHASE_LICM] = "licm",         [PHASE_REGALLOC] = "regalloc", [PHASE_CODEGEN] = "codegen",
+    [PHASE_PEEPHOLE] = "peephole",
+};
+
+static const char *mem_names[NUM_MEM_KINDS] = {
+    [MEM_TOKEN] = "Token",       [MEM_NODE] = "Node", [MEM_TYPE] = "Type",   [MEM_OBJECT] = "Object",
+    [MEM_FUNCTION] = "Function", [MEM_IR] = "IR",     [MEM_OTHER] = "other",
+};
+
+// wall and cpu seconds charged to each phase, summed over all threads
+static double s_wall[NUM_PHASES];
+static double s_cpu[NUM_PHASES];
+// the same for this thread since it last added them to the totals, which takes the lock
+static _Thread_local double s_thread_wall[NUM_PHASES];
+static _Thread_local double s_thread_cpu[NUM_PHASES];
+// memory and output of every compilation collected so far
+static ArenaStats s_arena;
+static EmitStats s_emit;
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// phases being timed on this thread, innermost last
+#define MAX_NESTING 8
+static _Thread_local Phase s_stack[MAX_NESTING];
+static _Thread_local int s_depth = 0;
+// when the innermost phase was last charged
+static _Thread_local double s_mark_wall;
+static _Thread_local double s_mark_cpu;
+
+void report_set_time(bool on) { s_time = on; }
+
+void report_set_mem(bool on) {
+    s_mem = on;
+    emit_set_stats(on);
+}
+
+void report_set_json(bool on) { s_json = on; }
+
+static double clock_seconds(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Charge the time since the last mark to the innermost phase
+static void charge(void) {
+    double wall = clock_seconds(CLOCK_MONOTONIC);
+    double cpu  = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+    if (s_depth > 0) {
+        s_thread_wall[s_stack[s_depth - 1]] += wall - s_mark_wall;
+        s_thread_cpu[s_stack[s_depth - 1]] += cpu - s_mark_cpu;
+    }
+    s_mark_wall = wall;
+    s_mark_cpu  = cpu;
+}
+
+void report_begin(Phase phase) {
+    if (!s_time) {
+        return;
+    }
+    if (s_depth == MAX_NESTING) {
+        error("phases nested too deep");
+    }
+    charge();
+    s_stack[s_depth++] = phase;
+}
+
+void report_end(void) {
+    if (!s_time) {
+        return;
+    }
+    charge();
+    s_depth--;
+}
+
+// Add the time of this thread to the totals
+void report_flush(void) {
+    if (!s_time) {
+        return;
+    }
+    pthread_mutex_lock(&s_lock);
+    for (int i = 0; i < NUM_PHASES; i++) {
+        s_wall[i] += s_thread_wall[i];
+        s_cpu[i] += s_thread_cpu[i];
+    }
+    pthread_mutex_unlock(&s_lock);
+    memset(s_thread_wall, 0, sizeof(s_thread_wall));
+    memset(s_thread_cpu, 0, sizeof(s_thread_cpu));
+}
+
+// Close the phases left open by a compilation that failed
+void report_abort(void) {
+    if (!s_time) {
+        return;
+    }
+    charge();
+    s_depth = 0;
+    report_flush();
+}
+
+// Add the time, memory and output of the compilation on this thread to the report.
+// Called after the output is closed and before the arena is released.
+void report_collect(void) {
+    report_flush();
+    if (!s_mem) {
+        return;
+    }
+    ArenaStats as = arena_stats();
+    EmitStats es  = emit_stats();
+    pthread_mutex_lock(&s_lock);
+    s_arena.allocs += as.allocs;
+    s_arena.bytes += as.bytes;
+    s_arena.chunks += as.chunks;
+    s_arena.reserved += as.reserved;
+    for (int i = 0; i < NUM_MEM_KINDS; i++) {
+        s_arena.kind_allocs[i] += as.kind_allocs[i];
+        s_arena.kind_bytes[i] += as.kind_bytes[i];
+    }
+    s_emit.lines += es.lines;
+    s_emit.insns += es.insns;
+    pthread_mutex_unlock(&s_lock);
+}
+
+static long peak_rss_kb(void) {
+    struct rusage ru;
+    return getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : 0;
+}
+
+static void print_time_text(void) {
+    double wall = 0;
+    double cpu  = 0;
+    for (int i = 0; i < NUM_PHASES; i++) {
+        wall += s_wall[i];
+        cpu += s_cpu[i];
+    }
+    fprintf(stderr, "time report:\n");
+    fprintf(stderr, "  %-10s %12s %12s %7s\n", "phase", "wall (ms)", "cpu (ms)", "wall %");
+    for (int i = 0; i < NUM_PHASES; i++) {
+        fprintf(stderr, "  %-10s %12.3f %12.3f %6.1f%%\n", phase_names[i], s_wall[i] * 1e3,
+                s_cpu[i] * 1e3, wall > 0 ? s_wall[i] / wall * 100 : 0);
+    }
+    fprintf(stderr, "  %-10s %12.3f %12.3f\n", "total", wall * 1e3, cpu * 1e3);
+}
+
+static void print_mem_text(ArenaStats *as, EmitStats *es) {
+    fprintf(stderr, "memory report:\n");
+    fprintf(stderr, "  %-10s %12s %12s\n", "kind", "count", "bytes");
+    for (int i = 0; i < NUM_MEM_KINDS; i++) {
+        fprintf(stderr, "  %-10s %12zu %12zu\n", mem_names[i], as->kind_allocs[i],
+                as->kind_bytes[i]);
+    }
+    fprintf(stderr, "  %-10s %12zu %12zu\n", "total", as->allocs, as->bytes);
+    fprintf(stderr, "  arena chunks %zu, %zu bytes reserved\n", as->chunks, as->reserved);
+    fprintf(stderr, "  peak rss %ld KB\n", peak_rss_kb());
+    fprintf(stderr, "  output %zu lines, %zu instructions\n", es->lines, es->insns);
+}
+
+static void print_json(ArenaStats *as, EmitStats *es) {
+    fprintf(stderr, "{");
+    if (s_time) {
+        fprintf(stderr, "\"time\": {");
+        for (int i = 0; i < NUM_PHASES; i++) {
+            fprintf(stderr, "%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}", i ? ", " : "",
+                    phase_names[i], s_wall[i] * 1e3, s_cpu[i] * 1e3);
+        }
+        fprintf(stderr, "}%s", s_mem ? ", " : "");
+    }
+    if (s_mem) {
+        fprintf(stderr, "\"memory\": {");
+        for (int i = 0; i < NUM_MEM_KINDS; i++) {
+            fprintf(stderr, "\"%s\": {\"count\": %zu, \"bytes\": %zu}, ", mem_names[i],
+                    as->kind_allocs[i], as->kind_bytes[i]);
+        }
+        fprintf(stderr, "\"total\": {\"count\": %zu, \"bytes\": %zu}, ", as->allocs, as->bytes);
+        fprintf(stderr, "\"arena_chunks\": %zu, \"arena_reserved\": %zu, ", as->chunks,
+                as->reserved);
+        fprintf(stderr, "\"peak_rss_kb\": %ld}, ", peak_rss_kb());
+        fprintf(stderr, "\"output\": {\"lines\": %zu, \"instructions\": %zu}", es->lines,
+                es->insns);
+    }
+    fprintf(stderr, "}\n");
+}
+
+const char *report_phase_name(Phase phase) { return phase_names[phase]; }
+
+// Wall seconds charged to phase so far, by every thread
+double report_phase_wall(Phase phase) {
+    pthread_mutex_lock(&s_lock);
+    double wall = s_wall[phase];
+    pthread_mutex_unlock(&s_lock);
+    return wall;
+}
+
+// Print the requested reports to stderr, summed over all compilations
+void report_print(void) {
+    if (!s_time && !s_mem) {
+        return;
+    }
+    if (s_json) {
+        print_json(&s_arena, &s_emit);
+        return;
+    }
+    if (s_time) {
+        print_time_text();
+    }
+    if (s_mem) {
+        print_mem_text(&s_arena, &s_emit);
+    }
+}
@@ -2,8 +2,11 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,26 +14,182 @@
 // reg byte width
 #define REG_BYTES 4
 
+// -finline-limit of -O1
+#define DEFAULT_INLINE_LIMIT 40
+
+// Options of a compilation. Every thread has its own copy, so compilations with
+// different options can run side by side; thread pools hand theirs on to the workers.
+typedef struct {
+    // run the peephole optimizer, -O1
+    bool peephole;
+    // hoist loop-invariant code out of loops in the IR, -O1
+    bool licm;
+    // return f(...) jumps to f instead of calling it, -O1, -foptimize-sibling-calls
+    bool tail_calls;
+    // bodies of at most this many AST nodes are inlined into every caller, 0 turns the
+    // inliner off, -finline-limit=
+    int inline_limit;
+    // explanatory comments in the assembly, -fverbose-asm
+    bool comments;
+    // address frames from sp, -fomit-frame-pointer
+    bool omit_fp;
+    // print the IR instead of assembly, --emit-ir
+    bool emit_ir;
+    // generate code from the IR, -fir-backend
+    bool ir_backend;
+    // threads generating functions, -fcodegen-threads=
+    int codegen_threads;
+    // keep the code of every function in this directory, --cache-dir
+    const char *cache_dir;
+    // memory for the arena, calloc and free if alloc is NULL
+    void *(*alloc)(void *ctx, size_t size);
+    void (*free)(void *ctx, void *ptr);
+    void *alloc_ctx;
+} Options;
+
+extern _Thread_local Options g_opts;
+void set_opt_level(Options *opts, int level);
+
+// What an arena allocation holds, for -fmem-report
+typedef enum {
+    MEM_TOKEN,
+    MEM_NODE,
+    MEM_TYPE,
+    MEM_OBJECT,
+    MEM_FUNCTION,
+    MEM_IR,
+    MEM_OTHER,
+    NUM_MEM_KINDS,
+} MemKind;
+
+typedef struct {
+    // number of allocations and bytes handed out
+    size_t allocs;
+    size_t bytes;
+    // chunks obtained from malloc and their total size
+    size_t chunks;
+    size_t reserved;
+    // allocations and bytes by kind
+    size_t kind_allocs[NUM_MEM_KINDS];
+    size_t kind_bytes[NUM_MEM_KINDS];
+} ArenaStats;
+
+void *arena_alloc(size_t size);
+void *arena_alloc_kind(MemKind kind, size_t size);
+char *arena_strndup(const char *str, size_t len);
+void arena_reset(void);
+ArenaStats arena_stats(void);
+void *heap_alloc(size_t size);
+void *heap_realloc(void *ptr, size_t old_size, size_t size);
+void heap_free(void *ptr);
+
+typedef struct {
+    const char *key;
+    int keylen;
+    uint32_t hash;
+    void *val;
+} HashEntry;
+
+typedef struct {
+    HashEntry *buckets;
+    int capacity;
+    int used;
+} HashMap;
+
+void *hashmap_get(HashMap *map, const char *key, int keylen);
+void hashmap_put(HashMap *map, const char *key, int keylen, void *val);
+
 typedef enum { TK_IDENT, TK_PUNCT, TK_NUM, TK_KEYWORD, TK_EOF } TokenKind;
 
+// Token identity. Punctuators and keywords have fixed ids, identifiers are interned
+// by the lexer and numbered from ID_IDENT on, so the parser compares integers.
+typedef enum {
+    ID_NONE,
+    // punctuators
+    ID_LPAREN,  // (
+    ID_RPAREN,  // )
+    ID_LBRACE,  // {
+    ID_RBRACE,  // }
+    ID_COMMA,   // ,
+    ID_SEMI,    // ;
+    ID_ASSIGN,  // =
+    ID_PLUS,    // +
+    ID_MINUS,   // -
+    ID_STAR,    // *
+    ID_SLASH,   // /
+    ID_AMP,     // &
+    ID_PERCENT, // %
+    ID_PIPE,    // |
+    ID_CARET,   // ^
+    ID_TILDE,   // ~
+    ID_NOT,     // !
+    ID_EQ,      // ==
+    ID_NE,      // !=
+    ID_LT,      // <
+    ID_LE,      // <=
+    ID_GT,      // >
+    ID_GE,      // >=
+    ID_SHL,     // <<
+    ID_SHR,     // >>
+    ID_LOGAND,  // &&
+    ID_LOGOR,   // ||
+    // keywords
+    ID_RETURN,
+    ID_IF,
+    ID_ELSE,
+    ID_FOR,
+    ID_WHILE,
+    ID_INT,
+    // first interned identifier
+    ID_IDENT,
+} TokenId;
+
 typedef struct Token Token;
 struct Token {
     TokenKind kind;
+    int id;
     int val;
     Token *next;
     const char *loc;
     int len;
 };
 
-void error(char *fmt, ...);
-void error_at(const char *loc, const char *fmt, ...);
-void verror_at(const char *loc, const char *fmt, va_list va);
-void error_tok(const Token *tok, const char *fmt, ...);
+// An error ends the compilation running on its thread: it longjmps to the recovery
+// point set for the thread, or exits the process if there is none
+void error_set_recovery(jmp_buf *env);
+_Noreturn void error_exit(void);
+
+// Receives every diagnostic of a thread as one string, lines included
+typedef struct {
+    void (*fn)(void *ctx, const char *msg);
+    void *ctx;
+} ErrorHandler;
+
+void error_set_handler(ErrorHandler handler);
+ErrorHandler error_handler(void);
+_Noreturn void error(char *fmt, ...);
+_Noreturn void error_at(const char *loc, const char *fmt, ...);
+_Noreturn void verror_at(const char *loc, const char *fmt, va_list va);
+_Noreturn void error_tok(const Token *tok, const char *fmt, ...);
+void warn_tok(const Token *tok, const char *fmt, ...);
 
-bool str_equal(Token *tok, const char *str);
-bool consume(Token **rest, Token *tok, const char *str);
+static inline bool equal(const Token *tok, TokenId id) { return tok->id == id; }
+bool consume(Token **rest, Token *tok, TokenId id);
+const char *id_spelling(TokenId id);
 
+// The file diagnostics on this thread point into
+typedef struct {
+    char *filename;
+    char *input;
+} SourceFile;
+
+SourceFile current_source(void);
+void set_current_source(SourceFile src);
 Token *tokenize(char *p);
+Token *tokenize_file(char *path);
+void release_source(void);
+int intern_count(void);
+const char *intern_name(int id);
 
 typedef enum {
     ND_NUM,
@@ -38,7 +197,17 @@ typedef enum {
     ND_SUB,
     ND_MUL,
     ND_DIV,
+    ND_MOD,
+    ND_SHL,
+    ND_SHR,
+    ND_BITAND,
+    ND_BITOR,
+    ND_BITXOR,
+    ND_LOGAND,
+    ND_LOGOR,
     ND_NEG,
+    ND_NOT,
+    ND_BITNOT,
     ND_EQ,
     ND_NE,
     ND_LT,
@@ -52,7 +221,9 @@ typedef enum {
     ND_BLOCK,
     ND_ADDR,
     ND_DEREF,
-    ND_FUNCCALL
+    ND_FUNCCALL,
+    // lhs for its effects, then the value of rhs; only made by the inliner
+    ND_COMMA
 } NodeKind;
 
 typedef struct Type Type;
@@ -64,16 +235,21 @@ struct Object {
     Type *type;
     const char *name;
     int offset;
+    // IR virtual register holding the variable, 0 while it lives in the frame
+    int vreg;
 };
 
 typedef struct Function Function;
 struct Function {
     Function *next;
-    char *name;
+    const char *name;
     Node *body;
     Object *params;
     Object *locals;
+    // bytes of locals and spill slots below fp
     int stack_size;
+    // fp offset of the expression spill area, right below the locals
+    int spill_offset;
 };
 
 typedef enum TypeKind { TY_INT, TY_PTR, TY_FUNC } TypeKind;
@@ -106,8 +282,11 @@ struct Node {
     Node *inc;
 
     Token *tok;
-    char *func_name;
+    const char *func_name;
     Node *args;
+
+    // registers needed to evaluate this subtree without spilling (Sethi-Ullman number)
+    int reg_need;
 };
 
 extern Type *TypeInt;
@@ -122,4 +301,199 @@ Type *pointer_to(Type *base);
 
 Function *parse(Token *tok);
 
-void codegen(Function *nd);
\ No newline at end of file
+void inline_functions(Function *prog);
+
+void fold(Function *prog);
+
+typedef struct {
+    // lines written and how many of them are instructions
+    size_t lines;
+    size_t insns;
+} EmitStats;
+
+void emit_open(const char *path);
+void emit_close(void);
+void emit_abort(void);
+void emit_set_stats(bool on);
+EmitStats emit_stats(void);
+void emit_capture_begin(void);
+char *emit_capture_end(size_t *len);
+void emit_raw(const char *s, size_t len);
+void emit_function_end(void);
+void emit(const char *fmt, ...);
+void emit_comment(const char *fmt, ...);
+
+// Compilation phases timed by -ftime-report. A phase started inside another one is
+// charged on its own and not to the outer phase.
+typedef enum {
+    PHASE_TOKENIZE,
+    PHASE_PARSE,
+    PHASE_TYPES,
+    PHASE_INLINE,
+    PHASE_FOLD,
+    PHASE_LOWER,
+    PHASE_LICM,
+    PHASE_REGALLOC,
+    PHASE_CODEGEN,
+    PHASE_PEEPHOLE,
+    NUM_PHASES,
+} Phase;
+
+void report_set_time(bool on);
+void report_set_mem(bool on);
+void report_set_json(bool on);
+void report_begin(Phase phase);
+void report_end(void);
+void report_abort(void);
+void report_flush(void);
+void report_collect(void);
+void report_print(void);
+const char *report_phase_name(Phase phase);
+double report_phase_wall(Phase phase);
+
+void peephole_add(const char *s, size_t len);
+void peephole_run(void);
+void peephole_flush(void (*out)(const char *s, size_t len));
+void peephole_release(void);
+
+void parallel_run(void **items, int n, int threads, void (*fn)(void *item));
+void parallel_codegen(void **items, int n, void (*gen)(void *item));
+
+// Frames are laid out with fp offsets; address them as frame_offset(off)(frame_reg())
+void frame_prologue(const char *name, int size, bool is_leaf);
+void frame_epilogue(void);
+void frame_teardown(void);
+const char *frame_reg(void);
+int frame_offset(int offset);
+
+void codegen(Function *nd);
+
+// rd = rs * imm, rs / imm and rs % imm; a6 and a7 are clobbered
+void emit_mul_imm(const char *rd, const char *rs, int imm);
+void emit_div_imm(const char *rd, const char *rs, int imm);
+void emit_mod_imm(const char *rd, const char *rs, int imm);
+
+// Three-address IR. Values live in virtual registers numbered from 1. Locals whose
+// address is never taken get a virtual register of their own, the rest stay in the
+// frame and are reached through IR_LDVAR/IR_STVAR or IR_ADDR.
+typedef enum {
+    IR_IMM,    // dst = imm
+    IR_MOV,    // dst = a
+    IR_PARAM,  // dst = incoming argument number imm
+    IR_ADD,    // dst = a + b
+    IR_SUB,    // dst = a - b
+    IR_MUL,    // dst = a * b
+    IR_DIV,    // dst = a / b
+    IR_MOD,    // dst = a % b
+    IR_SHL,    // dst = a << b
+    IR_SHR,    // dst = a >> b
+    IR_AND,    // dst = a & b
+    IR_OR,     // dst = a | b
+    IR_XOR,    // dst = a ^ b
+    IR_EQ,     // dst = a == b
+    IR_NE,     // dst = a != b
+    IR_LT,     // dst = a < b
+    IR_LE,     // dst = a <= b
+    IR_MULI,   // dst = a * imm
+    IR_DIVI,   // dst = a / imm
+    IR_MODI,   // dst = a % imm
+    IR_NEG,    // dst = -a
+    IR_NOT,    // dst = !a
+    IR_BITNOT, // dst = ~a
+    IR_ADDR,   // dst = &var
+    IR_LDVAR,  // dst = var
+    IR_STVAR,  // var = a
+    IR_LOAD,   // dst = *a
+    IR_STORE,  // *a = b
+    IR_CALL,   // dst = func_name(args)
+    // block terminators
+    IR_JMP,    // goto then
+    IR_BR,     // if (a cmp b) goto then else goto els
+    IR_RET,    // return a, a0 is left alone if a is 0
+} IrOp;
+
+typedef struct BasicBlock BasicBlock;
+
+typedef struct IrInsn IrInsn;
+struct IrInsn {
+    IrInsn *next;
+    IrOp op;
+    // defined virtual register, 0 if none
+    int dst;
+    int a;
+    int b;
+    int imm;
+    // comparison of IR_BR, one of IR_EQ, IR_NE, IR_LT and IR_LE. An operand of 0 is
+    // the constant zero, so a plain test of a is a != 0.
+    IrOp cmp;
+    Object *var;
+    const char *func_name;
+    int *args;
+    int num_args;
+    BasicBlock *then;
+    BasicBlock *els;
+};
+
+struct BasicBlock {
+    // next block in layout order
+    BasicBlock *next;
+    int id;
+    IrInsn *insns;
+    IrInsn *last;
+    BasicBlock *succs[2];
+    int num_succs;
+    BasicBlock **preds;
+    int num_preds;
+};
+
+typedef struct IrFunc IrFunc;
+struct IrFunc {
+    IrFunc *next;
+    Function *func;
+    // layout order, the entry block first
+    BasicBlock *blocks;
+    int num_blocks;
+    int num_vregs;
+
+    // register allocation, indexed by virtual register
+    // physical register number, -1 if the value lives in a spill slot
+    int *reg;
+    int *slot;
+    int num_slots;
+    // callee-saved registers in use, as a mask of register numbers
+    uint32_t saved_regs;
+};
+
+// at most two operands or six call arguments
+#define IR_MAX_USES 6
+
+IrFunc *lower(Function *prog);
+void emit_branch(IrOp cmp, bool negate, const char *a, const char *b, const char *label_fmt,
+                 ...);
+void licm(IrFunc *prog);
+int insn_uses(IrInsn *insn, int *uses);
+void dump_ir(IrFunc *prog);
+void regalloc(IrFunc *fn);
+void ir_codegen(IrFunc *prog);
+// Output of a program compiled in memory, both buffers are malloc'ed
+typedef struct {
+    bool ok;
+    // the assembly, NULL if the compilation failed
+    char *out;
+    size_t out_len;
+    // diagnostics, warnings of a successful compilation included
+    char *diag;
+    size_t diag_len;
+} CompileResult;
+
+bool compile_file(char *input, const char *output);
+char *compile_source(char *src, size_t *len);
+CompileResult compile_buffer(char *src);
+
+char *cache_key(Token *begin, Token *end, size_t *len);
+char *cache_load(const char *key, size_t key_len, size_t *len);
+void cache_save(const char *key, size_t key_len, const char *code, size_t len);
+
+// Batch mode, with requests read from stdin or from the connections to a Unix socket
+int batch_run(void);
+void server_run(const char *path);
@@ -0,0 +1,127 @@
+#include "rvcc.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Batch mode: one process compiles any number of programs, read from stdin or from the
+// connections to a Unix socket. A request is the length of the program in decimal and
+// a newline, followed by the program. The response is
+//
+//     ok <n> <m>\n<n bytes of assembly><m bytes of diagnostics>
+//
+// or "error 0 <m>\n<diagnostics>" for a program that does not compile. Either way the
+// next request is served as usual.
+
+// largest program accepted
+#define MAX_REQUEST (64 << 20)
+
+// Serve the requests of in until it ends, returns false on a malformed request
+static bool serve(FILE *in, FILE *out) {
+    char header[32];
+    while (fgets(header, sizeof(header), in) != NULL) {
+        char *end;
+        unsigned long len = strtoul(header, &end, 10);
+        if (end == header || *end != '\n' || len > MAX_REQUEST) {
+            return false;
+        }
+
+        char *src = malloc(len + 1);
+        if (src == NULL) {
+            error("out of memory");
+        }
+        if (fread(src, 1, len, in) != len) {
+            free(src);
+            return false;
+        }
+        src[len] = '\0';
+
+        CompileResult res = compile_buffer(src);
+        fprintf(out, "%s %zu %zu\n", res.ok ? "ok" : "error", res.out_len, res.diag_len);
+        if (res.ok) {
+            fwrite(res.out, 1, res.out_len, out);
+        }
+        fwrite(res.diag, 1, res.diag_len, out);
+        fflush(out);
+
+        heap_free(res.out);
+        free(res.diag);
+        free(src);
+    }
+    return feof(in);
+}
+
+int batch_run(void) {
+    if (!serve(stdin, stdout)) {
+        fprintf(stderr, "rvcc: malformed batch request\n");
+        return 1;
+    }
+    return 0;
+}
+
+// A connection is served on a thread of its own with the options of the server
+typedef struct {
+    int fd;
+    Options opts;
+} Connection;
+
+static void *connection(void *arg) {
+    Connection *conn = arg;
+    g_opts           = conn->opts;
+    int fd           = conn->fd;
+    free(conn);
+    FILE *in  = fdopen(fd, "r");
+    FILE *out = fdopen(dup(fd), "w");
+    if (in != NULL && out != NULL && !serve(in, out)) {
+        fprintf(stderr, "rvcc: malformed request, connection closed\n");
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+    if (out != NULL) {
+        fclose(out);
+    }
+    peephole_release();
+    return NULL;
+}
+
+// Listen on the socket at path and serve every connection, never returns
+void server_run(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        error("socket path too long: %s", path);
+    }
+    strcpy(addr.sun_path, path);
+
+    // replace the socket of a previous server, but nothing else
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        error("cannot listen on %s: %s", path, strerror(errno));
+    }
+
+    while (true) {
+        int conn_fd = accept(fd, NULL, NULL);
+        if (conn_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            error("cannot accept a connection on %s: %s", path, strerror(errno));
+        }
+        Connection *conn = malloc(sizeof(Connection));
+        conn->fd         = conn_fd;
+        conn->opts       = g_opts;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, connection, conn) != 0) {
+            error("cannot create a thread");
+        }
+        pthread_detach(thread);
+    }
+}
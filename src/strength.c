@@ -0,0 +1,189 @@
+#include "rvcc.h"
+
+// Multiplication, division and remainder by a constant without mul, div and rem where a
+// cheaper sequence exists: shifts and adds for multipliers with one or two set bits or a
+// single run of them, shifts with a rounding fixup for powers of two and a multiply-high
+// by a magic number for the other divisors (Hacker's Delight, chapter 10). All of them
+// give the same result as the RV32M instruction for every dividend, INT_MIN / -1 and
+// INT_MIN % -1 included.
+//
+// rd may be rs. a6 and a7 are scratch; no code generator allocates them.
+
+static const char *scratch_a = "a7";
+static const char *scratch_b = "a6";
+
+static bool is_pow2(uint32_t v) { return v != 0 && (v & (v - 1)) == 0; }
+
+static int log2u(uint32_t v) {
+    int n = 0;
+    while (v >>= 1) {
+        n++;
+    }
+    return n;
+}
+
+static void emit_shl(const char *rd, const char *rs, int shift) {
+    if (shift != 0) {
+        emit("    slli %s, %s, %d", rd, rs, shift);
+    } else if (strcmp(rd, rs) != 0) {
+        emit("    mv %s, %s", rd, rs);
+    }
+}
+
+// rd = (rs << hi) op (rs << lo), op being add or sub
+static void emit_shl_pair(const char *op, const char *rd, const char *rs, int hi, int lo) {
+    const char *a = hi ? scratch_a : rs;
+    const char *b = lo ? scratch_b : rs;
+    if (hi) {
+        emit("    slli %s, %s, %d", a, rs, hi);
+    }
+    if (lo) {
+        emit("    slli %s, %s, %d", b, rs, lo);
+    }
+    emit("    %s %s, %s, %s", op, rd, a, b);
+}
+
+void emit_mul_imm(const char *rd, const char *rs, int imm) {
+    uint32_t u   = imm < 0 ? -(uint32_t)imm : (uint32_t)imm;
+    uint32_t low = u & -u;
+
+    if (u == 0) {
+        emit("    li %s, 0", rd);
+    } else if (is_pow2(u)) {
+        emit_shl(rd, rs, log2u(u));
+        if (imm < 0) {
+            emit("    neg %s, %s", rd, rd);
+        }
+    } else if (imm > 0 && is_pow2(u - low)) {
+        // 2^a + 2^b
+        emit_shl_pair("add", rd, rs, log2u(u - low), log2u(low));
+    } else if (is_pow2(u + low)) {
+        // 2^a - 2^b, and 2^b - 2^a for its negation
+        int hi = log2u(u + low);
+        int lo = log2u(low);
+        if (imm > 0) {
+            emit_shl_pair("sub", rd, rs, hi, lo);
+        } else {
+            emit_shl_pair("sub", rd, rs, lo, hi);
+        }
+    } else {
+        emit("    li %s, %d", scratch_a, imm);
+        emit("    mul %s, %s, %s", rd, rs, scratch_a);
+    }
+}
+
+// Magic number and shift of the signed division by d, |d| >= 2 and not a power of two
+static void signed_magic(int d, int *magic, int *shift) {
+    const uint32_t two31 = 0x80000000;
+    uint32_t ad          = d < 0 ? -(uint32_t)d : (uint32_t)d;
+    uint32_t t           = two31 + ((uint32_t)d >> 31);
+    uint32_t anc         = t - 1 - t % ad;
+    uint32_t q1          = two31 / anc;
+    uint32_t r1          = two31 - q1 * anc;
+    uint32_t q2          = two31 / ad;
+    uint32_t r2          = two31 - q2 * ad;
+    uint32_t delta;
+    int p = 31;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    *magic = (int)(d < 0 ? -(q2 + 1) : q2 + 1);
+    *shift = p - 32;
+}
+
+// scratch_a = rs + 2^k - 1 if rs is negative, rs otherwise, so that shifting it right by
+// k rounds toward zero
+static void emit_round_bias(const char *rs, int k) {
+    if (k == 1) {
+        emit("    srli %s, %s, 31", scratch_a, rs);
+    } else {
+        emit("    srai %s, %s, 31", scratch_a, rs);
+        emit("    srli %s, %s, %d", scratch_a, scratch_a, 32 - k);
+    }
+    emit("    add %s, %s, %s", scratch_a, scratch_a, rs);
+}
+
+// rd = rs / d by the magic number, |d| >= 2 and not a power of two
+static void emit_magic_div(const char *rd, const char *rs, int d) {
+    int magic;
+    int shift;
+    signed_magic(d, &magic, &shift);
+    emit("    li %s, %d", scratch_a, magic);
+    emit("    mulh %s, %s, %s", scratch_a, rs, scratch_a);
+    if (d > 0 && magic < 0) {
+        emit("    add %s, %s, %s", scratch_a, scratch_a, rs);
+    } else if (d < 0 && magic > 0) {
+        emit("    sub %s, %s, %s", scratch_a, scratch_a, rs);
+    }
+    if (shift > 0) {
+        emit("    srai %s, %s, %d", scratch_a, scratch_a, shift);
+    }
+    // add one to a negative quotient to round it toward zero
+    emit("    srli %s, %s, 31", scratch_b, scratch_a);
+    emit("    add %s, %s, %s", rd, scratch_a, scratch_b);
+}
+
+void emit_div_imm(const char *rd, const char *rs, int imm) {
+    uint32_t u = imm < 0 ? -(uint32_t)imm : (uint32_t)imm;
+
+    if (u == 0) {
+        // division by zero is left to the hardware
+        emit("    div %s, %s, zero", rd, rs);
+    } else if (u == 1) {
+        if (imm < 0) {
+            emit("    neg %s, %s", rd, rs);
+        } else if (strcmp(rd, rs) != 0) {
+            emit("    mv %s, %s", rd, rs);
+        }
+    } else if (is_pow2(u)) {
+        int k = log2u(u);
+        emit_round_bias(rs, k);
+        emit("    srai %s, %s, %d", rd, scratch_a, k);
+        if (imm < 0) {
+            emit("    neg %s, %s", rd, rd);
+        }
+    } else {
+        emit_magic_div(rd, rs, imm);
+    }
+}
+
+void emit_mod_imm(const char *rd, const char *rs, int imm) {
+    uint32_t u = imm < 0 ? -(uint32_t)imm : (uint32_t)imm;
+
+    if (u == 0) {
+        emit("    rem %s, %s, zero", rd, rs);
+    } else if (u == 1) {
+        emit("    li %s, 0", rd);
+    } else if (is_pow2(u)) {
+        // rs minus rs rounded toward zero to a multiple of 2^k, the sign of d does not matter
+        int k = log2u(u);
+        emit_round_bias(rs, k);
+        if (k <= 11) {
+            emit("    andi %s, %s, %d", scratch_a, scratch_a, -(1 << k));
+        } else {
+            emit("    srai %s, %s, %d", scratch_a, scratch_a, k);
+            emit("    slli %s, %s, %d", scratch_a, scratch_a, k);
+        }
+        emit("    sub %s, %s, %s", rd, rs, scratch_a);
+    } else {
+        // rs - rs / d * d
+        emit_magic_div(scratch_a, rs, imm);
+        emit("    li %s, %d", scratch_b, imm);
+        emit("    mul %s, %s, %s", scratch_b, scratch_a, scratch_b);
+        emit("    sub %s, %s, %s", rd, rs, scratch_b);
+    }
+}
@@ -1,45 +1,139 @@
 #include "rvcc.h"
 
-static char *current_input;
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-void error(char *fmt, ...) {
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// source of the compilation running on this thread, for diagnostics
+static _Thread_local char *current_filename;
+static _Thread_local char *current_input;
+// the buffer tokenize_file() read, its tokens point into it until release_source()
+static _Thread_local char *s_source;
+static _Thread_local size_t s_source_len;
+static _Thread_local bool s_source_mapped;
+
+// where errors on this thread return to, NULL exits the process
+static _Thread_local jmp_buf *s_recovery;
+// where diagnostics of this thread go, stderr if there is no handler
+static _Thread_local ErrorHandler s_handler;
+
+SourceFile current_source(void) { return (SourceFile){current_filename, current_input}; }
+
+void set_current_source(SourceFile src) {
+    current_filename = src.filename;
+    current_input    = src.input;
+}
+
+void error_set_recovery(jmp_buf *env) { s_recovery = env; }
+
+void error_set_handler(ErrorHandler handler) { s_handler = handler; }
+
+ErrorHandler error_handler(void) { return s_handler; }
+
+// Give up on the current compilation, its error has been reported
+_Noreturn void error_exit(void) {
+    if (s_recovery != NULL) {
+        longjmp(*s_recovery, 1);
+    }
+    exit(1);
+}
+
+// Hand over one complete diagnostic, a single write keeps it in one piece when several
+// threads report at once
+static void deliver(const char *msg) {
+    if (s_handler.fn != NULL) {
+        s_handler.fn(s_handler.ctx, msg);
+        return;
+    }
+    fputs(msg, stderr);
+}
+
+_Noreturn void error(char *fmt, ...) {
     va_list va;
     va_start(va, fmt);
     char str[1024] = {};
-    vsprintf(str, fmt, va);
-    fprintf(stderr, "%s\n", str);
+    vsnprintf(str, sizeof(str) - 1, fmt, va);
+    strcat(str, "\n");
     va_end(va);
-    exit(1);
+    deliver(str);
+    error_exit();
 }
 
-void verror_at(const char *loc, const char *fmt, va_list va) {
+static void vprint_at(const char *loc, const char *prefix, const char *fmt, va_list va) {
+    // find the line containing loc
+    const char *line = loc;
+    while (current_input < line && line[-1] != '\n') {
+        line--;
+    }
+    const char *end = loc;
+    while (*end && *end != '\n') {
+        end++;
+    }
+    int line_no = 1;
+    for (const char *p = current_input; p < line; p++) {
+        if (*p == '\n') {
+            line_no++;
+        }
+    }
+
+    char *msg;
+    size_t size;
+    FILE *out = open_memstream(&msg, &size);
+    if (out == NULL) {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
     // output source code info
-    fprintf(stderr, "%s\n", current_input);
+    int indent = fprintf(out, "%s:%d: ", current_filename, line_no);
+    fprintf(out, "%.*s\n", (int)(end - line), line);
     // calculate error location
-    int len = loc - current_input;
-    fprintf(stderr, "%*s", len, "");
-    fprintf(stderr, "^ ");
-    char str[1024] = {};
-    vsprintf(str, fmt, va);
-    fprintf(stderr, "%s\n", str);
+    int len = loc - line + indent;
+    fprintf(out, "%*s", len, "");
+    fprintf(out, "^ %s", prefix);
+    vfprintf(out, fmt, va);
+    fputc('\n', out);
+    fclose(out);
+    deliver(msg);
+    free(msg);
+}
+
+_Noreturn void verror_at(const char *loc, const char *fmt, va_list va) {
+    vprint_at(loc, "", fmt, va);
     va_end(va);
-    exit(1);
+    error_exit();
 }
 
-void error_at(const char *loc, const char *fmt, ...) {
+_Noreturn void error_at(const char *loc, const char *fmt, ...) {
     va_list va;
     va_start(va, fmt);
     verror_at(loc, fmt, va);
 }
 
-void error_tok(const Token *tok, const char *fmt, ...) {
+_Noreturn void error_tok(const Token *tok, const char *fmt, ...) {
     va_list va;
     va_start(va, fmt);
     verror_at(tok->loc, fmt, va);
 }
 
-bool consume(Token **rest, Token *tok, const char *str) {
-    if (str_equal(tok, str)) {
+void warn_tok(const Token *tok, const char *fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+    vprint_at(tok->loc, "warning: ", fmt, va);
+    va_end(va);
+}
+
+bool consume(Token **rest, Token *tok, TokenId id) {
+    if (equal(tok, id)) {
         *rest = tok->next;
         return true;
     }
@@ -55,80 +149,409 @@ static int get_number(Token *tok) {
     return tok->val;
 }
 
-static bool starts_with(const char *str, const char *sub_str) {
-    return strncmp(str, sub_str, strlen(sub_str)) == 0;
+// Character classes
+#define CC_SPACE 1
+#define CC_DIGIT 2
+#define CC_ALPHA 4
+#define CC_PUNCT 8
+#define CC_IDENT (CC_ALPHA | CC_DIGIT)
+
+#define S CC_SPACE
+#define D CC_DIGIT
+#define I CC_ALPHA
+#define P CC_PUNCT
+static const unsigned char char_class[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, S, S, S, S, S, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    S, P, P, P, P, P, P, P, P, P, P, P, P, P, P, P,
+    D, D, D, D, D, D, D, D, D, D, P, P, P, P, P, P,
+    P, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I,
+    I, I, I, I, I, I, I, I, I, I, I, P, P, P, P, I,
+    P, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I,
+    I, I, I, I, I, I, I, I, I, I, I, P, P, P, P, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+#undef S
+#undef D
+#undef I
+#undef P
+
+// Loading n bytes at p stays within p's page. The input is NUL-terminated and the
+// NUL stops every scan, so reading past it inside the same page is harmless.
+#define CAN_LOAD(p, n) (((uintptr_t)(p)&4095) <= 4096 - (n))
+
+#if defined(__SSE2__)
+// Bit i is set if p[i] is not a whitespace character
+static unsigned not_space_mask16(__m128i c) {
+    __m128i sp = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+                              _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('\t' - 1)),
+                                            _mm_cmplt_epi8(c, _mm_set1_epi8('\r' + 1))));
+    return ~_mm_movemask_epi8(sp) & 0xffff;
 }
 
-static int read_punct(const char *p) {
-    bool is_relation = starts_with(p, "==") || starts_with(p, "!=") ||
-                       starts_with(p, ">=") || starts_with(p, "<=");
-    return (is_relation ? 2 : 1);
+// Bit i is set if p[i] can not continue an identifier
+static unsigned not_ident_mask16(__m128i c) {
+    // setting bit 5 maps 'A'-'Z' onto 'a'-'z' and nothing else onto it
+    __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i under = _mm_cmpeq_epi8(c, _mm_set1_epi8('_'));
+    return ~_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), under)) & 0xffff;
 }
+#endif
 
-static bool is_ident1(char c) {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+#if defined(__AVX2__)
+static unsigned not_space_mask32(__m256i c) {
+    __m256i sp = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+                                 _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('\t' - 1)),
+                                                  _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), c)));
+    return ~(unsigned)_mm256_movemask_epi8(sp);
 }
 
-static bool is_ident2(char c) { return is_ident1(c) || (c >= '0' && c <= '9'); }
+static unsigned not_ident_mask32(__m256i c) {
+    __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+    __m256i under = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('_'));
+    return ~(unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(alpha, digit), under));
+}
+#endif
 
-static Token *new_token(TokenKind kind, const char *start, const char *end) {
-    Token *tok = calloc(1, sizeof(Token));
-    tok->kind  = kind;
-    tok->loc   = start;
-    tok->len   = end - start;
-    return tok;
+// Skip a run of characters of class cc. Most runs are short, so the first bytes are
+// checked one by one and only long runs go 32 or 16 bytes at a time.
+static char *skip_class(char *p, int cc) {
+    for (int i = 0; i < 8; i++, p++) {
+        if (!(char_class[(unsigned char)*p] & cc)) {
+            return p;
+        }
+    }
+#if defined(__AVX2__)
+    while (CAN_LOAD(p, 32)) {
+        __m256i c     = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = cc == CC_SPACE ? not_space_mask32(c) : not_ident_mask32(c);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    while (CAN_LOAD(p, 16)) {
+        __m128i c     = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = cc == CC_SPACE ? not_space_mask16(c) : not_ident_mask16(c);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (char_class[(unsigned char)*p] & cc) {
+        p++;
+    }
+    return p;
+}
+
+static const char *spellings[ID_IDENT] = {
+    [ID_LPAREN] = "(",       [ID_RPAREN] = ")",   [ID_LBRACE] = "{",  [ID_RBRACE] = "}",
+    [ID_COMMA] = ",",        [ID_SEMI] = ";",     [ID_ASSIGN] = "=",  [ID_PLUS] = "+",
+    [ID_MINUS] = "-",        [ID_STAR] = "*",     [ID_SLASH] = "/",   [ID_AMP] = "&",
+    [ID_PERCENT] = "%",      [ID_PIPE] = "|",     [ID_CARET] = "^",   [ID_TILDE] = "~",
+    [ID_NOT] = "!",          [ID_EQ] = "==",      [ID_NE] = "!=",     [ID_LT] = "<",
+    [ID_LE] = "<=",          [ID_GT] = ">",       [ID_GE] = ">=",     [ID_SHL] = "<<",
+    [ID_SHR] = ">>",         [ID_LOGAND] = "&&",  [ID_LOGOR] = "||",  [ID_RETURN] = "return",
+    [ID_IF] = "if",          [ID_ELSE] = "else",  [ID_FOR] = "for",   [ID_WHILE] = "while",
+    [ID_INT] = "int",
+};
+
+const char *id_spelling(TokenId id) {
+    return id < ID_IDENT ? spellings[id] : intern_name(id);
 }
 
-static bool is_keyword(Token *tok) {
-    static char *keyword[] = {"return", "if", "else", "for", "while", "int"};
-    for (size_t i = 0; i < sizeof(keyword) / sizeof(*keyword); ++i) {
-        return str_equal(tok, keyword[i]);
+// Single-character punctuators, the others stay ID_NONE and never match in the parser
+static const unsigned char punct_ids[128] = {
+    ['('] = ID_LPAREN,  [')'] = ID_RPAREN, ['{'] = ID_LBRACE, ['}'] = ID_RBRACE,
+    [','] = ID_COMMA,   [';'] = ID_SEMI,   ['='] = ID_ASSIGN, ['+'] = ID_PLUS,
+    ['-'] = ID_MINUS,   ['*'] = ID_STAR,   ['/'] = ID_SLASH,  ['&'] = ID_AMP,
+    ['%'] = ID_PERCENT, ['|'] = ID_PIPE,   ['^'] = ID_CARET,  ['~'] = ID_TILDE,
+    ['!'] = ID_NOT,     ['<'] = ID_LT,     ['>'] = ID_GT,
+};
+
+// Multi-character punctuators are found by a switch on their first byte
+static int read_punct(const char *p, int *id) {
+    switch (*p) {
+        case '=':
+            if (p[1] == '=') {
+                *id = ID_EQ;
+                return 2;
+            }
+            break;
+        case '!':
+            if (p[1] == '=') {
+                *id = ID_NE;
+                return 2;
+            }
+            break;
+        case '<':
+            if (p[1] == '=' || p[1] == '<') {
+                *id = p[1] == '=' ? ID_LE : ID_SHL;
+                return 2;
+            }
+            break;
+        case '>':
+            if (p[1] == '=' || p[1] == '>') {
+                *id = p[1] == '=' ? ID_GE : ID_SHR;
+                return 2;
+            }
+            break;
+        case '&':
+            if (p[1] == '&') {
+                *id = ID_LOGAND;
+                return 2;
+            }
+            break;
+        case '|':
+            if (p[1] == '|') {
+                *id = ID_LOGOR;
+                return 2;
+            }
+            break;
+        default:
+            break;
+    }
+    *id = punct_ids[(unsigned char)*p];
+    return 1;
+}
+
+// Keywords are recognized while scanning identifiers with a perfect hash over
+// (first byte, last byte, length). The table must stay collision free when a
+// keyword is added; adjust KEYWORD_HASH until it is.
+#define KEYWORD_HASH(p, len) (((unsigned char)(p)[0] + (unsigned char)(p)[(len)-1] * 5 + (len)) & 7)
+
+static TokenId keyword_table[8];
+static pthread_once_t s_keywords_once = PTHREAD_ONCE_INIT;
+
+static void init_keywords(void) {
+    for (TokenId id = ID_RETURN; id <= ID_INT; id++) {
+        const char *kw = spellings[id];
+        int h          = KEYWORD_HASH(kw, strlen(kw));
+        assert(keyword_table[h] == ID_NONE);
+        keyword_table[h] = id;
     }
-    return false;
 }
 
-static void mark_keyword(Token *tok) {
-    for (Token *t = tok; t->kind != TK_EOF; t = t->next) {
-        if (is_keyword(tok)) {
-            t->kind = TK_KEYWORD;
+// Returns the keyword id of [p, p + len) or ID_NONE
+static TokenId find_keyword(const char *p, int len) {
+    TokenId id = keyword_table[KEYWORD_HASH(p, len)];
+    if (id == ID_NONE) {
+        return ID_NONE;
+    }
+    const char *kw = spellings[id];
+    return strncmp(kw, p, len) == 0 && kw[len] == '\0' ? id : ID_NONE;
+}
+
+// Identifier interning: every distinct name gets a stable id for this compilation
+static _Thread_local HashMap s_intern_map;
+static _Thread_local char **s_intern_names;
+static _Thread_local int s_intern_count;
+static _Thread_local int s_intern_capacity;
+
+static int intern(const char *p, int len) {
+    intptr_t id = (intptr_t)hashmap_get(&s_intern_map, p, len);
+    if (id != 0) {
+        return id;
+    }
+
+    if (s_intern_count == s_intern_capacity) {
+        s_intern_capacity = s_intern_capacity ? s_intern_capacity * 2 : 256;
+        char **names      = arena_alloc(sizeof(char *) * s_intern_capacity);
+        if (s_intern_count > 0) {
+            memcpy(names, s_intern_names, sizeof(char *) * s_intern_count);
         }
+        s_intern_names = names;
     }
+    s_intern_names[s_intern_count] = arena_strndup(p, len);
+    id                             = ID_IDENT + s_intern_count++;
+    hashmap_put(&s_intern_map, p, len, (void *)id);
+    return id;
+}
+
+// Number of interned identifiers, their ids are ID_IDENT .. ID_IDENT + intern_count() - 1
+int intern_count(void) { return s_intern_count; }
+
+const char *intern_name(int id) { return s_intern_names[id - ID_IDENT]; }
+
+static Token *new_token(TokenKind kind, const char *start, const char *end) {
+    Token *tok = arena_alloc_kind(MEM_TOKEN, sizeof(Token));
+    tok->kind  = kind;
+    tok->loc   = start;
+    tok->len   = end - start;
+    return tok;
 }
 
 Token *tokenize(char *p) {
     current_input = p;
+    pthread_once(&s_keywords_once, init_keywords);
+    memset(&s_intern_map, 0, sizeof(s_intern_map));
+    s_intern_names    = NULL;
+    s_intern_count    = 0;
+    s_intern_capacity = 0;
 
     Token head = {};
     Token *cur = &head;
     while (*p) {
-        if (isspace(*p)) {
-            p++;
-        } else if (isdigit(*p)) {
-            cur->next         = new_token(TK_NUM, p, p);
-            cur               = cur->next;
-            const char *old_p = p;
-            cur->val          = strtoul(p, &p, 10);
-            cur->len          = p - old_p;
-        } else if (ispunct(*p)) {
-            int punct_len = read_punct(p);
-            cur->next     = new_token(TK_PUNCT, p, p + punct_len);
-            cur           = cur->next;
-            p += punct_len;
-        } else if (is_ident1(*p)) {
-            // [a-zA-Z_][a-zA-Z0-9_]*
-            char *start = p;
-            do {
-                ++p;
-            } while (is_ident2(*p));
-            cur->next = new_token(TK_IDENT, start, p);
-            cur       = cur->next;
-        } else {
-            error_at(p, "invalid token\n");
+        switch (char_class[(unsigned char)*p]) {
+            case CC_SPACE:
+                p = skip_class(p + 1, CC_SPACE);
+                break;
+            case CC_DIGIT: {
+                char *start  = p;
+                unsigned val = 0;
+                do {
+                    val = val * 10 + (*p++ - '0');
+                } while (char_class[(unsigned char)*p] & CC_DIGIT);
+                cur->next = new_token(TK_NUM, start, p);
+                cur       = cur->next;
+                cur->val  = (int)val;
+                break;
+            }
+            case CC_ALPHA: {
+                // [a-zA-Z_][a-zA-Z0-9_]*
+                char *start = p;
+                p           = skip_class(p + 1, CC_IDENT);
+                TokenId id  = find_keyword(start, p - start);
+                if (id != ID_NONE) {
+                    cur->next     = new_token(TK_KEYWORD, start, p);
+                    cur->next->id = id;
+                } else {
+                    cur->next     = new_token(TK_IDENT, start, p);
+                    cur->next->id = intern(start, p - start);
+                }
+                cur = cur->next;
+                break;
+            }
+            case CC_PUNCT: {
+                int id;
+                int punct_len = read_punct(p, &id);
+                cur->next     = new_token(TK_PUNCT, p, p + punct_len);
+                cur           = cur->next;
+                cur->id       = id;
+                p += punct_len;
+                break;
+            }
+            default:
+                error_at(p, "invalid token");
         }
     }
 
     cur->next = new_token(TK_EOF, p, p);
-    // mark keyword
-    mark_keyword(head.next);
     return head.next;
-}
\ No newline at end of file
+}
+
+// Map a regular file read-only. Only possible when its size is not a multiple of the
+// page size: then the tail of the last page is zero-filled and terminates the string.
+static char *map_file(int fd, const struct stat *st) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (!S_ISREG(st->st_mode) || st->st_size == 0 || st->st_size % page_size == 0) {
+        return NULL;
+    }
+    char *buf = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf == MAP_FAILED) {
+        return NULL;
+    }
+    s_source_len    = st->st_size;
+    s_source_mapped = true;
+    return buf;
+}
+
+static void close_input(int fd) {
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+}
+
+// Read fd up to its end into s_source, where release_source() finds the buffer even
+// if the unit ends in an error
+static void read_all(int fd, const char *path) {
+    size_t cap = 0;
+    size_t len = 0;
+    while (true) {
+        if (len + 1 >= cap) {
+            cap       = cap ? cap * 2 : 4096;
+            char *buf = heap_realloc(s_source, len, cap);
+            if (buf == NULL) {
+                close_input(fd);
+                error("out of memory");
+            }
+            s_source = buf;
+        }
+        ssize_t n = read(fd, s_source + len, cap - len - 1);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int err = errno;
+            close_input(fd);
+            error("cannot read %s: %s", path, strerror(err));
+        }
+        len += n;
+    }
+    s_source[len] = '\0';
+}
+
+// Put the NUL-terminated contents of path in s_source, "-" reads stdin
+static void read_file(const char *path) {
+    int fd = STDIN_FILENO;
+    if (strcmp(path, "-") != 0) {
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            error("cannot open %s: %s", path, strerror(errno));
+        }
+    }
+
+    struct stat st;
+    s_source_mapped = false;
+    if (fstat(fd, &st) == 0) {
+        s_source = map_file(fd, &st);
+    }
+    if (s_source == NULL) {
+        read_all(fd, path);
+    }
+    close_input(fd);
+}
+
+Token *tokenize_file(char *path) {
+    release_source();
+    current_filename = strcmp(path, "-") == 0 ? "<stdin>" : path;
+    read_file(path);
+    return tokenize(s_source);
+}
+
+// Unmap or free the buffer of the last tokenize_file(), once the unit is done with it
+void release_source(void) {
+    if (s_source == NULL) {
+        return;
+    }
+    if (s_source_mapped) {
+        munmap(s_source, s_source_len);
+    } else {
+        heap_free(s_source);
+    }
+    if (current_input == s_source) {
+        current_input = NULL;
+    }
+    s_source = NULL;
+}
@@ -11,14 +11,14 @@ bool is_ptr(Type *type) {
 }
 
 Type *pointer_to(Type *base) {
-    Type *type = calloc(1, sizeof(Type));
+    Type *type = arena_alloc_kind(MEM_TYPE, sizeof(Type));
     type->kind = TY_PTR;
     type->base = base;
     return type;
 }
 
 Type *func_type(Type *ret_type) {
-    Type *type = calloc(1, sizeof(Type));
+    Type *type = arena_alloc_kind(MEM_TYPE, sizeof(Type));
     type->kind = TY_FUNC;
     type->name = ret_type->name;
     type->ret_type = ret_type;
@@ -26,7 +26,7 @@ Type *func_type(Type *ret_type) {
 }
 
 Type *copy_type(Type *type) {
-    Type *ty = calloc(1, sizeof(Type));
+    Type *ty = arena_alloc_kind(MEM_TYPE, sizeof(Type));
     *ty = *type;
     return ty;
 }
@@ -53,10 +53,23 @@ void add_type(Node *nd) {
         case ND_SUB:
         case ND_MUL:
         case ND_DIV:
+        case ND_MOD:
+        case ND_SHL:
+        case ND_SHR:
+        case ND_BITAND:
+        case ND_BITOR:
+        case ND_BITXOR:
         case ND_NEG:
+        case ND_BITNOT:
         case ND_ASSIGN:
             nd->type = nd->lhs->type;
             return;
+        case ND_COMMA:
+            nd->type = nd->rhs->type;
+            return;
+        case ND_NOT:
+        case ND_LOGAND:
+        case ND_LOGOR:
         case ND_EQ:
         case ND_NE:
         case ND_LT:
@@ -80,4 +93,4 @@ void add_type(Node *nd) {
         default:
             break;
     }
-}
\ No newline at end of file
+}
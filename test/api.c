@@ -0,0 +1,146 @@
+#include <librvcc.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// librvcc used from several threads at once, with contexts of different options, a
+// counting allocator and a diagnostic callback. Every program must compile to the same
+// code as when compiled alone, errors must reach the callback, and all memory must be
+// given back. Writes the code of the first program to argv[1] to be run by the caller.
+
+#define NUM_THREADS 4
+#define ROUNDS      50
+
+static const char *programs[] = {
+    "int f(int n){ if (n<2) return n; return f(n-1)+f(n-2); } int main(){ return f(10); }",
+    "int main(){ int s=0; int i; for (i=0;i<10;i=i+1) s=s+i; return s; }",
+    "int g(int a, int b){ return a*b-a; } int h(){ return g(6, 7); } int main(){ return h(); }",
+};
+#define NUM_PROGRAMS (int)(sizeof(programs) / sizeof(*programs))
+static const char *bad_program = "int main(){ return 1 +; }";
+
+static atomic_long s_live;
+static atomic_int s_diagnostics;
+
+// alloc and free keep a size header to count the bytes alive
+static void *count_alloc(void *user, size_t size) {
+    (void)user;
+    size_t *p = malloc(sizeof(size_t) * 2 + size);
+    if (p == NULL) {
+        return NULL;
+    }
+    p[0] = size;
+    atomic_fetch_add(&s_live, size);
+    return p + 2;
+}
+
+static void count_free(void *user, void *ptr) {
+    (void)user;
+    size_t *p = (size_t *)ptr - 2;
+    atomic_fetch_sub(&s_live, p[0]);
+    free(p);
+}
+
+static void on_diagnostic(void *user, const char *msg) {
+    (void)user;
+    if (strstr(msg, "<input>:1:") != NULL) {
+        atomic_fetch_add(&s_diagnostics, 1);
+    }
+}
+
+static RvccContext *s_ctx[2];
+// code of every program with every context, compiled alone
+static char *s_expected[2][NUM_PROGRAMS];
+static atomic_int s_failures;
+
+static char *compile(RvccContext *ctx, const char *src) {
+    char *out;
+    size_t len;
+    if (rvcc_compile(ctx, src, strlen(src), &out, &len) != 0) {
+        return NULL;
+    }
+    if (strlen(out) != len) {
+        fprintf(stderr, "api: output length %zu, expected %zu\n", strlen(out), len);
+        atomic_fetch_add(&s_failures, 1);
+    }
+    return out;
+}
+
+static void *worker(void *arg) {
+    int id = (int)(long)arg;
+    for (int round = 0; round < ROUNDS; round++) {
+        int c        = (id + round) % 2;
+        int p        = (id * 7 + round) % NUM_PROGRAMS;
+        char *out    = compile(s_ctx[c], programs[p]);
+        char *no_out = compile(s_ctx[c], bad_program);
+        if (out == NULL || strcmp(out, s_expected[c][p]) != 0 || no_out != NULL) {
+            fprintf(stderr, "api: program %d with context %d differs\n", p, c);
+            atomic_fetch_add(&s_failures, 1);
+        }
+        rvcc_free(s_ctx[c], out);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    RvccOptions opts = {
+        .alloc      = count_alloc,
+        .free       = count_free,
+        .diagnostic = on_diagnostic,
+    };
+    s_ctx[0]             = rvcc_create(&opts);
+    opts.opt_level       = 1;
+    opts.ir_backend      = true;
+    opts.codegen_threads = 2;
+    s_ctx[1]             = rvcc_create(&opts);
+
+    for (int c = 0; c < 2; c++) {
+        for (int p = 0; p < NUM_PROGRAMS; p++) {
+            s_expected[c][p] = compile(s_ctx[c], programs[p]);
+            if (s_expected[c][p] == NULL) {
+                fprintf(stderr, "api: program %d does not compile\n", p);
+                return 1;
+            }
+        }
+    }
+    if (strcmp(s_expected[0][0], s_expected[1][0]) == 0) {
+        fprintf(stderr, "api: the options of the contexts make no difference\n");
+        return 1;
+    }
+
+    pthread_t threads[NUM_THREADS];
+    for (long i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, worker, (void *)i);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if (atomic_load(&s_diagnostics) != NUM_THREADS * ROUNDS) {
+        fprintf(stderr, "api: %d diagnostics, expected %d\n", atomic_load(&s_diagnostics),
+                NUM_THREADS * ROUNDS);
+        return 1;
+    }
+
+    if (argc > 1) {
+        FILE *fp = fopen(argv[1], "w");
+        if (fp == NULL) {
+            return 1;
+        }
+        fputs(s_expected[1][0], fp);
+        fclose(fp);
+    }
+    for (int c = 0; c < 2; c++) {
+        for (int p = 0; p < NUM_PROGRAMS; p++) {
+            rvcc_free(s_ctx[c], s_expected[c][p]);
+        }
+        rvcc_destroy(s_ctx[c]);
+    }
+    if (atomic_load(&s_live) != 0) {
+        fprintf(stderr, "api: %ld bytes not freed\n", atomic_load(&s_live));
+        return 1;
+    }
+    return atomic_load(&s_failures) ? 1 : 0;
+}
@@ -1,19 +1,21 @@
 #!/bin/bash
 
+# usage: run_tests.sh [build dir], runs the generated code on the build's rvcc-sim
+build=${1:-build}
+
 assert() {
     expected="$1"
     input="$2"
 
-    cd /home/yuhongzhang/workspace/rvcc/build
-    ./rvcc "$input" > tmp.s || exit
-    riscv64-unknown-elf-gcc -march=rv32im -mabi=ilp32 tmp.s -o tmp
-    qemu-riscv32 /home/yuhongzhang/workspace/rvcc/build/tmp
+    echo "$input" | $build/rvcc $RVCC_FLAGS -o $build/tmp.s - || exit
+    $build/rvcc-sim $build/tmp.s
 
     actual="$?"
     if [ "$expected" == "$actual" ]; then
         echo "$input => $actual"
     else
         echo "$input => $expected expected, bug got $actual"
+        exit 1
     fi
 }
 
@@ -117,4 +119,275 @@ assert 7 'int main() { return add2(3,4); } int add2(int x, int y) { return x+y;
 # assert 1 'int main() { return sub2(4,3); } int sub2(int x, int y) { return x-y; }'
 # assert 55 'int main() { return fib(9); } int fib(int x) { if (x<=1) return 1; return fib(x-1) + fib(x-2); }'
 
+# temporaries run out of registers and spill to the frame
+assert 88 'int main(){ return ((((1+2)+(3+4))+((5+6)+(7+8)))+(((1+2)+(3+4))+((5+6)+(7+8)))) + ((((1+1)+(1+1))+((1+1)+(1+1)))+(((1+1)+(1+1))+((1+1)+(1+1)))) - (((((1+2)+(3+4))+((5+6)+(7+8)))+(((1+2)+(3+4))+((5+6)+(7+8)))) - ((((1+2)+(3+4))+((5+6)+(7+8)))+(((1+2)+(3+4))+((5+6)+(7+8))))); }'
+assert 13 'int main(){ return f(1,2) + f(3,4) + g(f(1,1), f(2,2), 3); } int f(int a, int b){ return a+b; } int g(int a,int b,int c){ return a*b-c-2; }'
+assert 20 'int main(){ int a=3; return h(a,2,3,4,5,h(1,a,3,4,h(a,a,a,a,a,a),6)); } int h(int a,int b,int c,int d,int e,int g){ return a+b*2+c*3+d-e+g; }'
+
+# constant folding
+assert 17 'int main(){ return 1-8/(2*2)+3*6; }'
+assert 11 'int main(){ int x=5; return (x+0)*1 + 0*x + -(-x) + (x/1) - (0+x) + (7==7); }'
+assert 7 'int main(){ int x=3; int y=5; *(&x+1+1-1)=7; return y; }'
+assert 4 'int main(){ int x=0; if (1) x=4; else x=5; if (0) x=x+10; for (;1;) { return x; } return 0; }'
+
+# block scope
+assert 1 'int main(){ int x=1; { int x=2; x=3; } return x; }'
+assert 71 'int main(){ int x=1; int y=0; { int x=2; { int x=5; y=y+x; } y=y+x; } return y*10+x; }'
+
+# bitwise, shift, remainder and logical operators
+assert 2 'int main(){ return 17%5; }'
+assert 33 'int main(){ int a=3; return (a<<3)-(-12>>2)+(12&10)-(12|3)+(12^10)+~-8; }'
+assert 14 'int main(){ return 1+2*3<<1|1 ^ 8 & 15 ^ 8 == 8; }'
+assert 2 'int main(){ return !0 + !!5 + !3; }'
+assert 0 'int main(){ int a=0; 0 && (a=1); 1 || (a=2); return a; }'
+assert 1 'int main(){ int x=6; return x > 3 && x < 10 || x == 0; }'
+
+# code generated from the IR
+RVCC_FLAGS=-fir-backend
+assert 3 'int main(){ int x=3; return x; }'
+assert 6 'int main(){ int x; int *p=&x; *p=5; x=x+1; return *p; }'
+assert 42 'int main(){ int s=0; int i; int j; for (i=0;i<5;i=i+1) for (j=0;j<i;j=j+1) if (i+j > 3 || j == 0) s=s+i*j+1; return s; }'
+assert 144 'int fib(int n){ if (n<2) return n; return fib(n-1)+fib(n-2); } int main(){ return fib(12); }'
+assert 174 'int id(int x){ return x; } int main(){ int a=1; int b=2; int c=3; int d=4; int e=5; int f=6; int g=7; int h=8; int i=9; int j=10; int k=11; int l=12; int m=13; int n=14; int o=15; int p=16; int q=17; int r=id(18); return a+b+c+d+e+f+g+h+i+j+k+l+m+n+o+p+q+r+id(a)*id(q) - id(b+c+d+e); }'
+RVCC_FLAGS=
+
+# peephole optimizer
+RVCC_FLAGS=-O1
+assert 42 'int main(){ int s=0; int i; int j; for (i=0;i<5;i=i+1) for (j=0;j<i;j=j+1) if (i+j > 3 || j == 0) s=s+i*j+1; return s; }'
+assert 7 'int main(){ int x=3; int y=5; *(&x+1)=7; return y; }'
+assert 19 'int main(){ int a=5; int b=a-3; if (a) {} else {} return (b<<2) + (a&1) + (a^0) + (a|0) - (a<3) - 0*b; }'
+assert 45 'int f(int a, int b){ return a*10+b; } int main(){ int x=4; return f(x, x+1); }'
+RVCC_FLAGS=-O1\ -fir-backend
+assert 144 'int fib(int n){ if (n<2) return n; return fib(n-1)+fib(n-2); } int main(){ return fib(12); }'
+RVCC_FLAGS=
+
+# leaf functions and frames addressed from sp
+RVCC_FLAGS=-fomit-frame-pointer
+assert 7 'int add(int a, int b){ return a+b; } int main(){ return add(3, 4); }'
+assert 21 'int sq(int x){ int y=x*x; return y; } int f(int n){ int s=0; int i; for (i=1;i<=n;i=i+1) s=s+sq(i); return s; } int main(){ return f(3)+7; }'
+assert 9 'int main(){ int x=4; int *p=&x; *p=*p+5; return x; }'
+RVCC_FLAGS=-O1\ -fir-backend
+assert 89 'int fib(int n){ if (n<2) return 1; return fib(n-1)+fib(n-2); } int id(int x){ return x; } int main(){ return id(fib(10)); }'
+RVCC_FLAGS=
+
+# rotated loops, and loop-invariant code leaves them with -O1
+RVCC_FLAGS=-O1\ -fir-backend
+assert 15 'int main(){ int x=1; int *p=&x; int s=0; int i; for (i=0;i<5;i=i+1) { s=s+*p; *p=*p+1; } return s; }'
+assert 3 'int main(){ int *p=0; int s=3; int i; for (i=0;i<0;i=i+1) s=s+*p; return s; }'
+assert 45 'int bump(int *p){ *p=*p+1; return 0; } int main(){ int x=1; int s=0; int i; for (i=0;i<5;i=i+1) { s=s+x*3; bump(&x); } return s; }'
+assert 23 'int main(){ int x=2; int s=0; int i; for (i=0;i<4;i=i+1) { s=s+x; x=7; } return s; }'
+assert 105 'int main(){ int s=0; int i; int j; int n=3; for (i=0;i<n;i=i+1) for (j=i;j<n+2;j=j+1) { if (j>2) s=s+(n*4+j); else s=s+i*n; } return s; }'
+RVCC_FLAGS=
+assert 70 'int main(){ int s=0; int i=0; for (;;) { s=s+7; i=i+1; if (i>9) return s; } return 1; }'
+assert 10 'int main(){ int i; int s=0; for (i=10;i<3;i=i+1) s=s+1; return s+i; }'
+echo 'int f(int n, int k){ int x=k; int *p=&x; int s=0; int i; for (i=0;i<n;i=i+1) s=s+k*7+*p; return s; }' > $build/licm.c
+$build/rvcc -O1 --emit-ir -o $build/licm.ir $build/licm.c || exit
+# the body of the loop is the block that is its own predecessor
+if awk '/^bb/ { name = substr($1, 1, length($1) - 1); body = $0 ~ (" " name "( |$)") } body' \
+    $build/licm.ir | grep -q "muli\|load"; then
+    echo "licm: k*7 or *p left in the loop"
+    exit 1
+fi
+# small constants are left to the instructions using them, hoisting k*7 costs nothing
+echo 'int f(int n, int k){ int s=0; int i; for (i=0;i<n;i=i+1) s=s+k*7+i*3+5; return s; }' > $build/licm.c
+$build/rvcc -O1 -fir-backend -fno-verbose-asm -o $build/licm.s $build/licm.c || exit
+$build/rvcc -O1 -fir-backend -fno-verbose-asm -fno-move-loop-invariants -o $build/tmp.s $build/licm.c || exit
+if [ "$(grep -cE '^\s+[a-z]' $build/licm.s)" -gt "$(grep -cE '^\s+[a-z]' $build/tmp.s)" ]; then
+    echo "licm: the hoisted loop is larger than the one left alone"
+    exit 1
+fi
+echo "licm: => ok"
+
+# conditions branch on the comparison itself
+cond_test='int t(int a, int b){ int n=0; if (a<=b && !(b<0)) n=n+1; if (0<a || a==b) n=n+2; while (a!=b && b>=0) { n=n+4; b=b-1; } return n; } int main(){ return t(2, 5)*10 + t(-1, -1); }'
+assert 152 "$cond_test"
+RVCC_FLAGS=-O1
+assert 152 "$cond_test"
+RVCC_FLAGS=-O1\ -fir-backend
+assert 152 "$cond_test"
+RVCC_FLAGS=
+for flags in "" "-fir-backend"; do
+    echo 'int f(int a, int b){ if (a < b) return 1; return 0; }' | $build/rvcc $flags -o $build/tmp.s - || exit
+    if grep -q "slt\|seqz\|snez" $build/tmp.s || ! grep -q "bge" $build/tmp.s; then
+        echo "compare-and-branch $flags: a < b materialized"
+        exit 1
+    fi
+done
+echo "compare-and-branch: => ok"
+
+# small and single-call functions are inlined with -O1, recursive ones never
+RVCC_FLAGS=-O1
+assert 21 'int add2(int a, int b){ return a+b; } int main(){ return add2(3, 4)*add2(1, 2); }'
+assert 86 'int sq(int x){ return x*x; } int f(int x){ return sq(x)+sq(x+1); } int main(){ return f(3)+f(f(1)); }'
+assert 32 'int g(int *p, int v){ *p=*p+v; return *p; } int main(){ int x=5; g(&x, 3); return g(&x, x)+x; }'
+assert 16 'int p(int a){ int *q=&a; *q=*q+4; return a; } int main(){ return p(3)+p(p(1)); }'
+assert 12 'int k(int a){ int t; t=a; a=a+1; return t+a; } int main(){ return k(7)+k(-2); }'
+assert 56 'int fib(int n){ if (n<2) return n; return fib(n-1)+fib(n-2); } int w(int n){ return fib(n)+1; } int main(){ return w(10); }'
+assert 5 'int n0(int a){ return 0; } int main(){ int x=1; n0(x=5); return x; }'
+RVCC_FLAGS=-O1\ -fir-backend
+assert 140 'int h(int a){ a=a*2; int b=a+1; return a*b; } int main(){ int s=0; int i; for (i=0;i<5;i=i+1) s=s+h(i); return s; }'
+assert 11 'int od(int n){ if (n==0) return 0; return ev(n-1); } int ev(int n){ if (n==0) return 1; return od(n-1); } int main(){ return ev(10)*10+od(7); }'
+RVCC_FLAGS=-finline-limit=1
+assert 111 'int big(int a, int b){ int c=a*b+a-b; int d=c*c-a; int e=d+c*b-a*a; c=c+d+e; d=d*3+e*5-c; return c+d*2+e*3; } int main(){ return big(3, 4)&255; }'
+RVCC_FLAGS=
+inline_test='int add2(int a, int b){ return a+b; } int main(){ return add2(3, 4); }'
+echo "$inline_test" | $build/rvcc -O1 -fno-verbose-asm -o $build/tmp.s - || exit
+if grep -qE '^\s+(call|tail) add2' $build/tmp.s; then
+    echo "inline: add2 called with -O1"
+    exit 1
+fi
+echo "$inline_test" | $build/rvcc -O1 -finline-limit=0 -fno-verbose-asm -o $build/tmp.s - || exit
+if ! grep -qE '^\s+(call|tail) add2' $build/tmp.s; then
+    echo "inline: add2 inlined with -finline-limit=0"
+    exit 1
+fi
+echo "inline: => ok"
+
+# return f(...) jumps to f with -O1, a million levels deep overflow the simulator's stack
+# otherwise
+RVCC_FLAGS=-O1\ -finline-limit=0
+assert 32 'int sum(int n, int acc){ if (n==0) return acc; return sum(n-1, acc+n); } int main(){ return sum(1000000, 0)&255; }'
+assert 11 'int od(int n){ if (n==0) return 0; return ev(n-1); } int ev(int n){ if (n==0) return 1; return od(n-1); } int main(){ return ev(1000000)*10+od(700001); }'
+assert 41 'int g(int *p){ return *p+1; } int h(int x){ int y=x*2; return g(&y); } int main(){ return h(20); }'
+assert 247 'int f6(int a, int b, int c, int d, int e, int f){ if (a<=0) return b+c+d+e+f; return f6(a-1, c, d, e, f, b+1); } int main(){ return f6(1000, 1, 2, 3, 4, 5)&255; }'
+RVCC_FLAGS=-O1\ -fir-backend\ -finline-limit=0
+assert 32 'int sum(int n, int acc){ if (n==0) return acc; return sum(n-1, acc+n); } int main(){ return sum(1000000, 0)&255; }'
+assert 11 'int od(int n){ if (n==0) return 0; return ev(n-1); } int ev(int n){ if (n==0) return 1; return od(n-1); } int main(){ return ev(1000000)*10+od(700001); }'
+assert 41 'int g(int *p){ return *p+1; } int h(int x){ int y=x*2; return g(&y); } int main(){ return h(20); }'
+RVCC_FLAGS=
+for flags in "-O1" "-O1 -fir-backend"; do
+    echo 'int f(int n){ if (n) return g(n-1); return f(n+1); }' |
+        $build/rvcc $flags -fno-verbose-asm -o $build/tmp.s - || exit
+    # no call left, so ra is not saved either
+    if grep -qw "call\|ra" $build/tmp.s || ! grep -q "tail g" $build/tmp.s; then
+        echo "tail-call $flags: return g() called"
+        exit 1
+    fi
+done
+echo "tail-call: => ok"
+
+# reports go to stderr and leave the code alone
+RVCC_FLAGS=-ftime-report\ -fmem-report\ -freport-format=json
+assert 5 'int main(){ int x=2; if (x) x=x+3; return x; }'
+RVCC_FLAGS=
+
+# functions generated on several threads
+RVCC_FLAGS=-fcodegen-threads=4
+assert 55 'int f(int n){ int s=0; while (n) { s=s+n; n=n-1; } return s; } int g(int n){ if (n>5) return f(n); return 0; } int main(){ return g(10); }'
+RVCC_FLAGS=-O1\ -fir-backend\ -fcodegen-threads=3
+assert 89 'int fib(int n){ if (n<2) return 1; return fib(n-1)+fib(n-2); } int id(int x){ return x; } int main(){ return id(fib(10)); }'
+RVCC_FLAGS=
+
+# multiply, divide and remainder by constants against the instructions, over edge cases
+int_min='(-2147483647-1)'
+consts="1 -1 2 -2 3 -3 5 6 7 -7 9 10 -10 12 24 25 -31 60 100 255 641 1000 4096 -4096 65536 65537
+    1048575 1234567 -1234567 1073741824 -1073741824 1431655765 2147483646 2147483647 $int_min"
+xs="0 1 -1 2 -2 3 -3 7 -7 100 -100 641 4096 -4097 65535 65536 -65536 123456789 -123456789
+    1073741823 1073741824 -1073741824 -1073741825 1431655765 -1431655766 2147483600
+    -2147483600 2147483646 2147483647 -2147483647 $int_min"
+sweep() {
+    echo 'int mul(int a, int b){ return a*b; } int div(int a, int b){ return a/b; }'
+    echo 'int mod(int a, int b){ return a%b; }'
+    echo 'int x(int i){'
+    i=0
+    for x in $xs; do
+        echo "if (i==$i) return $x;"
+        i=$((i+1))
+    done
+    echo 'return 0; }'
+    echo "int check(int v){ int bad=0; int i; for (i=0;i<$i;i=i+1) {"
+    for c in $consts; do
+        echo "if (x(i)*$c != mul(x(i), $c)) bad=bad+1;"
+        echo "if (x(i)/$c != div(x(i), $c)) bad=bad+1;"
+        echo "if (x(i)%$c != mod(x(i), $c)) bad=bad+1;"
+    done
+    echo '} return bad; }'
+    echo 'int main(){ if (check(0)) return 1; return 0; }'
+}
+sweep > $build/sweep.c
+# mul, div and mod must stay calls, inlined they would check the code against itself
+for flags in "" "-O1 -finline-limit=0" "-O1 -fir-backend -finline-limit=0"; do
+    $build/rvcc $flags -o $build/sweep.s $build/sweep.c || exit
+    $build/rvcc-sim $build/sweep.s
+    actual="$?"
+    if [ "$actual" != 0 ]; then
+        echo "constant sweep $flags: => 0 expected, bug got $actual"
+        exit 1
+    fi
+    echo "constant sweep $flags: => $actual"
+done
+
+# several files at once, a failing one does not stop the others
+multi=$build/multi
+rm -rf $multi && mkdir -p $multi
+echo 'int main(){ return 11; }' > $multi/a.c
+echo 'int main(){ return 1 +; }' > $multi/bad.c
+echo 'int f(int x){ return x*2; } int main(){ return f(11); }' > $multi/b.c
+if (cd $multi && ../rvcc -j 3 a.c bad.c b.c 2> /dev/null); then
+    echo "multi-file: error in bad.c not reported"
+    exit 1
+fi
+if [ -e $multi/bad.s ]; then
+    echo "multi-file: bad.s left behind"
+    exit 1
+fi
+for f in a:11 b:22; do
+    $build/rvcc-sim $multi/${f%:*}.s
+    actual="$?"
+    if [ "${f#*:}" != "$actual" ]; then
+        echo "multi-file: ${f%:*}.s => ${f#*:} expected, bug got $actual"
+        exit 1
+    fi
+    echo "multi-file: ${f%:*}.s => $actual"
+done
+
+# batch mode answers every request, a bad program included
+request() {
+    printf '%d\n%s' ${#1} "$1"
+}
+{
+    request 'int main(){ return 1 +; }'
+    request 'int f(int x){ return x+1; } int main(){ return f(8); }'
+} | $build/rvcc --batch > $multi/batch.out || exit
+{
+    read -r status len diag_len
+    head -c $diag_len > /dev/null
+    if [ "$status $len" != "error 0" ]; then
+        echo "batch: bad program => $status $len"
+        exit 1
+    fi
+    read -r status len diag_len
+    head -c $len > $multi/batch.s
+} < $multi/batch.out
+$build/rvcc-sim $multi/batch.s
+actual="$?"
+if [ "$status $actual" != "ok 9" ]; then
+    echo "batch: => ok 9 expected, bug got $status $actual"
+    exit 1
+fi
+echo "batch: => $actual"
+
+# function cache, only changed functions are generated again
+cache=$multi/cache
+echo 'int f(int x){ return x*3; } int main(){ return f(4)+1; }' > $multi/c.c
+$build/rvcc -O1 --cache-dir $cache -o $multi/c1.s $multi/c.c || exit
+$build/rvcc -O1 --cache-dir $cache -o $multi/c2.s $multi/c.c || exit
+# the cache compiles functions one by one and inlines nothing
+$build/rvcc -O1 -finline-limit=0 -o $multi/c3.s $multi/c.c || exit
+if ! cmp -s $multi/c1.s $multi/c3.s || ! cmp -s $multi/c2.s $multi/c3.s; then
+    echo "cache: code differs from an uncached compilation"
+    exit 1
+fi
+echo 'int f(int x){ return x*3; }
+int main(){ return f(5)+1; }' > $multi/c.c
+$build/rvcc -O1 --cache-dir $cache -o $multi/c1.s $multi/c.c || exit
+entries=$(ls $cache | wc -l)
+$build/rvcc-sim $multi/c1.s
+actual="$?"
+if [ "$entries $actual" != "3 16" ]; then
+    echo "cache: => 3 entries and 16 expected, bug got $entries entries and $actual"
+    exit 1
+fi
+echo "cache: => $actual"
+
 echo OK
\ No newline at end of file